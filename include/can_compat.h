@@ -22,6 +22,37 @@ typedef __u32 canid_t;
 
 typedef __u32 can_err_mask_t;
 
+/* error class (mask) in can_id of error frames */
+#define CAN_ERR_DLC 8 /* dlc for error message frames */
+
+#define CAN_ERR_LOSTARB 0x00000002U  /* lost arbitration    / data[0]    */
+#define CAN_ERR_CRTL 0x00000004U     /* controller problems / data[1]    */
+#define CAN_ERR_PROT 0x00000008U     /* protocol violations / data[2..3] */
+#define CAN_ERR_ACK 0x00000020U      /* received no ACK on transmission */
+#define CAN_ERR_BUSOFF 0x00000040U   /* bus off */
+#define CAN_ERR_BUSERROR 0x00000080U /* bus error (may flood!) */
+#define CAN_ERR_CNT 0x00000200U      /* TX error counter / data[6] */
+
+/* error status of CAN-controller / data[1] */
+#define CAN_ERR_CRTL_RX_OVERFLOW 0x01 /* RX buffer overflow */
+#define CAN_ERR_CRTL_RX_WARNING 0x04  /* reached warning level for RX errors */
+#define CAN_ERR_CRTL_TX_WARNING 0x08  /* reached warning level for TX errors */
+#define CAN_ERR_CRTL_RX_PASSIVE 0x10  /* reached error passive status RX */
+#define CAN_ERR_CRTL_TX_PASSIVE 0x20  /* reached error passive status TX */
+#define CAN_ERR_CRTL_ACTIVE 0x40      /* recovered to error active state */
+
+/* error in CAN protocol (type) / data[2] */
+#define CAN_ERR_PROT_UNSPEC 0x00 /* unspecified */
+#define CAN_ERR_PROT_FORM 0x02   /* frame format error */
+#define CAN_ERR_PROT_STUFF 0x04  /* bit stuffing error */
+#define CAN_ERR_PROT_BIT0 0x08   /* unable to send dominant bit */
+#define CAN_ERR_PROT_BIT1 0x10   /* unable to send recessive bit */
+
+/* error in CAN protocol (location) / data[3] */
+#define CAN_ERR_PROT_LOC_UNSPEC 0x00  /* unspecified */
+#define CAN_ERR_PROT_LOC_CRC_SEQ 0x08 /* CRC sequence */
+#define CAN_ERR_PROT_LOC_ACK 0x19     /* ACK slot */
+
 struct can_frame {
     canid_t can_id; /* 32 bit CAN_ID + EFF/RTR/ERR flags */
     __u8 can_dlc;   /* frame payload length in byte (0 .. CAN_MAX_DLEN) */
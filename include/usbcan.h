@@ -20,6 +20,7 @@
 
 #ifdef __linux__
 #include <linux/can.h>
+#include <linux/can/error.h>
 #else
 #include "can_compat.h"
 #endif
@@ -27,7 +28,9 @@
 #define CAN1 0
 #define CAN2 1
 
-const uint32_t CAN_SPEEDS[33][4] = {
+#define MAX_BUSES 2
+
+static const uint32_t CAN_SPEEDS[33][4] = {
     // CAN_BRP, CAN_BS1, CAN_BS2, CAN_SJW
 
     // The first 9 achieve a duration of ~16 bit times at each speed
@@ -107,29 +110,127 @@ const uint32_t CAN_SPEEDS[33][4] = {
 
 #define MAX_FILTERS 14
 
+#define USBCAN_FLAG_POLL 0x00000001
+#define USBCAN_FLAG_QUEUE 0x00000002
+#define USBCAN_FLAG_CHANGES_ONLY 0x00000004
+#define USBCAN_FLAG_LAST_VALUE 0x00000008
+#define USBCAN_FLAG_ERRORS 0x00000010
+#define USBCAN_FLAG_ADAPTIVE 0x00000020
+#define USBCAN_FLAG_SILENT 0x00000040
+#define USBCAN_FLAG_RETAIN 0x00000080
+#define USBCAN_FLAG_SOA 0x00000100
+#define USBCAN_FLAG_WORKER 0x00000200
+
+#define USBCAN_QUEUE_LEN 4096
+#define USBCAN_ERROR_INTERVAL_MS 100
+#define USBCAN_BATCH_MAX 1024
+#define USBCAN_POOL_BATCHES 64
+#define USBCAN_TRACE_EVENTS 65536
+
+// usbcan_bus_config.overload
+#define USBCAN_OVERLOAD_NONE 0 // call back on the driver's thread
+#define USBCAN_OVERLOAD_BLOCK 1
+#define USBCAN_OVERLOAD_DROP_OLDEST 2
+#define USBCAN_OVERLOAD_DROP_NEWEST 3
+#define USBCAN_OVERLOAD_KEEP_LATEST 4
+
 struct usbcan_msg {
     uint32_t timestamp;
     struct can_frame frame;
 };
 
+struct usbcan_bus_msg {
+    uint32_t dev;
+    uint32_t bus;
+    struct usbcan_msg msg;
+};
+
+struct usbcan_batch;
+
+#define USBCAN_SOA_EFF 0x01
+#define USBCAN_SOA_RTR 0x02
+#define USBCAN_SOA_ERR 0x04
+
+struct usbcan_soa {
+    uint32_t *ids;
+    uint8_t *flags;
+    uint8_t *dlc;
+    uint64_t *timestamps;
+    uint64_t *data;
+    uint32_t n;
+};
+
 typedef void (*usbcan_cb)(uint32_t dev, uint32_t bus, struct usbcan_msg *msgs,
                           uint32_t n, void *arg);
+typedef void (*usbcan_soa_cb)(uint32_t dev, uint32_t bus,
+                              const struct usbcan_soa *batch, void *arg);
 
 struct usbcan_bus_config {
     uint32_t speed;
     struct can_filter *filters;
     uint8_t num_filters;
+    uint32_t flags;
+    uint32_t queue_len;
+    struct can_filter change_filter;
+    uint32_t heartbeat_ms;
+    uint32_t error_interval_ms;
+    uint32_t batch_min;
+    uint32_t batch_max;
+    uint32_t hold_us;
+    uint32_t pool_batches;
+    uint32_t overload;
+    uint32_t overload_len;
+    uint32_t workers;
+    uint64_t worker_cpus;
+    int32_t worker_priority;
     usbcan_cb cb;
+    usbcan_soa_cb soa_cb;
     void *arg;
 };
 
+struct usbcan_dev_info {
+    char product[33];
+    char serial[25];
+    uint8_t firmware[4];
+    uint8_t hardware[4];
+};
+
+struct usbcan_bus_init {
+    const char *serial;
+    uint32_t dev;
+    uint32_t bus;
+    struct usbcan_bus_config *config;
+    bool status;
+};
+
+struct usbcan_bus_stats {
+    uint64_t received;
+    uint64_t delivered;
+    uint64_t suppressed;
+    uint64_t dropped;
+    uint64_t overflows;
+    uint64_t lost;
+    uint64_t errors;
+    uint64_t exhausted;
+    uint64_t evicted;
+    uint64_t rejected;
+    uint64_t replaced;
+    uint64_t stalls;
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
     bool usbcan_library_init();
     bool usbcan_library_close();
 
+    uint32_t usbcan_num_devs();
+    bool usbcan_get_dev_info(uint32_t dev, struct usbcan_dev_info *info);
+    bool usbcan_find_dev(const char *serial, uint32_t *dev);
+    bool usbcan_init_all(struct usbcan_bus_init *inits, uint32_t n);
+
     bool usbcan_init(uint32_t dev, uint32_t bus, struct usbcan_bus_config *config);
+    bool usbcan_autobaud(uint32_t dev, uint32_t bus, uint32_t *speed);
     bool usbcan_start(uint32_t dev, uint32_t bus);
     bool usbcan_reset(uint32_t dev, uint32_t bus);
     bool usbcan_stop(uint32_t dev, uint32_t bus);
@@ -137,13 +238,31 @@ extern "C" {
     uint32_t usbcan_send(uint32_t dev, uint32_t bus, struct can_frame *frame);
     uint32_t usbcan_send_n(uint32_t dev, uint32_t bus, struct can_frame *frames,
                            uint32_t len);
+    uint32_t usbcan_poll(uint32_t dev_mask, struct usbcan_bus_msg *msgs,
+                         uint32_t max);
+    int usbcan_event_fd(uint32_t dev, uint32_t bus);
+    uint32_t usbcan_drain(uint32_t dev, uint32_t bus, struct usbcan_msg *msgs,
+                          uint32_t max);
+    bool usbcan_get_stats(uint32_t dev, uint32_t bus,
+                          struct usbcan_bus_stats *stats);
+    bool usbcan_sample_errors(uint32_t dev, uint32_t bus);
+    bool usbcan_get_latest(uint32_t dev, uint32_t bus, canid_t can_id,
+                           struct usbcan_msg *msg);
+    uint32_t usbcan_snapshot_latest(uint32_t dev, uint32_t bus,
+                                    struct usbcan_msg *msgs, uint32_t max);
 
     bool usbcan_set_filters(uint32_t dev, uint32_t bus, struct can_filter *filters,
                             uint8_t num_filters);
     bool usbcan_clear_filters(uint32_t dev, uint32_t bus);
+    struct usbcan_batch *usbcan_retain(uint32_t dev, uint32_t bus,
+                                       struct usbcan_msg *msgs);
+    void usbcan_release(struct usbcan_batch *batch);
     bool usbcan_register_callback(uint32_t dev, uint32_t bus, usbcan_cb callback,
                                   void *arg);
     bool usbcan_deregister_callback(uint32_t dev, uint32_t bus);
+
+    bool usbcan_trace_start(uint32_t events);
+    bool usbcan_trace_stop(const char *path);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,377 @@
+/*
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#pragma once
+
+// Header-only C++20 coroutine layer over usbcan.h.
+//
+// A usbcan::bus constructed without an executor resumes the coroutine
+// awaiting receive_batch() directly from the dispatcher, on the driver
+// thread, with a copy of the dispatcher's batch. A bus constructed with a
+// usbcan::executor is initialized with USBCAN_FLAG_QUEUE and its waiters
+// are resumed from executor::run(), which multiplexes any number of
+// buses and timers on one thread.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "usbcan.h"
+
+namespace usbcan {
+
+using clock = std::chrono::steady_clock;
+
+class bus;
+
+// Received messages for one bus. Valid until the coroutine that received
+// it next awaits on the same bus.
+class batch {
+  public:
+    batch() = default;
+    batch(const usbcan_msg *msgs, uint32_t n) : msgs_(msgs), n_(n) {}
+
+    const usbcan_msg *begin() const { return msgs_; }
+    const usbcan_msg *end() const { return msgs_ + n_; }
+    const usbcan_msg &operator[](uint32_t i) const { return msgs_[i]; }
+    uint32_t size() const { return n_; }
+    bool empty() const { return n_ == 0; }
+
+  private:
+    const usbcan_msg *msgs_ = nullptr;
+    uint32_t n_ = 0;
+};
+
+// Fire-and-forget coroutine: starts eagerly, frees itself when done.
+struct task {
+    struct promise_type {
+        task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+class executor {
+  public:
+    executor() {
+        if (::pipe(wake_) != 0) {
+            throw std::runtime_error("usbcan::executor: pipe failed");
+        }
+        for (int fd : wake_) {
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+    }
+
+    ~executor() {
+        ::close(wake_[0]);
+        ::close(wake_[1]);
+    }
+
+    executor(const executor &) = delete;
+    executor &operator=(const executor &) = delete;
+
+    // Runs until stop() is called or no coroutine is waiting on a bus or
+    // timer of this executor.
+    void run();
+
+    // May be called from any thread.
+    void stop() {
+        stopped_ = true;
+        uint8_t one = 1;
+        [[maybe_unused]] ssize_t written = ::write(wake_[1], &one, 1);
+    }
+
+    auto sleep_for(clock::duration d) {
+        struct awaitable {
+            executor &ex;
+            clock::time_point deadline;
+
+            bool await_ready() const { return clock::now() >= deadline; }
+            void await_suspend(std::coroutine_handle<> h) {
+                ex.add_timer(deadline, h, nullptr);
+            }
+            void await_resume() const {}
+        };
+        return awaitable{*this, clock::now() + d};
+    }
+
+  private:
+    friend class bus;
+
+    struct timer {
+        clock::time_point deadline;
+        std::coroutine_handle<> h;
+        bus *b;
+    };
+
+    void add_timer(clock::time_point deadline, std::coroutine_handle<> h,
+                   bus *b) {
+        timers_.push_back({deadline, h, b});
+    }
+
+    void cancel_timers(bus *b) {
+        std::erase_if(timers_, [b](const timer &t) { return t.b == b; });
+    }
+
+    std::vector<bus *> buses_;
+    std::vector<timer> timers_;
+    int wake_[2];
+    std::atomic<bool> stopped_{false};
+};
+
+class bus {
+  public:
+    // Waiters resume on the driver thread, inside the dispatcher. Timed
+    // receives are not available.
+    bus(uint32_t dev, uint32_t bus, usbcan_bus_config config)
+        : dev_(dev), bus_(bus) {
+        config.flags &= ~(USBCAN_FLAG_POLL | USBCAN_FLAG_QUEUE);
+        config.cb = &bus::dispatch;
+        config.arg = this;
+        if (!usbcan_init(dev, bus, &config)) {
+            throw std::runtime_error("usbcan::bus: usbcan_init failed");
+        }
+    }
+
+    // Waiters resume on the thread running ex.run().
+    bus(executor &ex, uint32_t dev, uint32_t bus, usbcan_bus_config config)
+        : dev_(dev), bus_(bus), ex_(&ex) {
+        config.flags = (config.flags & ~USBCAN_FLAG_POLL) | USBCAN_FLAG_QUEUE;
+        config.cb = nullptr;
+        if (!usbcan_init(dev, bus, &config)) {
+            throw std::runtime_error("usbcan::bus: usbcan_init failed");
+        }
+        fd_ = usbcan_event_fd(dev, bus);
+        buf_.resize(config.queue_len > 0 ? config.queue_len : USBCAN_QUEUE_LEN);
+        ex_->buses_.push_back(this);
+    }
+
+    // usbcan_stop waits for the bus's callback to return, so a bus must
+    // not be destroyed by a coroutine its own callback resumed; that would
+    // wait for itself forever, and terminates instead.
+    ~bus() {
+        if (dispatching_ == this) {
+            std::terminate();
+        }
+        usbcan_stop(dev_, bus_);
+        if (ex_ != nullptr) {
+            ex_->cancel_timers(this);
+            std::erase(ex_->buses_, this);
+        }
+    }
+
+    bus(const bus &) = delete;
+    bus &operator=(const bus &) = delete;
+
+    bool start() { return usbcan_start(dev_, bus_); }
+
+    auto receive_batch() { return receive_awaitable{*this, std::nullopt}; }
+
+    // Resumes with an empty batch if nothing arrives within timeout.
+    auto receive_batch(clock::duration timeout) {
+        if (ex_ == nullptr) {
+            throw std::logic_error("usbcan::bus: timed receive needs an executor");
+        }
+        return receive_awaitable{*this, clock::now() + timeout};
+    }
+
+    // usbcan_send_n is synchronous, so this completes without suspending
+    // and yields the number of frames sent.
+    auto send(std::span<const can_frame> frames) {
+        struct awaitable {
+            uint32_t sent;
+
+            bool await_ready() const { return true; }
+            void await_suspend(std::coroutine_handle<>) const {}
+            uint32_t await_resume() const { return sent; }
+        };
+        return awaitable{usbcan_send_n(dev_, bus_,
+                                       const_cast<can_frame *>(frames.data()),
+                                       static_cast<uint32_t>(frames.size()))};
+    }
+
+  private:
+    friend class executor;
+
+    struct receive_awaitable {
+        class bus &b;
+        std::optional<clock::time_point> deadline;
+
+        bool await_ready() { return b.take(); }
+        bool await_suspend(std::coroutine_handle<> h) {
+            return b.wait(h, deadline);
+        }
+        batch await_resume() { return b.current_; }
+    };
+
+    static void dispatch(uint32_t, uint32_t, usbcan_msg *msgs, uint32_t n,
+                         void *arg) {
+        bus *b = static_cast<bus *>(arg);
+        std::unique_lock<std::mutex> lock(b->lock_);
+        if (b->waiter_) {
+            std::coroutine_handle<> h = std::exchange(b->waiter_, nullptr);
+            // The dispatcher reuses msgs as soon as this returns, while the
+            // coroutine may keep the batch across other suspensions.
+            b->buf_.assign(msgs, msgs + n);
+            b->current_ = batch(b->buf_.data(), n);
+            lock.unlock();
+            bus *outer = std::exchange(dispatching_, b);
+            h.resume();
+            dispatching_ = outer;
+        } else {
+            b->pending_.insert(b->pending_.end(), msgs, msgs + n);
+        }
+    }
+
+    // Claims already received messages, if any, as current_.
+    bool take() {
+        if (ex_ != nullptr) {
+            uint32_t n = usbcan_drain(dev_, bus_, buf_.data(),
+                                      static_cast<uint32_t>(buf_.size()));
+            current_ = batch(buf_.data(), n);
+            return n > 0;
+        }
+
+        std::lock_guard<std::mutex> lock(lock_);
+        if (pending_.empty()) {
+            return false;
+        }
+        buf_.swap(pending_);
+        pending_.clear();
+        current_ = batch(buf_.data(), static_cast<uint32_t>(buf_.size()));
+        return true;
+    }
+
+    bool wait(std::coroutine_handle<> h,
+              std::optional<clock::time_point> deadline) {
+        if (ex_ != nullptr) {
+            waiter_ = h;
+            if (deadline) {
+                ex_->add_timer(*deadline, h, this);
+            }
+            return true;
+        }
+
+        std::lock_guard<std::mutex> lock(lock_);
+        if (!pending_.empty()) {
+            buf_.swap(pending_);
+            pending_.clear();
+            current_ = batch(buf_.data(), static_cast<uint32_t>(buf_.size()));
+            return false;
+        }
+        waiter_ = h;
+        return true;
+    }
+
+    static inline thread_local bus *dispatching_ = nullptr;
+
+    uint32_t dev_;
+    uint32_t bus_;
+    executor *ex_ = nullptr;
+    int fd_ = -1;
+
+    std::mutex lock_;
+    std::coroutine_handle<> waiter_;
+    batch current_;
+    std::vector<usbcan_msg> pending_;
+    std::vector<usbcan_msg> buf_;
+};
+
+inline void executor::run() {
+    std::vector<pollfd> fds;
+    std::vector<bus *> polled;
+    std::vector<std::coroutine_handle<>> ready;
+
+    while (!stopped_) {
+        fds.assign(1, pollfd{wake_[0], POLLIN, 0});
+        polled.clear();
+        for (bus *b : buses_) {
+            if (b->waiter_) {
+                fds.push_back(pollfd{b->fd_, POLLIN, 0});
+                polled.push_back(b);
+            }
+        }
+
+        if (polled.empty() && timers_.empty()) {
+            return;
+        }
+
+        int timeout = -1;
+        if (!timers_.empty()) {
+            auto next = std::min_element(
+                timers_.begin(), timers_.end(),
+                [](const timer &a, const timer &b) {
+                    return a.deadline < b.deadline;
+                })->deadline;
+            auto wait = std::chrono::ceil<std::chrono::milliseconds>(
+                next - clock::now());
+            timeout = static_cast<int>(std::max<int64_t>(wait.count(), 0));
+        }
+
+        if (::poll(fds.data(), fds.size(), timeout) < 0) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            uint8_t buf[64];
+            while (::read(wake_[0], buf, sizeof(buf)) > 0) {
+            }
+        }
+
+        ready.clear();
+        for (size_t i = 0; i < polled.size(); i++) {
+            bus *b = polled[i];
+            if ((fds[i + 1].revents & POLLIN) && b->take()) {
+                cancel_timers(b);
+                ready.push_back(std::exchange(b->waiter_, nullptr));
+            }
+        }
+
+        auto now = clock::now();
+        for (auto t = timers_.begin(); t != timers_.end();) {
+            if (t->deadline > now) {
+                t++;
+                continue;
+            }
+            if (t->b != nullptr) {
+                t->b->waiter_ = nullptr;
+                t->b->current_ = batch();
+            }
+            ready.push_back(t->h);
+            t = timers_.erase(t);
+        }
+
+        for (std::coroutine_handle<> h : ready) {
+            h.resume();
+        }
+    }
+}
+
+} // namespace usbcan
@@ -0,0 +1,87 @@
+/*
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "usbcan.h"
+
+#define USBCAN_CAPTURE_BLOCK_FRAMES 4096
+
+// usbcan_capture_open flags
+#define USBCAN_CAPTURE_COMPACT 0x1 // delta-encode blocks
+
+struct usbcan_capture;
+struct usbcan_capture_reader;
+struct usbcan_capture_cursor;
+
+struct usbcan_capture_rec {
+    uint64_t time_us; // host wall clock when written
+    uint8_t dev;
+    uint8_t bus;
+    uint16_t reserved;
+    uint32_t timestamp; // adapter timestamp
+    struct can_frame frame;
+};
+
+struct usbcan_capture_query {
+    canid_t can_id;
+    canid_t can_mask;
+    uint64_t from_us;
+    uint64_t to_us;
+};
+
+struct usbcan_capture_info {
+    uint64_t start_us;
+    uint64_t end_us;
+    uint64_t frames;
+    uint64_t blocks;
+    uint32_t block_frames;
+    bool indexed;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+    struct usbcan_capture *usbcan_capture_open(const char *path,
+                                               uint32_t block_frames,
+                                               uint32_t flags);
+    bool usbcan_capture_write(struct usbcan_capture *cap, uint32_t dev,
+                              uint32_t bus, const struct usbcan_msg *msgs,
+                              uint32_t n);
+    bool usbcan_capture_close(struct usbcan_capture *cap);
+
+    struct usbcan_capture_reader *usbcan_capture_map(const char *path);
+    void usbcan_capture_unmap(struct usbcan_capture_reader *reader);
+    void usbcan_capture_info(const struct usbcan_capture_reader *reader,
+                             struct usbcan_capture_info *info);
+
+    uint32_t usbcan_capture_read_block(
+        const struct usbcan_capture_reader *reader, uint64_t block,
+        struct usbcan_capture_rec *recs);
+
+    struct usbcan_capture_cursor *
+    usbcan_capture_query(const struct usbcan_capture_reader *reader,
+                         const struct usbcan_capture_query *query);
+    const struct usbcan_capture_rec *
+    usbcan_capture_next(struct usbcan_capture_cursor *cursor);
+    uint64_t
+    usbcan_capture_blocks_read(const struct usbcan_capture_cursor *cursor);
+    void usbcan_capture_cursor_free(struct usbcan_capture_cursor *cursor);
+#ifdef __cplusplus
+}
+#endif
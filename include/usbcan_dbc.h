@@ -0,0 +1,54 @@
+/*
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "usbcan.h"
+
+struct usbcan_dbc;
+
+// Columnar decode output. The caller owns the three arrays, each of
+// which holds cap entries; n is the number of entries filled so far.
+struct usbcan_dbc_values {
+    uint32_t *signals;
+    uint32_t *timestamps;
+    double *values;
+    uint32_t n;
+    uint32_t cap;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+    struct usbcan_dbc *usbcan_dbc_load(const char *path);
+    void usbcan_dbc_free(struct usbcan_dbc *dbc);
+
+    uint32_t usbcan_dbc_num_signals(const struct usbcan_dbc *dbc);
+    int32_t usbcan_dbc_find_signal(const struct usbcan_dbc *dbc,
+                                   const char *name);
+    const char *usbcan_dbc_signal_name(const struct usbcan_dbc *dbc,
+                                       uint32_t signal);
+    canid_t usbcan_dbc_signal_can_id(const struct usbcan_dbc *dbc,
+                                     uint32_t signal);
+
+    uint32_t usbcan_dbc_decode(const struct usbcan_dbc *dbc,
+                               const struct usbcan_msg *msgs, uint32_t n,
+                               struct usbcan_dbc_values *out);
+#ifdef __cplusplus
+}
+#endif
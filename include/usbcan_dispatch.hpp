@@ -0,0 +1,299 @@
+/*
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#pragma once
+
+// Header-only C++20 per-ID handler dispatch, resolved at compile time.
+//
+//     auto d = usbcan::make_dispatcher(
+//         usbcan::on<0x7FD>([](const usbcan_msg &m) { ... }),
+//         usbcan::on_range<0x100, 0x1FF>([](const usbcan_msg &m) { ... }),
+//         usbcan::on<usbcan::eff(0x18FEF100)>([](const usbcan_msg &m) { ... }),
+//         usbcan::otherwise([](const usbcan_msg &m) { ... }));
+//
+//     config.cb = decltype(d)::callback;
+//     config.arg = &d;
+//
+// Standard IDs index a 2048 entry constexpr table, extended IDs declared
+// individually a constexpr perfect hash; either way each frame costs one
+// table lookup, and the handler index it yields selects the handler
+// through a fold the compiler turns into a switch, so every handler is
+// inlined into the batch loop. Extended ranges are checked in declaration
+// order only when the hash misses. Where declarations overlap the first
+// one wins. Error frames always go to the otherwise handler.
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <utility>
+
+#include "usbcan.h"
+
+namespace usbcan {
+
+constexpr canid_t eff(canid_t id) { return (id & CAN_EFF_MASK) | CAN_EFF_FLAG; }
+
+template <canid_t Lo, canid_t Hi, typename F>
+struct handler {
+    static_assert((Lo & CAN_EFF_FLAG) == (Hi & CAN_EFF_FLAG),
+                  "a range must not mix standard and extended IDs");
+    static_assert(Lo <= Hi, "empty ID range");
+    static_assert((Hi & CAN_EFF_FLAG) != 0 || Hi <= CAN_SFF_MASK,
+                  "standard IDs are 11 bits; wrap extended IDs in eff()");
+
+    static constexpr bool fallback = false;
+    static constexpr bool extended = (Lo & CAN_EFF_FLAG) != 0;
+    static constexpr canid_t lo = Lo & (extended ? CAN_EFF_MASK : CAN_SFF_MASK);
+    static constexpr canid_t hi = Hi & (extended ? CAN_EFF_MASK : CAN_SFF_MASK);
+
+    F f;
+};
+
+template <typename F>
+struct fallback_handler {
+    static constexpr bool fallback = true;
+    static constexpr bool extended = false;
+    static constexpr canid_t lo = 1;
+    static constexpr canid_t hi = 0;
+
+    F f;
+};
+
+template <canid_t Id, typename F>
+constexpr handler<Id, Id, F> on(F f) {
+    return {f};
+}
+
+template <canid_t Lo, canid_t Hi, typename F>
+constexpr handler<Lo, Hi, F> on_range(F f) {
+    return {f};
+}
+
+template <typename F>
+constexpr fallback_handler<F> otherwise(F f) {
+    return {f};
+}
+
+template <typename... Hs>
+class dispatcher {
+  public:
+    constexpr explicit dispatcher(Hs... hs) : handlers_(hs...) {}
+
+    void operator()(const usbcan_msg *msgs, uint32_t n) {
+        for (uint32_t i = 0; i < n; i++) {
+            invoke(index(msgs[i].frame.can_id), msgs[i],
+                   std::make_index_sequence<N>{});
+        }
+    }
+
+    // usbcan_cb adapter; pass the dispatcher as the callback's arg.
+    static void callback(uint32_t, uint32_t, usbcan_msg *msgs, uint32_t n,
+                         void *arg) {
+        (*static_cast<dispatcher *>(arg))(msgs, n);
+    }
+
+    static uint16_t index(canid_t can_id) {
+        if ((can_id & CAN_ERR_FLAG) != 0) {
+            return fallback;
+        }
+
+        if ((can_id & CAN_EFF_FLAG) == 0) {
+            return sff[can_id & CAN_SFF_MASK];
+        }
+
+        canid_t id = can_id & CAN_EFF_MASK;
+        const eff_slot &slot = eff_hash.slots[hash(id, eff_hash.seed)];
+        uint16_t i = slot.id == id ? slot.index : fallback;
+
+        if constexpr (num_eff_ranges > 0) {
+            if (i == fallback) {
+                i = eff_range_index(id);
+            }
+        }
+
+        return i;
+    }
+
+  private:
+    static constexpr size_t N = sizeof...(Hs);
+    static_assert(N < 0xFFFF, "too many handlers");
+
+    struct desc {
+        bool fallback;
+        bool extended;
+        canid_t lo;
+        canid_t hi;
+    };
+
+    static constexpr std::array<desc, N> descs = {
+        desc{Hs::fallback, Hs::extended, Hs::lo, Hs::hi}...};
+
+    // Index of the otherwise handler, or N for the no-op thunk.
+    static constexpr uint16_t fallback = [] {
+        for (size_t i = 0; i < N; i++) {
+            if (descs[i].fallback) {
+                return static_cast<uint16_t>(i);
+            }
+        }
+        return static_cast<uint16_t>(N);
+    }();
+
+    static constexpr std::array<uint16_t, CAN_SFF_MASK + 1> sff = [] {
+        std::array<uint16_t, CAN_SFF_MASK + 1> table{};
+        table.fill(fallback);
+        for (size_t i = N; i-- > 0;) {
+            const desc &d = descs[i];
+            if (!d.fallback && !d.extended) {
+                for (canid_t id = d.lo; id <= d.hi; id++) {
+                    table[id] = static_cast<uint16_t>(i);
+                }
+            }
+        }
+        return table;
+    }();
+
+    static constexpr size_t num_eff_ids = [] {
+        size_t n = 0;
+        for (const desc &d : descs) {
+            n += !d.fallback && d.extended && d.lo == d.hi;
+        }
+        return n;
+    }();
+
+    static constexpr size_t num_eff_ranges = [] {
+        size_t n = 0;
+        for (const desc &d : descs) {
+            n += !d.fallback && d.extended && d.lo != d.hi;
+        }
+        return n;
+    }();
+
+    // Multiplicative hash onto 2^bits slots.
+    static constexpr unsigned bits = [] {
+        unsigned b = 0;
+        while ((size_t(1) << b) < num_eff_ids) {
+            b++;
+        }
+        return b;
+    }() + 1;
+
+    static constexpr uint32_t hash(canid_t id, uint32_t seed) {
+        return static_cast<uint32_t>(id * seed) >> (32 - bits);
+    }
+
+    struct eff_slot {
+        canid_t id;
+        uint16_t index;
+    };
+
+    struct eff_table {
+        uint32_t seed;
+        std::array<eff_slot, size_t(1) << bits> slots;
+    };
+
+    // Whether an extended range declared before handler i covers its ID.
+    static constexpr bool shadowed(size_t i) {
+        for (size_t j = 0; j < i; j++) {
+            const desc &d = descs[j];
+            if (!d.fallback && d.extended && d.lo != d.hi &&
+                d.lo <= descs[i].lo && descs[i].lo <= d.hi) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Searches odd multipliers until the declared extended IDs map to
+    // distinct slots; IDs declared twice keep their first handler, and
+    // IDs an earlier range covers are left to the range.
+    static constexpr eff_table eff_hash = [] {
+        eff_table t{};
+        for (uint32_t seed = 0x9E3779B1; seed != 0x9E3779B1 + 2 * 65536;
+             seed += 2) {
+            t.seed = seed;
+            for (eff_slot &slot : t.slots) {
+                slot = {0xFFFFFFFF, fallback};
+            }
+
+            bool perfect = true;
+            for (size_t i = 0; i < N && perfect; i++) {
+                const desc &d = descs[i];
+                if (d.fallback || !d.extended || d.lo != d.hi ||
+                    shadowed(i)) {
+                    continue;
+                }
+
+                eff_slot &slot = t.slots[hash(d.lo, seed)];
+                if (slot.id == 0xFFFFFFFF) {
+                    slot = {d.lo, static_cast<uint16_t>(i)};
+                } else if (slot.id != d.lo) {
+                    perfect = false;
+                }
+            }
+
+            if (perfect) {
+                return t;
+            }
+        }
+        throw "no perfect hash for the declared extended IDs";
+    }();
+
+    struct eff_range {
+        canid_t lo;
+        canid_t hi;
+        uint16_t index;
+    };
+
+    // The extended ranges alone, in declaration order.
+    static constexpr std::array<eff_range, num_eff_ranges> eff_ranges = [] {
+        std::array<eff_range, num_eff_ranges> ranges{};
+        size_t n = 0;
+        for (size_t i = 0; i < N; i++) {
+            const desc &d = descs[i];
+            if (!d.fallback && d.extended && d.lo != d.hi) {
+                ranges[n++] = {d.lo, d.hi, static_cast<uint16_t>(i)};
+            }
+        }
+        return ranges;
+    }();
+
+    static uint16_t eff_range_index(canid_t id) {
+        for (const eff_range &r : eff_ranges) {
+            if (r.lo <= id && id <= r.hi) {
+                return r.index;
+            }
+        }
+        return fallback;
+    }
+
+    // Calls handler i, or nothing for N. The compiler sees every handler
+    // here, so it can inline them all and compile the chain of index
+    // tests as one switch.
+    template <size_t... I>
+    void invoke(uint16_t i, const usbcan_msg &msg, std::index_sequence<I...>) {
+        static_cast<void>(
+            ((i == I ? (std::get<I>(handlers_).f(msg), true) : false) || ...));
+    }
+
+    std::tuple<Hs...> handlers_;
+};
+
+template <typename... Hs>
+constexpr dispatcher<Hs...> make_dispatcher(Hs... hs) {
+    return dispatcher<Hs...>(hs...);
+}
+
+} // namespace usbcan
@@ -0,0 +1,54 @@
+/*
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "usbcan.h"
+
+#define USBCAN_ISOTP_MAX_LEN 4095
+
+struct usbcan_isotp;
+
+typedef void (*usbcan_isotp_cb)(struct usbcan_isotp *session,
+                                const uint8_t *data, uint32_t len, void *arg);
+
+struct usbcan_isotp_config {
+    canid_t tx_id;
+    canid_t rx_id;
+    uint8_t block_size;
+    uint8_t st_min;
+    bool pad;
+    uint8_t pad_byte;
+    uint32_t max_len;
+    uint32_t timeout_ms;
+    usbcan_isotp_cb cb;
+    void *arg;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+    struct usbcan_isotp *usbcan_isotp_open(uint32_t dev, uint32_t bus,
+                                           struct usbcan_isotp_config *config);
+    bool usbcan_isotp_close(struct usbcan_isotp *session);
+
+    bool usbcan_isotp_send(struct usbcan_isotp *session, const uint8_t *data,
+                           uint32_t len);
+#ifdef __cplusplus
+}
+#endif
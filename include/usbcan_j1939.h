@@ -0,0 +1,77 @@
+/*
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "usbcan.h"
+
+#define USBCAN_J1939_MAX_LEN 1785
+#define USBCAN_J1939_SESSIONS 32
+#define USBCAN_J1939_MAX_HANDLERS 1024
+
+#define USBCAN_J1939_NULL_ADDR 0xFE
+#define USBCAN_J1939_GLOBAL_ADDR 0xFF
+
+#define USBCAN_J1939_PGN_REQUEST 0xEA00
+#define USBCAN_J1939_PGN_ADDRESS_CLAIMED 0xEE00
+
+struct usbcan_j1939;
+
+struct usbcan_j1939_msg {
+    uint32_t pgn;
+    uint8_t priority;
+    uint8_t src;
+    uint8_t dst;
+    uint32_t timestamp;
+    uint32_t len;
+    const uint8_t *data;
+};
+
+typedef void (*usbcan_j1939_cb)(struct usbcan_j1939 *j1939,
+                                const struct usbcan_j1939_msg *msg,
+                                void *arg);
+
+struct usbcan_j1939_config {
+    uint64_t name;
+    uint8_t address;
+    uint32_t bam_gap_ms;
+    usbcan_j1939_cb cb;
+    void *arg;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+    struct usbcan_j1939 *usbcan_j1939_open(uint32_t dev, uint32_t bus,
+                                           struct usbcan_j1939_config *config);
+    void usbcan_j1939_close(struct usbcan_j1939 *j1939);
+
+    bool usbcan_j1939_on(struct usbcan_j1939 *j1939, uint32_t pgn,
+                         usbcan_j1939_cb cb, void *arg);
+    void usbcan_j1939_callback(uint32_t dev, uint32_t bus,
+                               struct usbcan_msg *msgs, uint32_t n, void *arg);
+
+    bool usbcan_j1939_claim(struct usbcan_j1939 *j1939);
+    uint8_t usbcan_j1939_address(struct usbcan_j1939 *j1939);
+
+    bool usbcan_j1939_send(struct usbcan_j1939 *j1939, uint32_t pgn,
+                           uint8_t priority, uint8_t dst, const uint8_t *data,
+                           uint32_t len);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,58 @@
+/*
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "usbcan.h"
+
+#define USBCAN_MERGE_WINDOW_US 10000
+
+struct usbcan_merge;
+
+typedef void (*usbcan_merge_cb)(struct usbcan_bus_msg *msgs, uint32_t n,
+                                void *arg);
+
+struct usbcan_merge_config {
+    uint32_t window_us; // reorder window
+    uint32_t tick_us;   // adapter timestamp period, 0 to order by arrival
+    uint32_t queue_len; // per bus
+    uint32_t batch_max;
+    usbcan_merge_cb cb;
+    void *arg;
+};
+
+struct usbcan_merge_stats {
+    uint64_t received;
+    uint64_t delivered;
+    uint64_t dropped;
+    uint64_t late;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+    struct usbcan_merge *usbcan_merge_open(struct usbcan_merge_config *config);
+    void usbcan_merge_close(struct usbcan_merge *merge);
+
+    void usbcan_merge_callback(uint32_t dev, uint32_t bus,
+                               struct usbcan_msg *msgs, uint32_t n, void *arg);
+    void usbcan_merge_get_stats(struct usbcan_merge *merge,
+                                struct usbcan_merge_stats *stats);
+#ifdef __cplusplus
+}
+#endif
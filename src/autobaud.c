@@ -0,0 +1,124 @@
+/*
+
+  autobaud.c -- bit rate detection in silent mode
+
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "usbcan.h"
+#include "ginkgo.h"
+#include "usbcan_internal.h"
+
+/*
+  Each candidate rate is tried with the controller in silent mode, so it
+  neither transmits nor acknowledges. At the wrong rate the controller
+  sees stuff and form errors within a few frames and the candidate is
+  dropped as soon as its receive error counter moves; at the right rate
+  frames pass their CRC. Candidates are ordered by how common they are
+  on vehicles, so on an active bus the search usually ends within the
+  first few tens of milliseconds.
+*/
+
+#define AUTOBAUD_POLL_US 2000
+#define AUTOBAUD_DWELL_US 50000
+#define AUTOBAUD_FRAME_BITS 130
+#define AUTOBAUD_FRAMES 2
+
+static const uint32_t AUTOBAUD_CANDIDATES[][2] = {
+    // speed, bits per second
+    {CAN_SPEED_500KBPS, 500000},       {CAN_SPEED_250KBPS, 250000},
+    {CAN_SPEED_125KBPS, 125000},       {CAN_SPEED_1000KBPS, 1000000},
+    {GINKGO_CAN_SPEED_800KBPS, 800000}, {CAN_SPEED_100KBPS, 100000},
+    {CAN_SPEED_83KBPS, 83333},         {CAN_SPEED_50KBPS, 50000},
+    {CAN_SPEED_20KBPS, 20000},         {CAN_SPEED_10KBPS, 10000},
+};
+
+// Listens at one rate and returns whether it carries valid frames.
+static bool autobaud_probe(uint32_t dev, uint32_t bus, uint32_t speed,
+                           uint32_t bps) {
+    if (!usbcan_init_can(dev, bus, speed, USBCAN_MODE_SILENT)) {
+        return false;
+    }
+
+    VCI_ERR_INFO info;
+    VCI_ClearBuffer(state.type, dev, bus);
+    VCI_ReadErrInfo(state.type, dev, bus, &info);
+    if (VCI_StartCAN(state.type, dev, bus) == STATUS_ERR) {
+        return false;
+    }
+
+    // Long enough for a few frames even at the slowest rates.
+    uint64_t dwell_us =
+        AUTOBAUD_DWELL_US + 4ULL * AUTOBAUD_FRAME_BITS * 1000000 / bps;
+    uint64_t deadline_us = usbcan_now_us() + dwell_us;
+    uint32_t frames = 0;
+    bool errors = false;
+    VCI_CAN_OBJ buf[16];
+
+    while (!errors && frames < AUTOBAUD_FRAMES) {
+        uint64_t now_us = usbcan_now_us();
+        if (now_us >= deadline_us) {
+            break;
+        }
+        usbcan_sleep_until(now_us + AUTOBAUD_POLL_US);
+
+        uint32_t n = VCI_GetReceiveNum(state.type, dev, bus);
+        if (n > 0 && n < 0xFFFFFFFF) {
+            n = VCI_Receive(state.type, dev, bus, buf, 16, 0);
+            if (n < 0xFFFFFFFF) {
+                frames += n;
+            }
+        }
+
+        VCI_CAN_STATUS status;
+        memset(&info, 0, sizeof(info));
+        memset(&status, 0, sizeof(status));
+        VCI_ReadErrInfo(state.type, dev, bus, &info);
+        VCI_ReadCANStatus(state.type, dev, bus, &status);
+
+        errors = status.regRECounter > 0 ||
+            (info.ErrCode & (ERR_CAN_BUSERR | ERR_CAN_ERRALARM |
+                             ERR_CAN_PASSIVE | ERR_CAN_BUSOFF)) > 0;
+    }
+
+    usbcan_filters_forget(dev, bus);
+    VCI_ResetCAN(state.type, dev, bus);
+    VCI_ClearBuffer(state.type, dev, bus);
+
+    return !errors && frames > 0;
+}
+
+bool usbcan_autobaud(uint32_t dev, uint32_t bus, uint32_t *speed) {
+    if (usbcan_get_bus(dev, bus) == NULL || !usbcan_dev_init(dev, false)) {
+        return false;
+    }
+
+    uint32_t num_candidates =
+        sizeof(AUTOBAUD_CANDIDATES) / sizeof(AUTOBAUD_CANDIDATES[0]);
+    for (uint32_t i = 0; i < num_candidates; i++) {
+        if (autobaud_probe(dev, bus, AUTOBAUD_CANDIDATES[i][0],
+                           AUTOBAUD_CANDIDATES[i][1])) {
+            *speed = AUTOBAUD_CANDIDATES[i][0];
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,984 @@
+/*
+
+  capture.c -- block-indexed capture files and an mmap reader
+
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "usbcan.h"
+#include "usbcan_capture.h"
+
+/*
+  A capture is a file header followed by blocks of up to block_frames
+  records, then an index. Each block header carries the block's time
+  range, the range of its ID keys and a 2048-bit Bloom filter of them,
+  so a file cut short by a crash is indexed again by walking the block
+  headers. The index at the end holds the same entries as two arrays,
+  fixed-size entries and then Bloom filters, so a query binary-searches
+  the entries by time and reads the filter of only those blocks in its
+  window; a block's records are touched only if its filter says the ID
+  may be there.
+
+  Record times come from the wall clock at open advanced by the
+  monotonic clock, so they never go backwards within a file and blocks
+  stay in time order.
+
+  The ID key is the CAN ID with its EFF flag, without RTR and ERR. All
+  fields are in host byte order.
+
+  A compact block holds the same records delta-encoded, and like a raw
+  block decodes on its own, so blocks can be decoded in any order or in
+  parallel. It starts with a dictionary of the (dev, bus, CAN ID) keys
+  in the block, sorted and stored as varint differences, followed by
+  each record as:
+
+    varint   microseconds since the previous record, or since min_us
+    index    into the dictionary, a byte if it has at most 256 keys and
+             a varint otherwise
+    byte     DLC in the low 4 bits, 15 meaning a DLC byte follows, and
+             CAPTURE_SAME if the payload equals the key's previous one
+    varint   adapter timestamp less the previous one from the same bus,
+             zigzag-encoded
+    byte     unless CAPTURE_SAME, a mask of the payload bytes that
+             changed, then each changed byte XORed with its old value
+
+  so a periodic frame whose payload did not change costs 4-6 bytes
+  against the 32 of a raw record. Previous payloads and timestamps
+  start at zero in each block. The block is padded to 8 bytes so the
+  next header stays aligned.
+*/
+
+#define CAPTURE_MAGIC "USBCAP01"
+#define CAPTURE_INDEX_MAGIC "USBCAPIX"
+#define CAPTURE_BLOCK_MAGIC 0x4B4C4255 // "UBLK"
+#define CAPTURE_VERSION 1
+#define CAPTURE_BLOOM_BITS 2048
+#define CAPTURE_BLOOM_BYTES (CAPTURE_BLOOM_BITS / 8)
+#define CAPTURE_ENCODING_RAW 0
+#define CAPTURE_ENCODING_DELTA 1
+#define CAPTURE_SAME 0x10
+#define CAPTURE_ALIGN(size) (((size) + 7) & ~(uint64_t)7)
+#define CAPTURE_KEY_MASK (CAN_EFF_FLAG | CAN_EFF_MASK)
+
+struct capture_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_frames;
+    uint64_t start_us;
+    uint8_t reserved[40];
+};
+
+struct capture_entry {
+    uint64_t offset; // of the block header
+    uint64_t min_us;
+    uint64_t max_us;
+    uint32_t n;
+    uint32_t size; // bytes following the block header
+    uint32_t encoding;
+    uint32_t min_key;
+    uint32_t max_key;
+    uint32_t reserved;
+};
+
+struct capture_block {
+    uint32_t magic;
+    uint32_t reserved;
+    struct capture_entry entry;
+    uint8_t bloom[CAPTURE_BLOOM_BYTES];
+};
+
+struct capture_trailer {
+    uint64_t entries_offset;
+    uint64_t blooms_offset;
+    uint64_t num_blocks;
+    char magic[8];
+};
+
+struct capture_slot {
+    uint64_t key;
+    uint32_t gen;
+    uint32_t index;
+};
+
+struct usbcan_capture {
+    pthread_mutex_t lock;
+    FILE *f;
+    uint32_t flags;
+    bool failed;
+    uint64_t offset;
+    uint64_t start_us;
+    uint64_t start_mono_us;
+    uint32_t block_frames;
+    struct usbcan_capture_rec *recs;
+    struct capture_block block;
+    struct capture_block *index;
+    uint64_t num_blocks;
+    uint64_t index_cap;
+
+    // Compact encoding state, sized by block_frames
+    uint8_t *enc;
+    uint64_t *dict;
+    uint32_t *sources;
+    uint32_t *timestamps;
+    uint64_t *data;
+    struct capture_slot *slots;
+    uint32_t slot_mask;
+    uint32_t gen;
+};
+
+struct usbcan_capture_reader {
+    int fd;
+    const uint8_t *base;
+    size_t size;
+    const struct capture_header *header;
+    const struct capture_entry *entries;
+    const uint8_t *blooms;
+    uint64_t num_blocks;
+    bool indexed;
+    void *owned; // entries and blooms rebuilt from block headers
+};
+
+struct usbcan_capture_cursor {
+    const struct usbcan_capture_reader *reader;
+    struct usbcan_capture_query query;
+    bool keyed;
+    uint32_t key;
+    uint64_t block;
+    struct usbcan_capture_rec *buf; // decoded compact block
+    const struct usbcan_capture_rec *recs;
+    uint32_t n;
+    uint32_t i;
+    uint64_t blocks_read;
+};
+
+static uint64_t capture_clock_us(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void capture_bloom_bits(uint32_t key, uint32_t bits[3]) {
+    uint64_t x = (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+    x ^= x >> 29;
+
+    bits[0] = x % CAPTURE_BLOOM_BITS;
+    bits[1] = (x >> 21) % CAPTURE_BLOOM_BITS;
+    bits[2] = (x >> 42) % CAPTURE_BLOOM_BITS;
+}
+
+static bool capture_bloom_test(const uint8_t *bloom, uint32_t key) {
+    uint32_t bits[3];
+    capture_bloom_bits(key, bits);
+
+    for (int i = 0; i < 3; i++) {
+        if ((bloom[bits[i] / 8] & (1 << (bits[i] % 8))) == 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static uint8_t *capture_put_varint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+
+    return p;
+}
+
+static const uint8_t *capture_get_varint(const uint8_t *p,
+                                         const uint8_t *end, uint64_t *v) {
+    uint64_t x = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        x |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            *v = x;
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+static uint64_t capture_dict_key(const struct usbcan_capture_rec *rec) {
+    return (uint64_t)rec->dev << 40 | (uint64_t)rec->bus << 32 |
+        rec->frame.can_id;
+}
+
+static int capture_key_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Finds the slot holding key in this block's table, or the empty slot
+// where it belongs.
+static struct capture_slot *capture_slot(struct usbcan_capture *cap,
+                                         uint64_t key) {
+    uint32_t i = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 40);
+    for (;; i++) {
+        struct capture_slot *slot = &cap->slots[i & cap->slot_mask];
+        if (slot->gen != cap->gen || slot->key == key) {
+            return slot;
+        }
+    }
+}
+
+// Delta-encodes the block being filled into cap->enc, returning its
+// size. Called with cap->lock held.
+static uint32_t capture_encode(struct usbcan_capture *cap) {
+    const struct capture_entry *entry = &cap->block.entry;
+
+    // A new generation empties the table without clearing it.
+    if (++cap->gen == 0) {
+        memset(cap->slots, 0,
+               (cap->slot_mask + 1) * sizeof(struct capture_slot));
+        cap->gen = 1;
+    }
+
+    uint32_t num_keys = 0;
+    for (uint32_t i = 0; i < entry->n; i++) {
+        uint64_t key = capture_dict_key(&cap->recs[i]);
+        struct capture_slot *slot = capture_slot(cap, key);
+        if (slot->gen != cap->gen) {
+            slot->gen = cap->gen;
+            slot->key = key;
+            cap->dict[num_keys++] = key;
+        }
+    }
+    qsort(cap->dict, num_keys, sizeof(uint64_t), capture_key_cmp);
+
+    // Keys sort by dev and bus first, so each bus's keys are adjacent.
+    uint8_t *p = capture_put_varint(cap->enc, num_keys);
+    uint32_t num_sources = 0;
+    for (uint32_t e = 0; e < num_keys; e++) {
+        uint64_t prev = e > 0 ? cap->dict[e - 1] : 0;
+        if (e == 0 || cap->dict[e] >> 32 != prev >> 32) {
+            cap->timestamps[num_sources++] = 0;
+        }
+
+        capture_slot(cap, cap->dict[e])->index = e;
+        cap->sources[e] = num_sources - 1;
+        cap->data[e] = 0;
+        p = capture_put_varint(p, cap->dict[e] - prev);
+    }
+
+    uint64_t time_us = entry->min_us;
+    for (uint32_t i = 0; i < entry->n; i++) {
+        const struct usbcan_capture_rec *rec = &cap->recs[i];
+        uint32_t e = capture_slot(cap, capture_dict_key(rec))->index;
+
+        p = capture_put_varint(p, rec->time_us - time_us);
+        time_us = rec->time_us;
+        if (num_keys <= 256) {
+            *p++ = (uint8_t)e;
+        } else {
+            p = capture_put_varint(p, e);
+        }
+
+        uint64_t data;
+        memcpy(&data, rec->frame.data, sizeof(data));
+        uint64_t delta = data ^ cap->data[e];
+        cap->data[e] = data;
+
+        uint8_t dlc = rec->frame.can_dlc;
+        *p++ = (dlc < 15 ? dlc : 15) | (delta == 0 ? CAPTURE_SAME : 0);
+        if (dlc >= 15) {
+            *p++ = dlc;
+        }
+
+        uint32_t *timestamp = &cap->timestamps[cap->sources[e]];
+        int32_t diff = (int32_t)(rec->timestamp - *timestamp);
+        *timestamp = rec->timestamp;
+        p = capture_put_varint(p,
+                               ((uint32_t)diff << 1) ^ (uint32_t)(diff >> 31));
+
+        if (delta != 0) {
+            uint8_t *mask = p++;
+            *mask = 0;
+            for (int j = 0; j < 8; j++) {
+                uint8_t x = (uint8_t)(delta >> (j * 8));
+                if (x != 0) {
+                    *mask |= 1 << j;
+                    *p++ = x;
+                }
+            }
+        }
+    }
+
+    return p - cap->enc;
+}
+
+struct capture_key {
+    uint64_t key;
+    uint64_t data;
+    uint32_t timestamp; // of the bus numbered like this key
+    uint32_t source;
+};
+
+// Decodes a compact block into recs, which holds entry->n records.
+static bool capture_decode(const struct capture_entry *entry,
+                           const uint8_t *p,
+                           struct usbcan_capture_rec *recs) {
+    const uint8_t *end = p + entry->size;
+
+    uint64_t num_keys;
+    p = capture_get_varint(p, end, &num_keys);
+    if (p == NULL || num_keys == 0 || num_keys > entry->n) {
+        return false;
+    }
+
+    struct capture_key *keys =
+        (struct capture_key *)malloc(num_keys * sizeof(struct capture_key));
+    if (keys == NULL) {
+        return false;
+    }
+
+    bool status = false;
+    uint64_t key = 0;
+    uint32_t num_sources = 0;
+    for (uint64_t e = 0; e < num_keys; e++) {
+        uint64_t v;
+        if ((p = capture_get_varint(p, end, &v)) == NULL) {
+            goto capture_decode_cleanup;
+        }
+        key += v;
+        if (e == 0 || key >> 32 != keys[e - 1].key >> 32) {
+            keys[num_sources++].timestamp = 0;
+        }
+
+        keys[e].key = key;
+        keys[e].data = 0;
+        keys[e].source = num_sources - 1;
+    }
+
+    uint64_t time_us = entry->min_us;
+    for (uint32_t i = 0; i < entry->n; i++) {
+        uint64_t dt, e, diff;
+        if ((p = capture_get_varint(p, end, &dt)) == NULL || p >= end) {
+            goto capture_decode_cleanup;
+        }
+        time_us += dt;
+
+        if (num_keys <= 256) {
+            e = *p++;
+        } else if ((p = capture_get_varint(p, end, &e)) == NULL) {
+            goto capture_decode_cleanup;
+        }
+        if (e >= num_keys || p >= end) {
+            goto capture_decode_cleanup;
+        }
+
+        uint8_t control = *p++;
+        uint8_t dlc = control & 0xF;
+        if (dlc == 15) {
+            if (p >= end) {
+                goto capture_decode_cleanup;
+            }
+            dlc = *p++;
+        }
+
+        if ((p = capture_get_varint(p, end, &diff)) == NULL) {
+            goto capture_decode_cleanup;
+        }
+        uint32_t *timestamp = &keys[keys[e].source].timestamp;
+        *timestamp += (uint32_t)(diff >> 1) ^ -(uint32_t)(diff & 1);
+
+        if ((control & CAPTURE_SAME) == 0) {
+            if (p >= end) {
+                goto capture_decode_cleanup;
+            }
+            uint8_t mask = *p++;
+            for (int j = 0; j < 8; j++) {
+                if ((mask & (1 << j)) != 0) {
+                    if (p >= end) {
+                        goto capture_decode_cleanup;
+                    }
+                    keys[e].data ^= (uint64_t)*p++ << (j * 8);
+                }
+            }
+        }
+
+        struct usbcan_capture_rec *rec = &recs[i];
+        memset(rec, 0, sizeof(*rec));
+        rec->time_us = time_us;
+        rec->dev = (uint8_t)(keys[e].key >> 40);
+        rec->bus = (uint8_t)(keys[e].key >> 32);
+        rec->timestamp = *timestamp;
+        rec->frame.can_id = (canid_t)keys[e].key;
+        rec->frame.can_dlc = dlc;
+        memcpy(rec->frame.data, &keys[e].data, sizeof(rec->frame.data));
+    }
+    status = p == end;
+
+  capture_decode_cleanup:
+    free(keys);
+    return status;
+}
+
+static void capture_block_reset(struct usbcan_capture *cap) {
+    memset(&cap->block, 0, sizeof(cap->block));
+    cap->block.magic = CAPTURE_BLOCK_MAGIC;
+    cap->block.entry.encoding = (cap->flags & USBCAN_CAPTURE_COMPACT) > 0
+        ? CAPTURE_ENCODING_DELTA
+        : CAPTURE_ENCODING_RAW;
+    cap->block.entry.min_key = UINT32_MAX;
+}
+
+// Writes out the block being filled. Called with cap->lock held.
+static bool capture_flush(struct usbcan_capture *cap) {
+    struct capture_block *block = &cap->block;
+    if (block->entry.n == 0) {
+        return true;
+    }
+
+    if (cap->num_blocks == cap->index_cap) {
+        uint64_t cap_blocks = cap->index_cap > 0 ? cap->index_cap * 2 : 64;
+        struct capture_block *index = (struct capture_block *)realloc(
+            cap->index, cap_blocks * sizeof(struct capture_block));
+        if (index == NULL) {
+            return false;
+        }
+        cap->index = index;
+        cap->index_cap = cap_blocks;
+    }
+
+    const void *body = cap->recs;
+    block->entry.offset = cap->offset;
+    if (block->entry.encoding == CAPTURE_ENCODING_DELTA) {
+        block->entry.size = capture_encode(cap);
+        body = cap->enc;
+    } else {
+        block->entry.size =
+            block->entry.n * sizeof(struct usbcan_capture_rec);
+    }
+
+    static const uint8_t padding[8];
+    uint32_t pad = CAPTURE_ALIGN(block->entry.size) - block->entry.size;
+    if (fwrite(block, sizeof(*block), 1, cap->f) != 1 ||
+        fwrite(body, block->entry.size, 1, cap->f) != 1 ||
+        fwrite(padding, 1, pad, cap->f) != pad) {
+        return false;
+    }
+
+    cap->offset += sizeof(*block) + CAPTURE_ALIGN(block->entry.size);
+    cap->index[cap->num_blocks++] = *block;
+    capture_block_reset(cap);
+
+    return true;
+}
+
+static void capture_free(struct usbcan_capture *cap) {
+    free(cap->enc);
+    free(cap->dict);
+    free(cap->sources);
+    free(cap->timestamps);
+    free(cap->data);
+    free(cap->slots);
+    free(cap->index);
+    free(cap->recs);
+    free(cap);
+}
+
+static bool capture_compact_alloc(struct usbcan_capture *cap) {
+    uint32_t n = cap->block_frames;
+
+    // Worst case: a 7-byte dictionary entry per record, and a record of
+    // 10 + 5 + 2 + 5 + 9 bytes.
+    cap->enc = (uint8_t *)malloc(10 + (size_t)n * 38);
+    cap->dict = (uint64_t *)malloc(n * sizeof(uint64_t));
+    cap->sources = (uint32_t *)malloc(n * sizeof(uint32_t));
+    cap->timestamps = (uint32_t *)malloc(n * sizeof(uint32_t));
+    cap->data = (uint64_t *)malloc(n * sizeof(uint64_t));
+
+    uint32_t slots = 1;
+    while (slots < n * 2) {
+        slots <<= 1;
+    }
+    cap->slots =
+        (struct capture_slot *)calloc(slots, sizeof(struct capture_slot));
+    cap->slot_mask = slots - 1;
+
+    return cap->enc != NULL && cap->dict != NULL && cap->sources != NULL &&
+        cap->timestamps != NULL && cap->data != NULL && cap->slots != NULL;
+}
+
+struct usbcan_capture *usbcan_capture_open(const char *path,
+                                           uint32_t block_frames,
+                                           uint32_t flags) {
+    struct usbcan_capture *cap =
+        (struct usbcan_capture *)calloc(1, sizeof(struct usbcan_capture));
+    if (cap == NULL) {
+        return NULL;
+    }
+
+    cap->flags = flags;
+    cap->block_frames =
+        block_frames > 0 ? block_frames : USBCAN_CAPTURE_BLOCK_FRAMES;
+    cap->recs = (struct usbcan_capture_rec *)calloc(
+        cap->block_frames, sizeof(struct usbcan_capture_rec));
+    if (cap->recs == NULL || ((flags & USBCAN_CAPTURE_COMPACT) > 0 &&
+                              !capture_compact_alloc(cap))) {
+        goto capture_open_error;
+    }
+
+    cap->f = fopen(path, "wb");
+    if (cap->f == NULL) {
+        goto capture_open_error;
+    }
+
+    cap->start_us = capture_clock_us(CLOCK_REALTIME);
+    cap->start_mono_us = capture_clock_us(CLOCK_MONOTONIC);
+
+    struct capture_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+    header.block_frames = cap->block_frames;
+    header.start_us = cap->start_us;
+
+    if (fwrite(&header, sizeof(header), 1, cap->f) != 1) {
+        goto capture_open_error;
+    }
+    cap->offset = sizeof(header);
+
+    pthread_mutex_init(&cap->lock, NULL);
+    capture_block_reset(cap);
+
+    return cap;
+
+  capture_open_error:
+    if (cap->f != NULL) {
+        fclose(cap->f);
+    }
+    capture_free(cap);
+    return NULL;
+}
+
+bool usbcan_capture_write(struct usbcan_capture *cap, uint32_t dev,
+                          uint32_t bus, const struct usbcan_msg *msgs,
+                          uint32_t n) {
+    pthread_mutex_lock(&cap->lock);
+
+    // Read under the lock so records are in time order across callers.
+    uint64_t time_us = cap->start_us +
+        (capture_clock_us(CLOCK_MONOTONIC) - cap->start_mono_us);
+
+    for (uint32_t i = 0; i < n && !cap->failed; i++) {
+        struct capture_entry *entry = &cap->block.entry;
+        struct usbcan_capture_rec *rec = &cap->recs[entry->n];
+
+        memset(rec, 0, sizeof(*rec));
+        rec->time_us = time_us;
+        rec->dev = dev;
+        rec->bus = bus;
+        rec->timestamp = msgs[i].timestamp;
+        rec->frame = msgs[i].frame;
+
+        uint32_t key = msgs[i].frame.can_id & CAPTURE_KEY_MASK;
+        uint32_t bits[3];
+        capture_bloom_bits(key, bits);
+        for (int b = 0; b < 3; b++) {
+            cap->block.bloom[bits[b] / 8] |= 1 << (bits[b] % 8);
+        }
+
+        if (entry->n == 0) {
+            entry->min_us = time_us;
+        }
+        entry->max_us = time_us;
+        entry->min_key = key < entry->min_key ? key : entry->min_key;
+        entry->max_key = key > entry->max_key ? key : entry->max_key;
+
+        if (++entry->n == cap->block_frames && !capture_flush(cap)) {
+            cap->failed = true;
+        }
+    }
+
+    bool status = !cap->failed;
+    pthread_mutex_unlock(&cap->lock);
+
+    return status;
+}
+
+bool usbcan_capture_close(struct usbcan_capture *cap) {
+    if (cap == NULL) {
+        return false;
+    }
+
+    bool status = !cap->failed && capture_flush(cap);
+
+    struct capture_trailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.entries_offset = cap->offset;
+    trailer.blooms_offset =
+        cap->offset + cap->num_blocks * sizeof(struct capture_entry);
+    trailer.num_blocks = cap->num_blocks;
+    memcpy(trailer.magic, CAPTURE_INDEX_MAGIC, sizeof(trailer.magic));
+
+    for (uint64_t i = 0; status && i < cap->num_blocks; i++) {
+        status = fwrite(&cap->index[i].entry, sizeof(struct capture_entry), 1,
+                        cap->f) == 1;
+    }
+    for (uint64_t i = 0; status && i < cap->num_blocks; i++) {
+        status = fwrite(cap->index[i].bloom, sizeof(cap->index[i].bloom), 1,
+                        cap->f) == 1;
+    }
+    status = status && fwrite(&trailer, sizeof(trailer), 1, cap->f) == 1;
+    status = fclose(cap->f) == 0 && status;
+
+    pthread_mutex_destroy(&cap->lock);
+    capture_free(cap);
+
+    return status;
+}
+
+static bool capture_entry_valid(const struct usbcan_capture_reader *r,
+                                const struct capture_entry *entry) {
+    return entry->offset >= sizeof(struct capture_header) &&
+        entry->offset <= r->size && entry->offset % 8 == 0 &&
+        r->size - entry->offset >= sizeof(struct capture_block) &&
+        r->size - entry->offset - sizeof(struct capture_block) >=
+        entry->size &&
+        entry->n > 0 && entry->n <= r->header->block_frames &&
+        (entry->encoding == CAPTURE_ENCODING_DELTA ||
+         (entry->encoding == CAPTURE_ENCODING_RAW &&
+          entry->size == entry->n * sizeof(struct usbcan_capture_rec)));
+}
+
+static bool capture_load_index(struct usbcan_capture_reader *r) {
+    if (r->size <
+        sizeof(struct capture_header) + sizeof(struct capture_trailer)) {
+        return false;
+    }
+
+    // A file cut short may end anywhere, so copy the trailer out.
+    struct capture_trailer trailer;
+    memcpy(&trailer, r->base + r->size - sizeof(trailer), sizeof(trailer));
+    if (memcmp(trailer.magic, CAPTURE_INDEX_MAGIC, sizeof(trailer.magic)) !=
+            0 ||
+        trailer.entries_offset > r->size || trailer.entries_offset % 8 != 0 ||
+        trailer.num_blocks >
+            (r->size - trailer.entries_offset) /
+                (sizeof(struct capture_entry) + CAPTURE_BLOOM_BYTES) ||
+        trailer.blooms_offset !=
+            trailer.entries_offset +
+                trailer.num_blocks * sizeof(struct capture_entry)) {
+        return false;
+    }
+
+    r->entries =
+        (const struct capture_entry *)(r->base + trailer.entries_offset);
+    r->blooms = r->base + trailer.blooms_offset;
+    r->num_blocks = trailer.num_blocks;
+
+    for (uint64_t i = 0; i < r->num_blocks; i++) {
+        if (!capture_entry_valid(r, &r->entries[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Follows the block headers of a file that was not closed, up to the
+// first incomplete block, copying out their entries and filters if
+// entries is not NULL. Returns the number of blocks.
+static uint64_t capture_walk(const struct usbcan_capture_reader *r,
+                             struct capture_entry *entries, uint8_t *blooms) {
+    uint64_t n = 0;
+    uint64_t offset = sizeof(struct capture_header);
+
+    while (offset + sizeof(struct capture_block) <= r->size) {
+        const struct capture_block *block =
+            (const struct capture_block *)(r->base + offset);
+        if (block->magic != CAPTURE_BLOCK_MAGIC ||
+            block->entry.offset != offset ||
+            !capture_entry_valid(r, &block->entry)) {
+            break;
+        }
+
+        if (entries != NULL) {
+            entries[n] = block->entry;
+            memcpy(blooms + n * CAPTURE_BLOOM_BYTES, block->bloom,
+                   CAPTURE_BLOOM_BYTES);
+        }
+        n++;
+        offset +=
+            sizeof(struct capture_block) + CAPTURE_ALIGN(block->entry.size);
+    }
+
+    return n;
+}
+
+static bool capture_rebuild_index(struct usbcan_capture_reader *r) {
+    uint64_t n = capture_walk(r, NULL, NULL);
+    size_t entries_size = n * sizeof(struct capture_entry);
+
+    uint8_t *owned =
+        (uint8_t *)malloc(entries_size + n * CAPTURE_BLOOM_BYTES + 1);
+    if (owned == NULL) {
+        return false;
+    }
+
+    r->owned = owned;
+    r->entries = (const struct capture_entry *)owned;
+    r->blooms = owned + entries_size;
+    r->num_blocks =
+        capture_walk(r, (struct capture_entry *)owned, owned + entries_size);
+
+    return true;
+}
+
+struct usbcan_capture_reader *usbcan_capture_map(const char *path) {
+    struct usbcan_capture_reader *r = (struct usbcan_capture_reader *)calloc(
+        1, sizeof(struct usbcan_capture_reader));
+    if (r == NULL) {
+        return NULL;
+    }
+
+    struct stat st;
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0 || fstat(r->fd, &st) != 0 ||
+        (size_t)st.st_size < sizeof(struct capture_header)) {
+        goto capture_map_error;
+    }
+    r->size = st.st_size;
+
+    void *base = mmap(NULL, r->size, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (base == MAP_FAILED) {
+        goto capture_map_error;
+    }
+    r->base = (const uint8_t *)base;
+
+    // Queries jump between blocks, so read ahead only on request.
+    madvise(base, r->size, MADV_RANDOM);
+
+    r->header = (const struct capture_header *)r->base;
+    if (memcmp(r->header->magic, CAPTURE_MAGIC, sizeof(r->header->magic)) !=
+            0 ||
+        r->header->version != CAPTURE_VERSION) {
+        goto capture_map_error;
+    }
+
+    r->indexed = capture_load_index(r);
+    if (!r->indexed && !capture_rebuild_index(r)) {
+        goto capture_map_error;
+    }
+
+    return r;
+
+  capture_map_error:
+    usbcan_capture_unmap(r);
+    return NULL;
+}
+
+void usbcan_capture_unmap(struct usbcan_capture_reader *r) {
+    if (r == NULL) {
+        return;
+    }
+
+    if (r->base != NULL) {
+        munmap((void *)r->base, r->size);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    free(r->owned);
+    free(r);
+}
+
+void usbcan_capture_info(const struct usbcan_capture_reader *r,
+                         struct usbcan_capture_info *info) {
+    memset(info, 0, sizeof(*info));
+    info->start_us = r->header->start_us;
+    info->end_us = r->header->start_us;
+    info->blocks = r->num_blocks;
+    info->block_frames = r->header->block_frames;
+    info->indexed = r->indexed;
+
+    for (uint64_t i = 0; i < r->num_blocks; i++) {
+        info->frames += r->entries[i].n;
+    }
+    if (r->num_blocks > 0) {
+        info->end_us = r->entries[r->num_blocks - 1].max_us;
+    }
+}
+
+uint32_t usbcan_capture_read_block(const struct usbcan_capture_reader *r,
+                                   uint64_t block,
+                                   struct usbcan_capture_rec *recs) {
+    if (block >= r->num_blocks) {
+        return 0;
+    }
+
+    const struct capture_entry *entry = &r->entries[block];
+    const uint8_t *body =
+        r->base + entry->offset + sizeof(struct capture_block);
+    if (entry->encoding == CAPTURE_ENCODING_DELTA) {
+        return capture_decode(entry, body, recs) ? entry->n : 0;
+    }
+
+    memcpy(recs, body, entry->size);
+
+    return entry->n;
+}
+
+struct usbcan_capture_cursor *
+usbcan_capture_query(const struct usbcan_capture_reader *r,
+                     const struct usbcan_capture_query *query) {
+    struct usbcan_capture_cursor *c = (struct usbcan_capture_cursor *)calloc(
+        1, sizeof(struct usbcan_capture_cursor));
+    if (c == NULL) {
+        return NULL;
+    }
+
+    c->reader = r;
+    c->query = *query;
+    if (c->query.to_us == 0) {
+        c->query.to_us = UINT64_MAX;
+    }
+
+    // The Bloom filters help only when the mask pins a whole ID.
+    canid_t full = (query->can_id & CAN_EFF_FLAG) > 0
+        ? CAN_EFF_FLAG | CAN_EFF_MASK
+        : CAN_EFF_FLAG | CAN_SFF_MASK;
+    c->keyed = (query->can_mask & full) == full;
+    c->key = query->can_id & full;
+
+    // Blocks are in time order; find the first that can hold from_us.
+    uint64_t lo = 0, hi = r->num_blocks;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (r->entries[mid].max_us < c->query.from_us) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    c->block = lo;
+
+    return c;
+}
+
+static bool capture_block_matches(struct usbcan_capture_cursor *c,
+                                  uint64_t block) {
+    const struct usbcan_capture_reader *r = c->reader;
+    const struct capture_entry *entry = &r->entries[block];
+
+    if (entry->max_us < c->query.from_us) {
+        return false;
+    }
+
+    if (c->keyed &&
+        (c->key < entry->min_key || c->key > entry->max_key ||
+         !capture_bloom_test(r->blooms + block * CAPTURE_BLOOM_BYTES,
+                             c->key))) {
+        return false;
+    }
+
+    return true;
+}
+
+const struct usbcan_capture_rec *
+usbcan_capture_next(struct usbcan_capture_cursor *c) {
+    const struct usbcan_capture_reader *r = c->reader;
+    const struct usbcan_capture_query *q = &c->query;
+
+    for (;;) {
+        while (c->i < c->n) {
+            const struct usbcan_capture_rec *rec = &c->recs[c->i++];
+            if (rec->time_us > q->to_us) {
+                c->i = c->n;
+                c->block = r->num_blocks;
+                return NULL;
+            }
+            if (rec->time_us >= q->from_us &&
+                ((rec->frame.can_id ^ q->can_id) & q->can_mask) == 0) {
+                return rec;
+            }
+        }
+
+        while (c->block < r->num_blocks &&
+               r->entries[c->block].min_us <= q->to_us &&
+               !capture_block_matches(c, c->block)) {
+            c->block++;
+        }
+        if (c->block >= r->num_blocks ||
+            r->entries[c->block].min_us > q->to_us) {
+            return NULL;
+        }
+
+        const struct capture_entry *entry = &r->entries[c->block++];
+        const uint8_t *body =
+            r->base + entry->offset + sizeof(struct capture_block);
+        madvise((void *)((uintptr_t)body & ~(uintptr_t)(getpagesize() - 1)),
+                entry->size + ((uintptr_t)body & (getpagesize() - 1)),
+                MADV_WILLNEED);
+        c->blocks_read++;
+
+        c->n = 0;
+        c->i = 0;
+        if (entry->encoding == CAPTURE_ENCODING_RAW) {
+            c->recs = (const struct usbcan_capture_rec *)body;
+            c->n = entry->n;
+            continue;
+        }
+
+        if (c->buf == NULL) {
+            c->buf = (struct usbcan_capture_rec *)malloc(
+                r->header->block_frames * sizeof(struct usbcan_capture_rec));
+            if (c->buf == NULL) {
+                return NULL;
+            }
+        }
+
+        // A block that fails to decode is skipped.
+        if (capture_decode(entry, body, c->buf)) {
+            c->recs = c->buf;
+            c->n = entry->n;
+        }
+    }
+}
+
+uint64_t usbcan_capture_blocks_read(const struct usbcan_capture_cursor *c) {
+    return c->blocks_read;
+}
+
+void usbcan_capture_cursor_free(struct usbcan_capture_cursor *c) {
+    if (c == NULL) {
+        return;
+    }
+
+    free(c->buf);
+    free(c);
+}
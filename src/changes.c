@@ -0,0 +1,141 @@
+/*
+
+  changes.c -- change-only delivery of received frames
+
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbcan.h"
+#include "usbcan_internal.h"
+
+/*
+  The last forwarded frame of every standard ID lives in a direct table
+  and that of extended IDs in a fixed open-addressing table. Once the
+  extended table is three quarters full, frames of further extended IDs
+  are always forwarded rather than evicting anything.
+*/
+
+#define CHANGES_EFF_SLOTS 2048
+#define CHANGES_EFF_MAX (CHANGES_EFF_SLOTS / 4 * 3)
+#define CHANGES_EMPTY 0xFFFFFFFF
+
+struct usbcan_last {
+    canid_t can_id;
+    uint8_t dlc;
+    uint64_t data;
+    uint64_t forwarded_us;
+};
+
+struct usbcan_changes {
+    struct can_filter filter;
+    uint64_t heartbeat_us;
+    uint32_t eff_used;
+    struct usbcan_last sff[CAN_SFF_MASK + 1];
+    struct usbcan_last eff[CHANGES_EFF_SLOTS];
+};
+
+struct usbcan_changes *usbcan_changes_alloc(struct usbcan_bus_config *config) {
+    // Zeroed, since the filter reads every field of an empty slot.
+    struct usbcan_changes *c =
+        (struct usbcan_changes *)calloc(1, sizeof(struct usbcan_changes));
+    if (c == NULL) {
+        return NULL;
+    }
+
+    c->filter = config->change_filter;
+    c->heartbeat_us = (uint64_t)config->heartbeat_ms * 1000;
+
+    for (uint32_t i = 0; i <= CAN_SFF_MASK; i++) {
+        c->sff[i].can_id = CHANGES_EMPTY;
+    }
+    for (uint32_t i = 0; i < CHANGES_EFF_SLOTS; i++) {
+        c->eff[i].can_id = CHANGES_EMPTY;
+    }
+
+    return c;
+}
+
+static struct usbcan_last *changes_slot(struct usbcan_changes *c,
+                                        canid_t can_id) {
+    if ((can_id & CAN_EFF_FLAG) == 0) {
+        return &c->sff[can_id & CAN_SFF_MASK];
+    }
+
+    canid_t id = can_id & CAN_EFF_MASK;
+    for (uint32_t h = id * 0x9E3779B1U;; h++) {
+        struct usbcan_last *slot = &c->eff[h % CHANGES_EFF_SLOTS];
+        if (slot->can_id == CHANGES_EMPTY) {
+            if (c->eff_used == CHANGES_EFF_MAX) {
+                return NULL;
+            }
+            c->eff_used++;
+            return slot;
+        }
+
+        if ((slot->can_id & CAN_EFF_MASK) == id) {
+            return slot;
+        }
+    }
+}
+
+// Compacts msgs in place to the frames that differ from the last one
+// forwarded for their ID, or whose heartbeat is due, and returns how
+// many remain. Error frames and frames outside the filter always pass.
+uint32_t usbcan_changes_filter(struct usbcan_changes *c,
+                               struct usbcan_msg *msgs, uint32_t n,
+                               uint64_t now_us) {
+    uint32_t kept = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        canid_t can_id = msgs[i].frame.can_id;
+        bool forward = true;
+
+        if ((can_id & CAN_ERR_FLAG) == 0 &&
+            ((can_id ^ c->filter.can_id) & c->filter.can_mask) == 0) {
+            struct usbcan_last *last = changes_slot(c, can_id);
+
+            if (last != NULL) {
+                uint64_t data;
+                memcpy(&data, msgs[i].frame.data, sizeof(data));
+
+                // Changed and unchanged frames tend to alternate at
+                // random, so nothing here branches on which this is: an
+                // unchanged frame stores back the same ID, DLC and data,
+                // and every frame is copied down, counting only if kept.
+                forward = (last->can_id != can_id) |
+                    (last->dlc != msgs[i].frame.can_dlc) |
+                    (last->data != data) |
+                    ((c->heartbeat_us > 0) &
+                     (now_us - last->forwarded_us >= c->heartbeat_us));
+
+                last->can_id = can_id;
+                last->dlc = msgs[i].frame.can_dlc;
+                last->data = data;
+                last->forwarded_us = forward ? now_us : last->forwarded_us;
+            }
+        }
+
+        msgs[kept] = msgs[i];
+        kept += forward;
+    }
+
+    return kept;
+}
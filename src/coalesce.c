@@ -0,0 +1,297 @@
+/*
+
+  coalesce.c -- batching of received frames under a latency bound
+
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "usbcan.h"
+#include "usbcan_internal.h"
+
+/*
+  The dispatcher appends frames to the bus's hold buffer and calls back
+  once min frames are held; a dispatch that alone brings min frames is
+  passed straight through without copying. The latency bound is kept by
+  a flusher thread per device, started with its first coalescing bus,
+  which sleeps until the earliest hold deadline and flushes every bus
+  whose oldest frame has waited hold_us, so a bus that goes quiet still
+  gets its frames.
+
+  The flusher swaps the held frames for the spare buffer and calls back
+  without the bus's rx_lock, marked as a dispatcher of the device, so
+  callbacks have the same restrictions wherever they run. Until it is
+  done every other delivery on the bus waits, which keeps frames in
+  order and one callback at a time.
+
+  In adaptive mode min follows the receive rate: half of what is
+  expected to arrive within hold_us, so batches usually fill well
+  before the deadline, down to single frames on a quiet bus.
+*/
+
+static void coalesce_deliver(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+                             struct usbcan_msg *msgs, uint32_t n) {
+    if (b->soa_cb != NULL) {
+        usbcan_soa_deliver(dev, bus, b, msgs, n);
+    } else if (b->cb != NULL) {
+        b->cb(dev, bus, msgs, n, b->arg);
+        usbcan_count(&b->stats.delivered, n);
+    }
+}
+
+// Waits, with rx_lock held, for the flusher to finish calling back.
+static void coalesce_wait(struct usbcan_bus *b) {
+    while (b->coalesce.flushing) {
+        pthread_cond_wait(&b->coalesce.flushed, &b->rx_lock);
+    }
+}
+
+void usbcan_coalesce_flush(uint32_t dev, uint32_t bus, struct usbcan_bus *b) {
+    struct usbcan_coalesce *c = &b->coalesce;
+
+    coalesce_wait(b);
+    if (c->n > 0) {
+        coalesce_deliver(dev, bus, b, c->msgs, c->n);
+        c->n = 0;
+    }
+}
+
+// Flushes the device's expired buses and returns the next hold deadline.
+static uint64_t coalesce_expire(uint32_t dev, struct usbcan_dev *d) {
+    uint64_t next_us = UINT64_MAX;
+
+    for (uint32_t bus = 0; bus < MAX_BUSES; bus++) {
+        struct usbcan_bus *b = &d->buses[bus];
+        struct usbcan_coalesce *c = &b->coalesce;
+
+        pthread_mutex_lock(&b->rx_lock);
+        if (c->n == 0 || c->flushing) {
+            pthread_mutex_unlock(&b->rx_lock);
+            continue;
+        }
+
+        uint64_t deadline_us = c->since_us + c->hold_us;
+        if (deadline_us > usbcan_now_us()) {
+            if (deadline_us < next_us) {
+                next_us = deadline_us;
+            }
+            pthread_mutex_unlock(&b->rx_lock);
+            continue;
+        }
+
+        // The callback cannot change until flushing is cleared, since
+        // deregistering flushes first and registering needs none set.
+        struct usbcan_msg *msgs = c->msgs;
+        uint32_t n = c->n;
+        c->msgs = c->spare;
+        c->spare = msgs;
+        c->n = 0;
+        c->flushing = true;
+        pthread_mutex_unlock(&b->rx_lock);
+
+        usbcan_set_dispatcher(dev);
+        coalesce_deliver(dev, bus, b, msgs, n);
+        usbcan_clear_dispatcher();
+
+        pthread_mutex_lock(&b->rx_lock);
+        c->flushing = false;
+        pthread_cond_broadcast(&c->flushed);
+        pthread_mutex_unlock(&b->rx_lock);
+    }
+
+    return next_us;
+}
+
+static void *coalesce_flusher(void *arg) {
+    uint32_t dev = (uint32_t)(uintptr_t)arg;
+    // The devices outlive their flushers; see usbcan_coalesce_stop.
+    struct usbcan_dev *d = &state.devs[dev];
+    struct usbcan_flusher *f = &d->flusher;
+
+    pthread_mutex_lock(&f->lock);
+    while (f->running) {
+        if (f->deadline_us == UINT64_MAX) {
+            pthread_cond_wait(&f->cond, &f->lock);
+            continue;
+        }
+
+        if (f->deadline_us > usbcan_now_us()) {
+            usbcan_cond_wait_until(&f->cond, &f->lock, f->deadline_us);
+            continue;
+        }
+
+        // Deadlines armed while the buses are scanned lower this again.
+        f->deadline_us = UINT64_MAX;
+        pthread_mutex_unlock(&f->lock);
+
+        uint64_t next_us = coalesce_expire(dev, d);
+
+        pthread_mutex_lock(&f->lock);
+        if (next_us < f->deadline_us) {
+            f->deadline_us = next_us;
+        }
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    return NULL;
+}
+
+static void coalesce_arm(struct usbcan_flusher *f, uint64_t deadline_us) {
+    pthread_mutex_lock(&f->lock);
+    if (deadline_us < f->deadline_us) {
+        f->deadline_us = deadline_us;
+        pthread_cond_signal(&f->cond);
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+static bool coalesce_start(uint32_t dev) {
+    struct usbcan_flusher *f = &state.devs[dev].flusher;
+    bool status = true;
+
+    pthread_mutex_lock(&f->lock);
+    if (!f->running) {
+        f->running = true;
+        f->deadline_us = UINT64_MAX;
+        if (pthread_create(&f->thread, NULL, coalesce_flusher,
+                           (void *)(uintptr_t)dev) != 0) {
+            f->running = false;
+            status = false;
+        }
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    return status;
+}
+
+// Called by usbcan_library_close before the devices are freed.
+void usbcan_coalesce_stop() {
+    pthread_rwlock_rdlock(&state.lock);
+    for (uint32_t dev = 0; dev < state.num_devs; dev++) {
+        struct usbcan_flusher *f = &state.devs[dev].flusher;
+
+        pthread_mutex_lock(&f->lock);
+        bool running = f->running;
+        f->running = false;
+        pthread_cond_signal(&f->cond);
+        pthread_mutex_unlock(&f->lock);
+
+        if (running) {
+            pthread_join(f->thread, NULL);
+        }
+    }
+    pthread_rwlock_unlock(&state.lock);
+}
+
+bool usbcan_coalesce_init(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+                          struct usbcan_bus_config *config, bool enabled) {
+    uint32_t max = config->batch_max > 0 ? config->batch_max : USBCAN_BATCH_MAX;
+    uint32_t min = config->batch_min > 0 ? config->batch_min : max;
+    bool adaptive = (config->flags & USBCAN_FLAG_ADAPTIVE) > 0;
+
+    if (adaptive) {
+        min = config->batch_min > 0 ? config->batch_min : 1;
+    }
+    if (min > max) {
+        min = max;
+    }
+
+    enabled = enabled && config->hold_us > 0;
+    if (enabled && !coalesce_start(dev)) {
+        return false;
+    }
+
+    bool status = true;
+
+    pthread_mutex_lock(&b->rx_lock);
+    struct usbcan_coalesce *c = &b->coalesce;
+    usbcan_coalesce_flush(dev, bus, b);
+
+    if (enabled && c->cap < max) {
+        struct usbcan_msg *msgs = (struct usbcan_msg *)realloc(
+            c->msgs, max * sizeof(struct usbcan_msg));
+        if (msgs != NULL) {
+            c->msgs = msgs;
+        }
+        struct usbcan_msg *spare = (struct usbcan_msg *)realloc(
+            c->spare, max * sizeof(struct usbcan_msg));
+        if (spare != NULL) {
+            c->spare = spare;
+        }
+
+        if (msgs == NULL || spare == NULL) {
+            enabled = false;
+            status = false;
+        } else {
+            c->cap = max;
+        }
+    }
+
+    c->enabled = enabled;
+    c->adaptive = adaptive;
+    c->min = min;
+    c->max = max;
+    c->hold_us = config->hold_us;
+    pthread_mutex_unlock(&b->rx_lock);
+
+    return status;
+}
+
+// Called by usbcan_deliver with rx_lock held.
+void usbcan_coalesce(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+                     struct usbcan_msg *msgs, uint32_t n, uint64_t now_us) {
+    struct usbcan_coalesce *c = &b->coalesce;
+    coalesce_wait(b);
+    uint32_t min = c->min;
+
+    if (c->adaptive) {
+        // errors.rate is the smoothed arrival rate in frames per second.
+        uint64_t target = b->errors.rate * c->hold_us / 2000000;
+        if (target > min) {
+            min = target < c->max ? (uint32_t)target : c->max;
+        }
+    }
+
+    uint32_t i = 0;
+    while (i < n) {
+        uint32_t m;
+
+        if (c->n == 0 && n - i >= min) {
+            m = n - i < c->max ? n - i : c->max;
+            coalesce_deliver(dev, bus, b, msgs + i, m);
+            i += m;
+            continue;
+        }
+
+        m = n - i < c->max - c->n ? n - i : c->max - c->n;
+        if (c->n == 0) {
+            c->since_us = now_us;
+            coalesce_arm(&state.devs[dev].flusher, now_us + c->hold_us);
+        }
+        memcpy(c->msgs + c->n, msgs + i, m * sizeof(struct usbcan_msg));
+        c->n += m;
+        i += m;
+
+        if (c->n >= min) {
+            usbcan_coalesce_flush(dev, bus, b);
+        }
+    }
+}
@@ -0,0 +1,475 @@
+/*
+
+  dbc.c -- DBC signal decoding for received batches
+
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "usbcan.h"
+#include "usbcan_dbc.h"
+
+/*
+  Each signal is compiled to a shift and mask over the frame payload read
+  as one 64-bit word, little endian for Intel signals and big endian for
+  Motorola ones, followed by sign extension and scaling. The programs are
+  stored as parallel arrays with each message's signals contiguous, so
+  decoding a frame is a branch-free loop over that message's slice.
+
+  Multiplexed signals (m<N>) are emitted only when the message's
+  multiplexor (M) decodes to N. SIG_VALTYPE_ float signals, value tables
+  and attributes are not interpreted.
+*/
+
+#define DBC_NO_MUX -1
+#define DBC_LINE_LEN 1024
+
+struct dbc_msg {
+    canid_t can_id;
+    uint32_t first;
+    uint32_t num;
+    int32_t mux; // signal index of the multiplexor, or DBC_NO_MUX
+};
+
+struct dbc_parsed_signal {
+    char *name;
+    uint32_t msg;
+    uint32_t start;
+    uint32_t len;
+    bool big_endian;
+    bool is_signed;
+    double factor;
+    double offset;
+    bool multiplexor;
+    int32_t mux_value;
+};
+
+struct usbcan_dbc {
+    uint32_t num_msgs;
+    struct dbc_msg *msgs;
+
+    uint32_t num_signals;
+    char **names;
+    uint32_t *signal_msgs;
+    uint8_t *shifts;
+    uint8_t *big_endian;
+    uint64_t *masks;
+    uint64_t *signs;
+    double *factors;
+    double *offsets;
+    int32_t *mux_values;
+
+    int32_t sff[CAN_SFF_MASK + 1];
+    canid_t *eff_ids;
+    int32_t *eff_msgs;
+    uint32_t eff_mask;
+};
+
+static uint32_t dbc_hash(canid_t id) {
+    return id * 0x9E3779B1U;
+}
+
+static int32_t dbc_lookup(const struct usbcan_dbc *dbc, canid_t can_id) {
+    if ((can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG)) > 0) {
+        return -1;
+    }
+
+    if ((can_id & CAN_EFF_FLAG) == 0) {
+        return dbc->sff[can_id & CAN_SFF_MASK];
+    }
+
+    canid_t id = can_id & CAN_EFF_MASK;
+    for (uint32_t h = dbc_hash(id);; h++) {
+        int32_t m = dbc->eff_msgs[h & dbc->eff_mask];
+        if (m < 0 || dbc->eff_ids[h & dbc->eff_mask] == id) {
+            return m;
+        }
+    }
+}
+
+static bool dbc_parse_msg(const char *line, struct dbc_msg *msg) {
+    unsigned long id;
+    if (sscanf(line, " BO_ %lu", &id) != 1) {
+        return false;
+    }
+
+    msg->can_id = (id & CAN_EFF_FLAG) > 0 ? (id & CAN_EFF_MASK) | CAN_EFF_FLAG
+                                          : id & CAN_SFF_MASK;
+    msg->num = 0;
+    msg->mux = DBC_NO_MUX;
+
+    return true;
+}
+
+static bool dbc_parse_signal(const char *line,
+                             struct dbc_parsed_signal *sig) {
+    char name[256], mux[16];
+    int consumed = 0;
+
+    if (sscanf(line, " SG_ %255s %n", name, &consumed) != 1) {
+        return false;
+    }
+    line += consumed;
+
+    sig->multiplexor = false;
+    sig->mux_value = DBC_NO_MUX;
+    if (*line != ':') {
+        if (sscanf(line, "%15s %n", mux, &consumed) != 1) {
+            return false;
+        }
+        line += consumed;
+
+        if (strcmp(mux, "M") == 0) {
+            sig->multiplexor = true;
+        } else if (mux[0] == 'm') {
+            sig->mux_value = atoi(mux + 1);
+        }
+    }
+
+    unsigned start, len;
+    char order, sign;
+    if (sscanf(line, ": %u|%u@%c%c (%lf,%lf)", &start, &len, &order, &sign,
+               &sig->factor, &sig->offset) != 6) {
+        return false;
+    }
+
+    if (len == 0 || len > 64 || start > 63) {
+        return false;
+    }
+
+    sig->start = start;
+    sig->len = len;
+    sig->big_endian = order == '0';
+    sig->is_signed = sign == '-';
+    sig->name = strdup(name);
+
+    return sig->name != NULL;
+}
+
+// Shift that brings the signal's least significant bit to bit 0 of the
+// payload word, or -1 if the signal does not fit in 8 bytes.
+static int dbc_shift(const struct dbc_parsed_signal *sig) {
+    if (!sig->big_endian) {
+        return sig->start + sig->len <= 64 ? (int)sig->start : -1;
+    }
+
+    // Motorola start bits name the MSB in sawtooth order; convert it to a
+    // position counted from the most significant bit of the big endian word.
+    int msb = (sig->start / 8) * 8 + (7 - sig->start % 8);
+    int shift = 64 - msb - (int)sig->len;
+
+    return shift >= 0 ? shift : -1;
+}
+
+static bool dbc_compile(struct usbcan_dbc *dbc,
+                        struct dbc_parsed_signal *sigs) {
+    uint32_t n = dbc->num_signals;
+
+    dbc->names = (char **)calloc(n + 1, sizeof(char *));
+    dbc->signal_msgs = (uint32_t *)calloc(n + 1, sizeof(uint32_t));
+    dbc->shifts = (uint8_t *)calloc(n + 1, sizeof(uint8_t));
+    dbc->big_endian = (uint8_t *)calloc(n + 1, sizeof(uint8_t));
+    dbc->masks = (uint64_t *)calloc(n + 1, sizeof(uint64_t));
+    dbc->signs = (uint64_t *)calloc(n + 1, sizeof(uint64_t));
+    dbc->factors = (double *)calloc(n + 1, sizeof(double));
+    dbc->offsets = (double *)calloc(n + 1, sizeof(double));
+    dbc->mux_values = (int32_t *)calloc(n + 1, sizeof(int32_t));
+
+    if (dbc->names == NULL || dbc->signal_msgs == NULL ||
+        dbc->shifts == NULL || dbc->big_endian == NULL ||
+        dbc->masks == NULL || dbc->signs == NULL || dbc->factors == NULL ||
+        dbc->offsets == NULL || dbc->mux_values == NULL) {
+        return false;
+    }
+
+    for (uint32_t s = 0; s < n; s++) {
+        int shift = dbc_shift(&sigs[s]);
+        if (shift < 0) {
+            return false;
+        }
+
+        dbc->names[s] = sigs[s].name;
+        sigs[s].name = NULL;
+        dbc->signal_msgs[s] = sigs[s].msg;
+        dbc->shifts[s] = (uint8_t)shift;
+        dbc->big_endian[s] = sigs[s].big_endian;
+        dbc->masks[s] =
+            sigs[s].len == 64 ? ~(uint64_t)0 : ((uint64_t)1 << sigs[s].len) - 1;
+        dbc->signs[s] =
+            sigs[s].is_signed ? (uint64_t)1 << (sigs[s].len - 1) : 0;
+        dbc->factors[s] = sigs[s].factor;
+        dbc->offsets[s] = sigs[s].offset;
+        dbc->mux_values[s] = sigs[s].mux_value;
+
+        if (sigs[s].multiplexor) {
+            dbc->msgs[sigs[s].msg].mux = (int32_t)s;
+        }
+    }
+
+    uint32_t num_eff = 0;
+    for (uint32_t m = 0; m < dbc->num_msgs; m++) {
+        num_eff += (dbc->msgs[m].can_id & CAN_EFF_FLAG) > 0;
+    }
+
+    uint32_t cap = 1;
+    while (cap < 2 * num_eff + 1) {
+        cap <<= 1;
+    }
+    dbc->eff_mask = cap - 1;
+    dbc->eff_ids = (canid_t *)calloc(cap, sizeof(canid_t));
+    dbc->eff_msgs = (int32_t *)malloc(cap * sizeof(int32_t));
+    if (dbc->eff_ids == NULL || dbc->eff_msgs == NULL) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < cap; i++) {
+        dbc->eff_msgs[i] = -1;
+    }
+    for (uint32_t i = 0; i <= CAN_SFF_MASK; i++) {
+        dbc->sff[i] = -1;
+    }
+
+    // Earlier definitions of an ID take precedence over later ones.
+    for (uint32_t m = 0; m < dbc->num_msgs; m++) {
+        canid_t can_id = dbc->msgs[m].can_id;
+        if (dbc_lookup(dbc, can_id) >= 0) {
+            continue;
+        }
+
+        if ((can_id & CAN_EFF_FLAG) == 0) {
+            dbc->sff[can_id] = (int32_t)m;
+            continue;
+        }
+
+        canid_t id = can_id & CAN_EFF_MASK;
+        uint32_t h = dbc_hash(id);
+        while (dbc->eff_msgs[h & dbc->eff_mask] >= 0) {
+            h++;
+        }
+        dbc->eff_ids[h & dbc->eff_mask] = id;
+        dbc->eff_msgs[h & dbc->eff_mask] = (int32_t)m;
+    }
+
+    return true;
+}
+
+struct usbcan_dbc *usbcan_dbc_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return NULL;
+    }
+
+    struct usbcan_dbc *dbc =
+        (struct usbcan_dbc *)calloc(1, sizeof(struct usbcan_dbc));
+    struct dbc_parsed_signal *sigs = NULL;
+    uint32_t msgs_cap = 0, sigs_cap = 0;
+    bool status = dbc != NULL;
+    bool in_msg = false; // signals belong to the last BO_ that parsed
+    char line[DBC_LINE_LEN];
+
+    while (status && fgets(line, sizeof(line), f) != NULL) {
+        const char *p = line + strspn(line, " \t");
+
+        if (strncmp(p, "BO_ ", 4) == 0) {
+            if (dbc->num_msgs == msgs_cap) {
+                msgs_cap = msgs_cap > 0 ? 2 * msgs_cap : 64;
+                struct dbc_msg *msgs = (struct dbc_msg *)realloc(
+                    dbc->msgs, msgs_cap * sizeof(struct dbc_msg));
+                if (msgs == NULL) {
+                    status = false;
+                    break;
+                }
+                dbc->msgs = msgs;
+            }
+
+            struct dbc_msg *msg = &dbc->msgs[dbc->num_msgs];
+            in_msg = dbc_parse_msg(p, msg);
+            if (in_msg) {
+                msg->first = dbc->num_signals;
+                dbc->num_msgs++;
+            }
+        } else if (strncmp(p, "SG_ ", 4) == 0 && in_msg) {
+            if (dbc->num_signals == sigs_cap) {
+                sigs_cap = sigs_cap > 0 ? 2 * sigs_cap : 256;
+                struct dbc_parsed_signal *grown =
+                    (struct dbc_parsed_signal *)realloc(
+                        sigs, sigs_cap * sizeof(struct dbc_parsed_signal));
+                if (grown == NULL) {
+                    status = false;
+                    break;
+                }
+                sigs = grown;
+            }
+
+            struct dbc_parsed_signal *sig = &sigs[dbc->num_signals];
+            if (!dbc_parse_signal(p, sig)) {
+                status = false;
+                break;
+            }
+            sig->msg = dbc->num_msgs - 1;
+            dbc->msgs[sig->msg].num++;
+            dbc->num_signals++;
+        }
+    }
+
+    fclose(f);
+
+    if (status) {
+        status = dbc_compile(dbc, sigs);
+    }
+
+    if (sigs != NULL) {
+        for (uint32_t s = 0; s < dbc->num_signals; s++) {
+            free(sigs[s].name);
+        }
+        free(sigs);
+    }
+
+    if (!status) {
+        usbcan_dbc_free(dbc);
+        return NULL;
+    }
+
+    return dbc;
+}
+
+void usbcan_dbc_free(struct usbcan_dbc *dbc) {
+    if (dbc == NULL) {
+        return;
+    }
+
+    if (dbc->names != NULL) {
+        for (uint32_t s = 0; s < dbc->num_signals; s++) {
+            free(dbc->names[s]);
+        }
+    }
+
+    free(dbc->msgs);
+    free(dbc->names);
+    free(dbc->signal_msgs);
+    free(dbc->shifts);
+    free(dbc->big_endian);
+    free(dbc->masks);
+    free(dbc->signs);
+    free(dbc->factors);
+    free(dbc->offsets);
+    free(dbc->mux_values);
+    free(dbc->eff_ids);
+    free(dbc->eff_msgs);
+    free(dbc);
+}
+
+uint32_t usbcan_dbc_num_signals(const struct usbcan_dbc *dbc) {
+    return dbc->num_signals;
+}
+
+int32_t usbcan_dbc_find_signal(const struct usbcan_dbc *dbc,
+                               const char *name) {
+    for (uint32_t s = 0; s < dbc->num_signals; s++) {
+        if (strcmp(dbc->names[s], name) == 0) {
+            return (int32_t)s;
+        }
+    }
+
+    return -1;
+}
+
+const char *usbcan_dbc_signal_name(const struct usbcan_dbc *dbc,
+                                   uint32_t signal) {
+    return signal < dbc->num_signals ? dbc->names[signal] : NULL;
+}
+
+canid_t usbcan_dbc_signal_can_id(const struct usbcan_dbc *dbc,
+                                 uint32_t signal) {
+    return signal < dbc->num_signals
+        ? dbc->msgs[dbc->signal_msgs[signal]].can_id
+        : 0;
+}
+
+// Decodes whole frames until out is full, returning the number of frames
+// consumed; frames without a DBC definition are skipped.
+uint32_t usbcan_dbc_decode(const struct usbcan_dbc *dbc,
+                           const struct usbcan_msg *msgs, uint32_t n,
+                           struct usbcan_dbc_values *out) {
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        int32_t m = dbc_lookup(dbc, msgs[i].frame.can_id);
+        if (m < 0) {
+            continue;
+        }
+
+        const struct dbc_msg *msg = &dbc->msgs[m];
+        if (out->cap - out->n < msg->num) {
+            break;
+        }
+
+        const uint8_t *d = msgs[i].frame.data;
+        uint64_t le = (uint64_t)d[0] | (uint64_t)d[1] << 8 |
+            (uint64_t)d[2] << 16 | (uint64_t)d[3] << 24 |
+            (uint64_t)d[4] << 32 | (uint64_t)d[5] << 40 |
+            (uint64_t)d[6] << 48 | (uint64_t)d[7] << 56;
+        uint64_t be = (uint64_t)d[7] | (uint64_t)d[6] << 8 |
+            (uint64_t)d[5] << 16 | (uint64_t)d[4] << 24 |
+            (uint64_t)d[3] << 32 | (uint64_t)d[2] << 40 |
+            (uint64_t)d[1] << 48 | (uint64_t)d[0] << 56;
+
+        uint32_t first = msg->first, last = msg->first + msg->num;
+        uint32_t *signals = out->signals + out->n;
+        uint32_t *timestamps = out->timestamps + out->n;
+        double *values = out->values + out->n;
+
+        for (uint32_t s = first; s < last; s++) {
+            uint64_t word = dbc->big_endian[s] ? be : le;
+            uint64_t raw = (word >> dbc->shifts[s]) & dbc->masks[s];
+            int64_t v = (int64_t)((raw ^ dbc->signs[s]) - dbc->signs[s]);
+
+            signals[s - first] = s;
+            timestamps[s - first] = msgs[i].timestamp;
+            values[s - first] = (double)v * dbc->factors[s] + dbc->offsets[s];
+        }
+
+        uint32_t written = msg->num;
+
+        // Multiplexed messages are compacted after the fact so the loop
+        // above stays free of data-dependent branches.
+        if (msg->mux != DBC_NO_MUX) {
+            int32_t x = msg->mux;
+            int32_t mux = (int32_t)(((dbc->big_endian[x] ? be : le) >>
+                                     dbc->shifts[x]) &
+                                    dbc->masks[x]);
+            written = 0;
+            for (uint32_t s = first; s < last; s++) {
+                if (dbc->mux_values[s] == DBC_NO_MUX ||
+                    dbc->mux_values[s] == mux) {
+                    signals[written] = signals[s - first];
+                    timestamps[written] = timestamps[s - first];
+                    values[written] = values[s - first];
+                    written++;
+                }
+            }
+        }
+
+        out->n += written;
+    }
+
+    return i;
+}
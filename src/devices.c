@@ -0,0 +1,210 @@
+/*
+
+  devices.c -- adapter enumeration, binding by serial number and
+               concurrent bring-up
+
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "usbcan.h"
+#include "ginkgo.h"
+#include "usbcan_internal.h"
+
+/*
+  Every call into the driver is a USB round trip, and opening an adapter
+  takes far longer than that, but calls for different adapters do not
+  wait on each other. Enumeration therefore opens and queries each
+  adapter from its own thread, and usbcan_init_all brings up each
+  adapter's buses from a thread per adapter. Board information is read
+  once per library_init, the first time it is asked for.
+*/
+
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *devices_read_info(void *arg) {
+    uint32_t dev = (uint32_t)(uintptr_t)arg;
+    struct usbcan_dev *d = &state.devs[dev];
+
+    if (usbcan_dev_init(dev, false) &&
+        VCI_ReadBoardInfoEx(dev, &d->info) != STATUS_ERR) {
+        d->info_valid = true;
+    }
+    d->info_read = true;
+
+    return NULL;
+}
+
+static void devices_enumerate() {
+    pthread_mutex_lock(&devices_lock);
+
+    uint32_t num_devs = state.num_devs;
+    pthread_t *threads = (pthread_t *)calloc(num_devs, sizeof(pthread_t));
+    bool *started = (bool *)calloc(num_devs, sizeof(bool));
+
+    for (uint32_t dev = 0; dev < num_devs; dev++) {
+        if (state.devs[dev].info_read) {
+            continue;
+        }
+
+        if (threads == NULL || started == NULL ||
+            pthread_create(&threads[dev], NULL, devices_read_info,
+                           (void *)(uintptr_t)dev) != 0) {
+            devices_read_info((void *)(uintptr_t)dev);
+        } else {
+            started[dev] = true;
+        }
+    }
+
+    for (uint32_t dev = 0; dev < num_devs; dev++) {
+        if (started != NULL && started[dev]) {
+            pthread_join(threads[dev], NULL);
+        }
+    }
+
+    free(started);
+    free(threads);
+    pthread_mutex_unlock(&devices_lock);
+}
+
+uint32_t usbcan_num_devs() {
+    return state.num_devs;
+}
+
+bool usbcan_get_dev_info(uint32_t dev, struct usbcan_dev_info *info) {
+    if (state.num_devs <= dev) {
+        return false;
+    }
+
+    devices_enumerate();
+
+    struct usbcan_dev *d = &state.devs[dev];
+    if (!d->info_valid) {
+        return false;
+    }
+
+    memset(info, 0, sizeof(*info));
+    memcpy(info->product, d->info.ProductName, sizeof(d->info.ProductName));
+    memcpy(info->firmware, d->info.FirmwareVersion, sizeof(info->firmware));
+    memcpy(info->hardware, d->info.HardwareVersion, sizeof(info->hardware));
+
+    // The serial number is 12 raw bytes, any of which may be zero.
+    for (uint32_t i = 0; i < sizeof(d->info.SerialNumber); i++) {
+        snprintf(info->serial + i * 2, 3, "%02X", d->info.SerialNumber[i]);
+    }
+
+    return true;
+}
+
+bool usbcan_find_dev(const char *serial, uint32_t *dev) {
+    struct usbcan_dev_info info;
+
+    for (uint32_t i = 0; i < state.num_devs; i++) {
+        if (usbcan_get_dev_info(i, &info) &&
+            strcasecmp(info.serial, serial) == 0) {
+            *dev = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+struct devices_init {
+    struct usbcan_bus_init *inits;
+    uint32_t n;
+    uint32_t dev;
+};
+
+static void *devices_init_dev(void *arg) {
+    struct devices_init *di = (struct devices_init *)arg;
+
+    for (uint32_t i = 0; i < di->n; i++) {
+        struct usbcan_bus_init *init = &di->inits[i];
+        if (init->status && init->dev == di->dev) {
+            init->status = usbcan_init(init->dev, init->bus, init->config);
+        }
+    }
+
+    return NULL;
+}
+
+bool usbcan_init_all(struct usbcan_bus_init *inits, uint32_t n) {
+    uint32_t num_devs = state.num_devs;
+    if (num_devs == 0) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        inits[i].status = inits[i].serial == NULL
+            ? inits[i].dev < num_devs
+            : usbcan_find_dev(inits[i].serial, &inits[i].dev);
+    }
+
+    pthread_t *threads = (pthread_t *)calloc(num_devs, sizeof(pthread_t));
+    struct devices_init *dis =
+        (struct devices_init *)calloc(num_devs, sizeof(struct devices_init));
+    bool *started = (bool *)calloc(num_devs, sizeof(bool));
+
+    // Buses of one adapter are brought up in order by one thread.
+    for (uint32_t dev = 0; dev < num_devs; dev++) {
+        bool wanted = false;
+        for (uint32_t i = 0; i < n; i++) {
+            wanted = wanted || (inits[i].status && inits[i].dev == dev);
+        }
+        if (!wanted) {
+            continue;
+        }
+
+        struct devices_init local = {inits, n, dev};
+        if (threads == NULL || dis == NULL || started == NULL) {
+            devices_init_dev(&local);
+            continue;
+        }
+
+        dis[dev] = local;
+        if (pthread_create(&threads[dev], NULL, devices_init_dev, &dis[dev]) !=
+            0) {
+            devices_init_dev(&dis[dev]);
+        } else {
+            started[dev] = true;
+        }
+    }
+
+    for (uint32_t dev = 0; dev < num_devs; dev++) {
+        if (started != NULL && started[dev]) {
+            pthread_join(threads[dev], NULL);
+        }
+    }
+
+    free(started);
+    free(dis);
+    free(threads);
+
+    bool status = true;
+    for (uint32_t i = 0; i < n; i++) {
+        status = status && inits[i].status;
+    }
+
+    return status;
+}
@@ -0,0 +1,265 @@
+/*
+
+  errors.c -- receive overflow and controller error monitoring
+
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "usbcan.h"
+#include "ginkgo.h"
+#include "usbcan_internal.h"
+
+/*
+  Overflow of the driver's receive buffer is detected for free: the
+  dispatcher already asks how many frames are waiting, and a full buffer
+  means frames were turned away since the last drain. How many is
+  estimated from the recent receive rate over the time since that drain,
+  and the bus keeps draining until the buffer is back under a quarter
+  full.
+
+  Reading the controller's error code and counters costs two round trips
+  to the adapter, so with USBCAN_FLAG_ERRORS they are sampled at most
+  once per interval from the receive path, or sooner after an overflow
+  or a failed read. Each sample that shows an error or a change of error
+  state becomes one SocketCAN error frame in the bus's normal stream.
+*/
+
+#define ERRORS_ACTIVE 0
+#define ERRORS_WARNING 1
+#define ERRORS_PASSIVE 2
+#define ERRORS_BUS_OFF 3
+
+#define ERRORS_WARNING_LIMIT 96
+#define ERRORS_PASSIVE_LIMIT 128
+
+void usbcan_errors_init(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+                        struct usbcan_bus_config *config) {
+    VCI_CAN_STATUS status;
+    memset(&status, 0, sizeof(status));
+    if (VCI_ReadCANStatus(state.type, dev, bus, &status) == STATUS_ERR) {
+        status.BufferSize = 0;
+    }
+
+    uint32_t interval_ms = config->error_interval_ms > 0
+        ? config->error_interval_ms
+        : USBCAN_ERROR_INTERVAL_MS;
+
+    pthread_mutex_lock(&b->rx_lock);
+    memset(&b->errors, 0, sizeof(b->errors));
+    b->errors.enabled = (config->flags & USBCAN_FLAG_ERRORS) > 0;
+    b->errors.buffer_size = status.BufferSize;
+    b->errors.interval_us = (uint64_t)interval_ms * 1000;
+    b->errors.last_us = usbcan_now_us();
+    pthread_mutex_unlock(&b->rx_lock);
+}
+
+// Called with the number of frames waiting at the start of a dispatch.
+void usbcan_errors_received(struct usbcan_bus *b, uint32_t avail,
+                            uint64_t now_us) {
+    struct usbcan_errors *e = &b->errors;
+    uint64_t gap_us = now_us - e->last_us;
+    e->last_us = now_us;
+
+    if (e->buffer_size > 0 && avail >= e->buffer_size) {
+        // Frames went on arriving at about the recent rate while the
+        // buffer was full; at least one was lost.
+        uint64_t expected = e->rate * gap_us / 1000000;
+        uint64_t lost = expected > avail ? expected - avail : 1;
+
+        usbcan_count(&b->stats.overflows, 1);
+        usbcan_count(&b->stats.lost, lost);
+        e->overflow = true;
+        e->draining = true;
+        e->due = true;
+        return;
+    }
+
+    if (avail <= e->buffer_size / 4) {
+        e->draining = false;
+    }
+
+    // Frames per second, smoothed over about eight dispatches. Also used
+    // by adaptive coalescing.
+    if (gap_us > 0) {
+        uint64_t rate = (uint64_t)avail * 1000000 / gap_us;
+        e->rate = (e->rate * 7 + rate) / 8;
+    }
+}
+
+static uint8_t errors_state(uint32_t code, PVCI_CAN_STATUS status) {
+    uint8_t counter = status->regTECounter > status->regRECounter
+        ? status->regTECounter
+        : status->regRECounter;
+
+    if ((code & ERR_CAN_BUSOFF) > 0 || (status->regESR & 0x4) > 0) {
+        return ERRORS_BUS_OFF;
+    }
+    if (counter >= ERRORS_PASSIVE_LIMIT) {
+        return ERRORS_PASSIVE;
+    }
+    if (counter >= ERRORS_WARNING_LIMIT) {
+        return ERRORS_WARNING;
+    }
+
+    return ERRORS_ACTIVE;
+}
+
+// Maps the last error code of the controller's error status register.
+static void errors_protocol(struct can_frame *frame, uint32_t esr) {
+    switch ((esr >> 4) & 0x7) {
+    case 1:
+        frame->data[2] = CAN_ERR_PROT_STUFF;
+        break;
+    case 2:
+        frame->data[2] = CAN_ERR_PROT_FORM;
+        break;
+    case 3:
+        frame->can_id |= CAN_ERR_ACK;
+        frame->data[3] = CAN_ERR_PROT_LOC_ACK;
+        break;
+    case 4:
+        frame->data[2] = CAN_ERR_PROT_BIT1;
+        break;
+    case 5:
+        frame->data[2] = CAN_ERR_PROT_BIT0;
+        break;
+    case 6:
+        frame->data[3] = CAN_ERR_PROT_LOC_CRC_SEQ;
+        break;
+    }
+}
+
+// Samples the controller if a sample is due and writes an error frame to
+// msg if there is anything to report. Called with rx_lock held.
+bool usbcan_errors_sample(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+                          struct usbcan_msg *msg, uint64_t now_us) {
+    struct usbcan_errors *e = &b->errors;
+    if (!e->enabled || (!e->due && now_us - e->sample_us < e->interval_us)) {
+        return false;
+    }
+
+    e->due = false;
+    e->sample_us = now_us;
+
+    VCI_ERR_INFO info;
+    memset(&info, 0, sizeof(info));
+    if (VCI_ReadErrInfo(state.type, dev, bus, &info) == STATUS_ERR) {
+        info.ErrCode = 0;
+    }
+
+    VCI_CAN_STATUS status;
+    memset(&status, 0, sizeof(status));
+    if (VCI_ReadCANStatus(state.type, dev, bus, &status) == STATUS_ERR) {
+        return false;
+    }
+
+    memset(msg, 0, sizeof(*msg));
+    msg->timestamp = e->timestamp;
+
+    struct can_frame *frame = &msg->frame;
+    frame->can_id = CAN_ERR_FLAG | CAN_ERR_CNT;
+    frame->can_dlc = CAN_ERR_DLC;
+    frame->data[6] = status.regTECounter;
+    frame->data[7] = status.regRECounter;
+
+    uint32_t code = info.ErrCode;
+    if ((code & (ERR_CAN_OVERFLOW | ERR_BUFFEROVERFLOW)) > 0 && !e->overflow) {
+        // Reported by the adapter rather than seen by the dispatcher, so
+        // only the one frame known to be lost is counted.
+        usbcan_count(&b->stats.overflows, 1);
+        usbcan_count(&b->stats.lost, 1);
+        e->overflow = true;
+    }
+
+    if (e->overflow) {
+        frame->can_id |= CAN_ERR_CRTL;
+        frame->data[1] |= CAN_ERR_CRTL_RX_OVERFLOW;
+        e->overflow = false;
+    }
+
+    if ((code & ERR_CAN_LOSE) > 0) {
+        frame->can_id |= CAN_ERR_LOSTARB;
+        frame->data[0] = info.ArLost_ErrData & 0x1F;
+    }
+
+    if ((code & ERR_CAN_BUSERR) > 0) {
+        frame->can_id |= CAN_ERR_PROT | CAN_ERR_BUSERROR;
+        errors_protocol(frame, status.regESR);
+    }
+
+    uint8_t error_state = errors_state(code, &status);
+    if (error_state != e->state) {
+        uint8_t tec = status.regTECounter;
+        uint8_t rec = status.regRECounter;
+
+        switch (error_state) {
+        case ERRORS_BUS_OFF:
+            frame->can_id |= CAN_ERR_BUSOFF;
+            break;
+        case ERRORS_PASSIVE:
+            frame->can_id |= CAN_ERR_CRTL;
+            frame->data[1] |=
+                (tec >= ERRORS_PASSIVE_LIMIT ? CAN_ERR_CRTL_TX_PASSIVE : 0) |
+                (rec >= ERRORS_PASSIVE_LIMIT ? CAN_ERR_CRTL_RX_PASSIVE : 0);
+            break;
+        case ERRORS_WARNING:
+            frame->can_id |= CAN_ERR_CRTL;
+            frame->data[1] |=
+                (tec >= ERRORS_WARNING_LIMIT ? CAN_ERR_CRTL_TX_WARNING : 0) |
+                (rec >= ERRORS_WARNING_LIMIT ? CAN_ERR_CRTL_RX_WARNING : 0);
+            break;
+        case ERRORS_ACTIVE:
+            frame->can_id |= CAN_ERR_CRTL;
+            frame->data[1] |= CAN_ERR_CRTL_ACTIVE;
+            break;
+        }
+        e->state = error_state;
+    }
+
+    if ((frame->can_id & ~(CAN_ERR_FLAG | CAN_ERR_CNT)) == 0) {
+        return false;
+    }
+
+    usbcan_count(&b->stats.errors, 1);
+
+    return true;
+}
+
+bool usbcan_sample_errors(uint32_t dev, uint32_t bus) {
+    struct usbcan_bus *b = usbcan_get_bus(dev, bus);
+    if (b == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&b->rx_lock);
+    bool status = b->errors.enabled;
+    b->errors.due = status;
+
+    // Polled buses pick the frame up on their next usbcan_poll.
+    struct usbcan_msg msg;
+    if (status && !b->poll &&
+        usbcan_errors_sample(dev, bus, b, &msg, usbcan_now_us())) {
+        usbcan_deliver(dev, bus, b, &msg, 1);
+    }
+    pthread_mutex_unlock(&b->rx_lock);
+
+    return status;
+}
@@ -0,0 +1,209 @@
+/*
+
+  filters.c -- incremental hardware filter programming
+
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "usbcan.h"
+#include "ginkgo.h"
+#include "usbcan_internal.h"
+
+/*
+  Every VCI_SetFilter is a synchronous round trip to the adapter, so each
+  bus remembers what its 14 banks hold and a change only rewrites banks
+  whose contents differ. A filter already held by some bank stays where
+  it is, however the list was reordered.
+
+  A frame passes if any enabled bank matches it. New filters are written
+  into disabled banks first, then over banks holding filters that are
+  going away, and leftover banks are disabled last, so while a change is
+  under way the bus passes at most the union of the old and new filters,
+  and, as long as enough banks are free, never blocks an ID both of them
+  pass. Banks are unknown until first written, again after a failed
+  write, and again whenever the controller is initialized or reset,
+  which may clear them; unknown banks are always rewritten.
+*/
+
+static void filters_bank(struct can_filter *filter, VCI_FILTER_CONFIG *config) {
+    memset(config, 0, sizeof(*config));
+    config->Enable = 1;
+    config->FilterMode = filter->can_mask == 0 && filter->can_id > 0 ? 0 : 1;
+    config->ID_IDE = (filter->can_id & CAN_EFF_FLAG) > 0 ? 1 : 0;
+    config->ID_RTR = (filter->can_id & CAN_RTR_FLAG) > 0 ? 1 : 0;
+    config->ID_Std_Ext = (filter->can_id & CAN_EFF_FLAG) > 0
+        ? filter->can_id & CAN_EFF_MASK
+        : filter->can_id & CAN_SFF_MASK;
+    config->MASK_IDE = (filter->can_mask & CAN_EFF_FLAG) > 0 ? 1 : 0;
+    config->MASK_RTR = (filter->can_mask & CAN_RTR_FLAG) > 0 ? 1 : 0;
+    config->MASK_Std_Ext = (filter->can_mask & CAN_EFF_FLAG) > 0
+        ? filter->can_mask & CAN_EFF_MASK
+        : filter->can_mask & CAN_SFF_MASK;
+}
+
+static bool filters_equal(VCI_FILTER_CONFIG *a, VCI_FILTER_CONFIG *b) {
+    return a->Enable == b->Enable && a->FilterMode == b->FilterMode &&
+        a->ExtFrame == b->ExtFrame && a->ID_Std_Ext == b->ID_Std_Ext &&
+        a->ID_IDE == b->ID_IDE && a->ID_RTR == b->ID_RTR &&
+        a->MASK_Std_Ext == b->MASK_Std_Ext && a->MASK_IDE == b->MASK_IDE &&
+        a->MASK_RTR == b->MASK_RTR;
+}
+
+static bool filters_write(uint32_t dev, uint32_t bus, struct usbcan_filters *f,
+                          uint8_t i, VCI_FILTER_CONFIG *config) {
+    f->banks[i] = *config;
+    f->banks[i].FilterIndex = i;
+    f->known[i] = false;
+
+    if (VCI_SetFilter(state.type, dev, bus, &f->banks[i]) == STATUS_ERR) {
+        return false;
+    }
+
+    f->known[i] = true;
+
+    return true;
+}
+
+// Moves the banks from their cached contents to the wanted configs.
+// Called with the device lock held.
+static bool filters_program(uint32_t dev, uint32_t bus,
+                            struct usbcan_filters *f, VCI_FILTER_CONFIG *wanted,
+                            uint8_t num_wanted) {
+    bool taken[MAX_FILTERS];
+    bool placed[MAX_FILTERS];
+    memset(taken, 0, sizeof(taken));
+    memset(placed, 0, sizeof(placed));
+
+    // Filters already in a bank stay there.
+    for (uint8_t w = 0; w < num_wanted; w++) {
+        for (uint8_t i = 0; i < MAX_FILTERS; i++) {
+            if (!taken[i] && f->known[i] &&
+                filters_equal(&f->banks[i], &wanted[w])) {
+                taken[i] = true;
+                placed[w] = true;
+                break;
+            }
+        }
+    }
+
+    // Additions go into disabled banks, then over banks being replaced.
+    for (int pass = 0; pass < 2; pass++) {
+        uint8_t i = 0;
+        for (uint8_t w = 0; w < num_wanted; w++) {
+            if (placed[w]) {
+                continue;
+            }
+
+            while (i < MAX_FILTERS &&
+                   (taken[i] ||
+                    (pass == 0 && !(f->known[i] && f->banks[i].Enable == 0)))) {
+                i++;
+            }
+            if (i == MAX_FILTERS) {
+                break;
+            }
+
+            taken[i] = true;
+            placed[w] = true;
+            if (!filters_write(dev, bus, f, i, &wanted[w])) {
+                return false;
+            }
+        }
+    }
+
+    VCI_FILTER_CONFIG disabled;
+    memset(&disabled, 0, sizeof(disabled));
+
+    for (uint8_t i = 0; i < MAX_FILTERS; i++) {
+        if (!taken[i] &&
+            !(f->known[i] && filters_equal(&f->banks[i], &disabled))) {
+            if (!filters_write(dev, bus, f, i, &disabled)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool usbcan_set_filters(uint32_t dev, uint32_t bus, struct can_filter *filters,
+                        uint8_t num_filters) {
+    struct usbcan_bus *b = usbcan_get_bus(dev, bus);
+    if (b == NULL || num_filters >= MAX_FILTERS) {
+        return false;
+    }
+
+    if (num_filters == 0) {
+        return usbcan_clear_filters(dev, bus);
+    }
+
+    VCI_FILTER_CONFIG wanted[MAX_FILTERS];
+    uint8_t num_wanted = 0;
+
+    for (uint8_t i = 0; i < num_filters; i++) {
+        filters_bank(&filters[i], &wanted[num_wanted]);
+
+        bool duplicate = false;
+        for (uint8_t w = 0; w < num_wanted; w++) {
+            duplicate =
+                duplicate || filters_equal(&wanted[w], &wanted[num_wanted]);
+        }
+        if (!duplicate) {
+            num_wanted++;
+        }
+    }
+
+    pthread_mutex_lock(&state.devs[dev].lock);
+    bool status = filters_program(dev, bus, &b->filters, wanted, num_wanted);
+    pthread_mutex_unlock(&state.devs[dev].lock);
+
+    return status;
+}
+
+bool usbcan_clear_filters(uint32_t dev, uint32_t bus) {
+    struct usbcan_bus *b = usbcan_get_bus(dev, bus);
+    if (b == NULL) {
+        return false;
+    }
+
+    // One bank in mask mode with a zero mask passes every frame.
+    VCI_FILTER_CONFIG pass_all;
+    memset(&pass_all, 0, sizeof(pass_all));
+    pass_all.Enable = 1;
+
+    pthread_mutex_lock(&state.devs[dev].lock);
+    bool status = filters_program(dev, bus, &b->filters, &pass_all, 1);
+    pthread_mutex_unlock(&state.devs[dev].lock);
+
+    return status;
+}
+
+// Called when the controller is initialized or reset.
+void usbcan_filters_forget(uint32_t dev, uint32_t bus) {
+    struct usbcan_bus *b = usbcan_get_bus(dev, bus);
+    if (b == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&state.devs[dev].lock);
+    memset(b->filters.known, 0, sizeof(b->filters.known));
+    pthread_mutex_unlock(&state.devs[dev].lock);
+}
@@ -0,0 +1,449 @@
+/*
+
+  isotp.c -- ISO 15765-2 (ISO-TP) transport over libusbcan buses
+
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "usbcan.h"
+#include "usbcan_isotp.h"
+#include "usbcan_internal.h"
+
+/*
+  Sessions use normal addressing on classic CAN. Received frames are fed
+  to every session of the bus by the dispatcher, which reassembles
+  messages and answers first and consecutive frames with flow control
+  from the driver thread. usbcan_isotp_send runs on the caller's thread:
+  it sends the first frame, then for every flow control sends a block of
+  consecutive frames. With an STmin of 0 a block goes out in batches of
+  ISOTP_BATCH frames per usbcan_send_n; otherwise each frame is paced
+  against an absolute deadline so sleep overshoot does not accumulate.
+  The driver thread would never receive the flow control it waits for,
+  so session callbacks, and anything else it runs, may only send single
+  frames.
+  First frames with the 32-bit length escape are sent and accepted, so
+  messages are not limited to 4095 bytes.
+*/
+
+#define ISOTP_SF 0x0
+#define ISOTP_FF 0x1
+#define ISOTP_CF 0x2
+#define ISOTP_FC 0x3
+
+#define ISOTP_FC_CTS 0x0
+#define ISOTP_FC_WAIT 0x1
+#define ISOTP_FC_OVFLW 0x2
+
+#define ISOTP_BATCH 64
+#define ISOTP_MAX_WAITS 16
+#define ISOTP_TIMEOUT_MS 1000
+
+struct usbcan_isotp {
+    uint32_t dev;
+    uint32_t bus;
+    struct usbcan_isotp_config config;
+    struct usbcan_isotp *next;
+
+    // Receive state, touched only by the dispatcher.
+    uint8_t *rx_buf;
+    uint32_t rx_cap;
+    uint32_t rx_len;
+    uint32_t rx_pos;
+    uint8_t rx_sn;
+    uint8_t rx_block;
+    bool rx_active;
+
+    // Transmit state. send_lock serializes senders; lock and cond hand
+    // flow control frames from the dispatcher to the sender.
+    pthread_mutex_t send_lock;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool tx_active;
+    bool fc_ready;
+    uint8_t fc_status;
+    uint8_t fc_bs;
+    uint8_t fc_st_min;
+};
+
+static uint32_t isotp_st_min_us(uint8_t st_min) {
+    if (st_min <= 0x7F) {
+        return st_min * 1000;
+    }
+
+    if (st_min >= 0xF1 && st_min <= 0xF9) {
+        return (st_min - 0xF0) * 100;
+    }
+
+    // Reserved values are to be treated as the maximum.
+    return 0x7F * 1000;
+}
+
+static void isotp_frame(struct usbcan_isotp *s, struct can_frame *frame,
+                        const uint8_t *data, uint8_t len) {
+    memset(frame, 0, sizeof(*frame));
+    frame->can_id = s->config.tx_id;
+    memcpy(frame->data, data, len);
+
+    if (s->config.pad) {
+        memset(frame->data + len, s->config.pad_byte, 8 - len);
+        len = 8;
+    }
+    frame->can_dlc = len;
+}
+
+static void isotp_send_fc(struct usbcan_isotp *s, uint8_t status) {
+    uint8_t fc[3] = {ISOTP_FC << 4 | status, s->config.block_size,
+                     s->config.st_min};
+    struct can_frame frame;
+
+    isotp_frame(s, &frame, fc, sizeof(fc));
+    usbcan_send(s->dev, s->bus, &frame);
+}
+
+static void isotp_rx_complete(struct usbcan_isotp *s) {
+    s->rx_active = false;
+    if (s->config.cb != NULL) {
+        s->config.cb(s, s->rx_buf, s->rx_len, s->config.arg);
+    }
+}
+
+static void isotp_rx_first(struct usbcan_isotp *s, const uint8_t *data,
+                           uint8_t dlc) {
+    uint32_t len = (uint32_t)(data[0] & 0x0F) << 8 | data[1];
+    uint8_t header = 2;
+
+    if (len == 0 && dlc == 8) {
+        len = (uint32_t)data[2] << 24 | (uint32_t)data[3] << 16 |
+            (uint32_t)data[4] << 8 | data[5];
+        header = 6;
+    }
+
+    if (dlc < 8 || len < 8) {
+        s->rx_active = false;
+        return;
+    }
+
+    uint32_t max_len =
+        s->config.max_len > 0 ? s->config.max_len : USBCAN_ISOTP_MAX_LEN;
+    if (len > max_len) {
+        s->rx_active = false;
+        isotp_send_fc(s, ISOTP_FC_OVFLW);
+        return;
+    }
+
+    if (s->rx_cap < len) {
+        uint8_t *rx_buf = (uint8_t *)realloc(s->rx_buf, len);
+        if (rx_buf == NULL) {
+            s->rx_active = false;
+            isotp_send_fc(s, ISOTP_FC_OVFLW);
+            return;
+        }
+        s->rx_buf = rx_buf;
+        s->rx_cap = len;
+    }
+
+    s->rx_len = len;
+    s->rx_pos = 8 - header;
+    memcpy(s->rx_buf, data + header, s->rx_pos);
+    s->rx_sn = 1;
+    s->rx_block = 0;
+    s->rx_active = true;
+
+    isotp_send_fc(s, ISOTP_FC_CTS);
+}
+
+static void isotp_rx_consecutive(struct usbcan_isotp *s, const uint8_t *data,
+                                 uint8_t dlc) {
+    if (!s->rx_active) {
+        return;
+    }
+
+    if ((data[0] & 0x0F) != s->rx_sn) {
+        s->rx_active = false;
+        return;
+    }
+
+    uint32_t n = s->rx_len - s->rx_pos;
+    if (n > 7) {
+        n = 7;
+    }
+    if (dlc < n + 1) {
+        s->rx_active = false;
+        return;
+    }
+
+    memcpy(s->rx_buf + s->rx_pos, data + 1, n);
+    s->rx_pos += n;
+    s->rx_sn = (s->rx_sn + 1) & 0x0F;
+
+    if (s->rx_pos == s->rx_len) {
+        isotp_rx_complete(s);
+    } else if (s->config.block_size > 0 &&
+               ++s->rx_block == s->config.block_size) {
+        s->rx_block = 0;
+        isotp_send_fc(s, ISOTP_FC_CTS);
+    }
+}
+
+static void isotp_rx_flow_control(struct usbcan_isotp *s,
+                                  const uint8_t *data, uint8_t dlc) {
+    if (dlc < 3) {
+        return;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if (s->tx_active) {
+        s->fc_status = data[0] & 0x0F;
+        s->fc_bs = data[1];
+        s->fc_st_min = data[2];
+        s->fc_ready = true;
+        pthread_cond_signal(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void usbcan_isotp_receive(struct usbcan_isotp *sessions,
+                          struct usbcan_msg *msgs, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        const struct can_frame *frame = &msgs[i].frame;
+        if (frame->can_dlc == 0 ||
+            (frame->can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG)) > 0) {
+            continue;
+        }
+
+        for (struct usbcan_isotp *s = sessions; s != NULL; s = s->next) {
+            if (frame->can_id != s->config.rx_id) {
+                continue;
+            }
+
+            switch (frame->data[0] >> 4) {
+            case ISOTP_SF: {
+                uint8_t len = frame->data[0] & 0x0F;
+                if (len > 0 && len < frame->can_dlc && s->config.cb != NULL) {
+                    s->config.cb(s, frame->data + 1, len, s->config.arg);
+                }
+                break;
+            }
+            case ISOTP_FF:
+                isotp_rx_first(s, frame->data, frame->can_dlc);
+                break;
+            case ISOTP_CF:
+                isotp_rx_consecutive(s, frame->data, frame->can_dlc);
+                break;
+            case ISOTP_FC:
+                isotp_rx_flow_control(s, frame->data, frame->can_dlc);
+                break;
+            }
+        }
+    }
+}
+
+struct usbcan_isotp *usbcan_isotp_open(uint32_t dev, uint32_t bus,
+                                       struct usbcan_isotp_config *config) {
+    struct usbcan_bus *b = usbcan_get_bus(dev, bus);
+    if (b == NULL || !usbcan_dev_init(dev, true)) {
+        return NULL;
+    }
+
+    struct usbcan_isotp *s =
+        (struct usbcan_isotp *)calloc(1, sizeof(struct usbcan_isotp));
+    if (s == NULL) {
+        return NULL;
+    }
+
+    s->dev = dev;
+    s->bus = bus;
+    s->config = *config;
+    pthread_mutex_init(&s->send_lock, NULL);
+    pthread_mutex_init(&s->lock, NULL);
+    usbcan_cond_init(&s->cond);
+
+    pthread_mutex_lock(&b->rx_lock);
+    s->next = b->isotp;
+    b->isotp = s;
+    pthread_mutex_unlock(&b->rx_lock);
+
+    return s;
+}
+
+// Waits for a send in progress to finish. Fails on the driver thread,
+// which holds the bus's rx_lock while it feeds the session.
+bool usbcan_isotp_close(struct usbcan_isotp *s) {
+    if (s == NULL) {
+        return true;
+    }
+
+    if (usbcan_on_dispatcher(s->dev)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&s->send_lock);
+
+    struct usbcan_bus *b = usbcan_get_bus(s->dev, s->bus);
+    if (b != NULL) {
+        pthread_mutex_lock(&b->rx_lock);
+        for (struct usbcan_isotp **p = &b->isotp; *p != NULL;
+             p = &(*p)->next) {
+            if (*p == s) {
+                *p = s->next;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&b->rx_lock);
+    }
+
+    pthread_mutex_unlock(&s->send_lock);
+
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    pthread_mutex_destroy(&s->send_lock);
+    free(s->rx_buf);
+    free(s);
+
+    return true;
+}
+
+// Waits for the next flow control frame, sitting out WAIT frames, and
+// returns false on overflow, an invalid status or timeout.
+static bool isotp_wait_fc(struct usbcan_isotp *s, uint8_t *bs,
+                          uint8_t *st_min) {
+    uint32_t timeout_ms =
+        s->config.timeout_ms > 0 ? s->config.timeout_ms : ISOTP_TIMEOUT_MS;
+    bool status = false;
+
+    pthread_mutex_lock(&s->lock);
+    for (int waits = 0; waits <= ISOTP_MAX_WAITS; waits++) {
+        uint64_t deadline_us = usbcan_now_us() + (uint64_t)timeout_ms * 1000;
+
+        while (!s->fc_ready) {
+            if (!usbcan_cond_wait_until(&s->cond, &s->lock, deadline_us)) {
+                goto wait_fc_done;
+            }
+        }
+        s->fc_ready = false;
+
+        if (s->fc_status != ISOTP_FC_WAIT) {
+            status = s->fc_status == ISOTP_FC_CTS;
+            *bs = s->fc_bs;
+            *st_min = s->fc_st_min;
+            break;
+        }
+    }
+
+  wait_fc_done:
+    pthread_mutex_unlock(&s->lock);
+
+    return status;
+}
+
+bool usbcan_isotp_send(struct usbcan_isotp *s, const uint8_t *data,
+                       uint32_t len) {
+    struct can_frame frames[ISOTP_BATCH];
+    uint8_t buf[8];
+
+    if (len <= 7) {
+        buf[0] = (uint8_t)len;
+        memcpy(buf + 1, data, len);
+        isotp_frame(s, &frames[0], buf, (uint8_t)(len + 1));
+
+        return len > 0 && usbcan_send(s->dev, s->bus, &frames[0]) == 1;
+    }
+
+    // The driver thread would wait for flow control it has to receive.
+    if (usbcan_on_dispatcher(s->dev)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&s->send_lock);
+
+    pthread_mutex_lock(&s->lock);
+    s->tx_active = true;
+    s->fc_ready = false;
+    pthread_mutex_unlock(&s->lock);
+
+    uint32_t pos;
+    if (len <= USBCAN_ISOTP_MAX_LEN) {
+        buf[0] = ISOTP_FF << 4 | (uint8_t)(len >> 8);
+        buf[1] = (uint8_t)len;
+        pos = 6;
+        memcpy(buf + 2, data, pos);
+    } else {
+        buf[0] = ISOTP_FF << 4;
+        buf[1] = 0;
+        buf[2] = (uint8_t)(len >> 24);
+        buf[3] = (uint8_t)(len >> 16);
+        buf[4] = (uint8_t)(len >> 8);
+        buf[5] = (uint8_t)len;
+        pos = 2;
+        memcpy(buf + 6, data, pos);
+    }
+    isotp_frame(s, &frames[0], buf, 8);
+
+    bool status = usbcan_send(s->dev, s->bus, &frames[0]) == 1;
+    uint8_t sn = 1;
+
+    while (status && pos < len) {
+        uint8_t bs, st_min;
+        status = isotp_wait_fc(s, &bs, &st_min);
+        if (!status) {
+            break;
+        }
+
+        uint32_t st_min_us = isotp_st_min_us(st_min);
+        uint32_t block = bs > 0 ? bs : 0xFFFFFFFF;
+        uint64_t deadline_us = usbcan_now_us();
+
+        while (status && block > 0 && pos < len) {
+            uint32_t batch = 0;
+
+            // Without a separation time the whole block may go to the
+            // adapter at once; otherwise frames leave one at a time.
+            uint32_t max_batch = st_min_us == 0 ? ISOTP_BATCH : 1;
+            while (batch < max_batch && block > 0 && pos < len) {
+                uint8_t n = len - pos > 7 ? 7 : (uint8_t)(len - pos);
+                buf[0] = ISOTP_CF << 4 | sn;
+                memcpy(buf + 1, data + pos, n);
+                isotp_frame(s, &frames[batch], buf, (uint8_t)(n + 1));
+
+                sn = (sn + 1) & 0x0F;
+                pos += n;
+                block--;
+                batch++;
+            }
+
+            if (st_min_us > 0) {
+                usbcan_sleep_until(deadline_us);
+                deadline_us += st_min_us;
+            }
+
+            status = usbcan_send_n(s->dev, s->bus, frames, batch) == batch;
+        }
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->tx_active = false;
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_mutex_unlock(&s->send_lock);
+
+    return status;
+}
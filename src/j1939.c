@@ -0,0 +1,765 @@
+/*
+
+  j1939.c -- SAE J1939 PGN dispatch, transport protocol and address claim
+
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "usbcan.h"
+#include "usbcan_j1939.h"
+#include "usbcan_internal.h"
+
+/*
+  usbcan_j1939_callback is an ordinary usbcan_cb, so everything here runs
+  on whichever thread delivers the bus's batches. Every PGN maps to a
+  slot of a dense table (PDU1 PGNs by data page and PF, PDU2 PGNs by data
+  page, PF and group extension) holding the index of its handler, so
+  dispatch is one load whatever the number of handlers.
+
+  Transport sessions are preallocated and looked up by source address,
+  one BAM and one RTS/CTS transfer per source as the protocol allows. A
+  session idle for longer than T1 is reclaimed when a new transfer needs
+  its buffer. Clear-to-send, end-of-message and abort frames addressed to
+  us are handed to the sender blocked in usbcan_j1939_send, which is why
+  neither handlers nor the driver thread may send more than one frame.
+*/
+
+#define J1939_PGN_TP_DT 0xEB00
+#define J1939_PGN_TP_CM 0xEC00
+
+#define J1939_CM_RTS 16
+#define J1939_CM_CTS 17
+#define J1939_CM_EOMA 19
+#define J1939_CM_BAM 32
+#define J1939_CM_ABORT 255
+
+#define J1939_ABORT_BUSY 1
+#define J1939_ABORT_RESOURCES 2
+#define J1939_ABORT_TIMEOUT 3
+#define J1939_ABORT_SEQUENCE 7
+
+#define J1939_PDU1_SLOTS (4 * 240)
+#define J1939_PGN_SLOTS (J1939_PDU1_SLOTS + 4 * 16 * 256)
+
+#define J1939_T1_US 750000
+#define J1939_T3_MS 1250
+#define J1939_T4_MS 1050
+#define J1939_CLAIM_US 250000
+#define J1939_BAM_GAP_MS 50
+
+// The handle whose frames this thread is delivering.
+static __thread struct usbcan_j1939 *delivering
+    __attribute__((tls_model("initial-exec")));
+
+struct j1939_handler {
+    usbcan_j1939_cb cb;
+    void *arg;
+};
+
+struct j1939_session {
+    bool active;
+    bool bam;
+    uint32_t pgn;
+    uint32_t len;
+    uint8_t priority;
+    uint8_t src;
+    uint8_t dst;
+    uint8_t packets;
+    uint8_t next;
+    uint8_t window_end;
+    uint8_t window;
+    uint64_t last_us;
+    uint8_t *data;
+};
+
+struct usbcan_j1939 {
+    uint32_t dev;
+    uint32_t bus;
+    struct usbcan_j1939_config config;
+
+    pthread_mutex_t handlers_lock;
+    uint32_t num_handlers;
+    struct j1939_handler handlers[USBCAN_J1939_MAX_HANDLERS];
+    uint16_t pgn_index[J1939_PGN_SLOTS];
+
+    // Receive state, touched only by the delivering thread.
+    struct j1939_session sessions[USBCAN_J1939_SESSIONS];
+    struct j1939_session *bam[256];
+    struct j1939_session *cmdt[256];
+    uint8_t *buffers;
+
+    // Address claim and transmit state, under lock. send_lock serializes
+    // multi-packet senders.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool claiming;
+    uint8_t address;
+    uint8_t next_address;
+    uint64_t claim_us;
+    uint32_t taken[8];
+
+    pthread_mutex_t send_lock;
+    bool tx_active;
+    uint32_t tx_pgn;
+    uint8_t tx_dst;
+    bool tx_event;
+    uint8_t tx_ctrl;
+    uint8_t tx_cts_packets;
+    uint8_t tx_cts_next;
+};
+
+static int32_t j1939_pgn_slot(uint32_t pgn) {
+    uint32_t dp = (pgn >> 16) & 0x3;
+    uint32_t pf = (pgn >> 8) & 0xFF;
+
+    if (pgn > 0x3FFFF) {
+        return -1;
+    }
+
+    if (pf < 240) {
+        return (pgn & 0xFF) == 0 ? (int32_t)(dp * 240 + pf) : -1;
+    }
+
+    return J1939_PDU1_SLOTS + dp * 4096 + (pf - 240) * 256 + (pgn & 0xFF);
+}
+
+static canid_t j1939_id(uint8_t priority, uint32_t pgn, uint8_t dst,
+                        uint8_t src) {
+    uint8_t ps = ((pgn >> 8) & 0xFF) < 240 ? dst : (uint8_t)pgn;
+
+    return CAN_EFF_FLAG | (canid_t)(priority & 0x7) << 26 |
+        (pgn & 0x3FF00) << 8 | (canid_t)ps << 8 | src;
+}
+
+static void j1939_put_pgn(uint8_t *data, uint32_t pgn) {
+    data[0] = (uint8_t)pgn;
+    data[1] = (uint8_t)(pgn >> 8);
+    data[2] = (uint8_t)(pgn >> 16);
+}
+
+static uint32_t j1939_get_pgn(const uint8_t *data) {
+    return data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16;
+}
+
+static bool j1939_send_frame(struct usbcan_j1939 *j, uint8_t priority,
+                             uint32_t pgn, uint8_t dst, uint8_t src,
+                             const uint8_t *data, uint8_t len) {
+    struct can_frame frame;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = j1939_id(priority, pgn, dst, src);
+    frame.can_dlc = len;
+    memcpy(frame.data, data, len);
+
+    return usbcan_send(j->dev, j->bus, &frame) == 1;
+}
+
+static void j1939_send_cm(struct usbcan_j1939 *j, uint8_t dst, uint8_t src,
+                          uint8_t ctrl, uint8_t b1, uint8_t b2, uint8_t b3,
+                          uint8_t b4, uint32_t pgn) {
+    uint8_t data[8] = {ctrl, b1, b2, b3, b4};
+
+    j1939_put_pgn(data + 5, pgn);
+    j1939_send_frame(j, 7, J1939_PGN_TP_CM, dst, src, data, 8);
+}
+
+static void j1939_send_abort(struct usbcan_j1939 *j, uint8_t dst, uint8_t src,
+                             uint8_t reason, uint32_t pgn) {
+    j1939_send_cm(j, dst, src, J1939_CM_ABORT, reason, 0xFF, 0xFF, 0xFF, pgn);
+}
+
+struct usbcan_j1939 *usbcan_j1939_open(uint32_t dev, uint32_t bus,
+                                       struct usbcan_j1939_config *config) {
+    if (usbcan_get_bus(dev, bus) == NULL) {
+        return NULL;
+    }
+
+    struct usbcan_j1939 *j =
+        (struct usbcan_j1939 *)calloc(1, sizeof(struct usbcan_j1939));
+    if (j == NULL) {
+        return NULL;
+    }
+
+    j->buffers =
+        (uint8_t *)malloc(USBCAN_J1939_SESSIONS * USBCAN_J1939_MAX_LEN);
+    if (j->buffers == NULL) {
+        free(j);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < USBCAN_J1939_SESSIONS; i++) {
+        j->sessions[i].data = j->buffers + i * USBCAN_J1939_MAX_LEN;
+    }
+
+    j->dev = dev;
+    j->bus = bus;
+    j->config = *config;
+    j->address = USBCAN_J1939_NULL_ADDR;
+    pthread_mutex_init(&j->handlers_lock, NULL);
+    pthread_mutex_init(&j->lock, NULL);
+    usbcan_cond_init(&j->cond);
+    pthread_mutex_init(&j->send_lock, NULL);
+
+    return j;
+}
+
+void usbcan_j1939_close(struct usbcan_j1939 *j) {
+    if (j == NULL) {
+        return;
+    }
+
+    pthread_mutex_destroy(&j->send_lock);
+    pthread_cond_destroy(&j->cond);
+    pthread_mutex_destroy(&j->lock);
+    pthread_mutex_destroy(&j->handlers_lock);
+    free(j->buffers);
+    free(j);
+}
+
+bool usbcan_j1939_on(struct usbcan_j1939 *j, uint32_t pgn, usbcan_j1939_cb cb,
+                     void *arg) {
+    int32_t slot = j1939_pgn_slot(pgn);
+    if (slot < 0) {
+        return false;
+    }
+
+    bool status = false;
+
+    // Handlers are never overwritten in place, so the delivering thread
+    // always sees a complete one; replacing a PGN's handler takes a new
+    // entry.
+    pthread_mutex_lock(&j->handlers_lock);
+    if (j->num_handlers < USBCAN_J1939_MAX_HANDLERS) {
+        j->handlers[j->num_handlers].cb = cb;
+        j->handlers[j->num_handlers].arg = arg;
+        j->num_handlers++;
+        __atomic_store_n(&j->pgn_index[slot], (uint16_t)j->num_handlers,
+                         __ATOMIC_RELEASE);
+        status = true;
+    }
+    pthread_mutex_unlock(&j->handlers_lock);
+
+    return status;
+}
+
+static void j1939_dispatch(struct usbcan_j1939 *j,
+                           const struct usbcan_j1939_msg *msg) {
+    int32_t slot = j1939_pgn_slot(msg->pgn);
+    uint16_t index =
+        slot < 0 ? 0 : __atomic_load_n(&j->pgn_index[slot], __ATOMIC_ACQUIRE);
+
+    if (index > 0) {
+        j->handlers[index - 1].cb(j, msg, j->handlers[index - 1].arg);
+    } else if (j->config.cb != NULL) {
+        j->config.cb(j, msg, j->config.arg);
+    }
+}
+
+// Address claim
+
+static void j1939_send_claim(struct usbcan_j1939 *j, uint8_t address) {
+    uint8_t data[8];
+
+    for (int i = 0; i < 8; i++) {
+        data[i] = (uint8_t)(j->config.name >> (i * 8));
+    }
+    j1939_send_frame(j, 6, USBCAN_J1939_PGN_ADDRESS_CLAIMED,
+                     USBCAN_J1939_GLOBAL_ADDR, address, data, 8);
+}
+
+// Picks the next address not claimed by another node for a self-configurable
+// NAME, or the null address once the dynamic range 128-247 is exhausted.
+// Called with lock held.
+static uint8_t j1939_next_address(struct usbcan_j1939 *j) {
+    if ((j->config.name >> 63) == 0) {
+        return USBCAN_J1939_NULL_ADDR;
+    }
+
+    while (j->next_address <= 247) {
+        uint8_t address = j->next_address++;
+        if ((j->taken[address / 32] & (1U << (address % 32))) == 0) {
+            return address;
+        }
+    }
+
+    return USBCAN_J1939_NULL_ADDR;
+}
+
+bool usbcan_j1939_claim(struct usbcan_j1939 *j) {
+    pthread_mutex_lock(&j->lock);
+    j->claiming = true;
+    j->address = j->config.address;
+    j->next_address = 128;
+    j->claim_us = usbcan_now_us();
+    uint8_t address = j->address;
+    pthread_mutex_unlock(&j->lock);
+
+    j1939_send_claim(j, address);
+
+    return address != USBCAN_J1939_NULL_ADDR;
+}
+
+uint8_t usbcan_j1939_address(struct usbcan_j1939 *j) {
+    pthread_mutex_lock(&j->lock);
+    uint8_t address = j->address;
+    if (usbcan_now_us() - j->claim_us < J1939_CLAIM_US) {
+        address = USBCAN_J1939_NULL_ADDR;
+    }
+    pthread_mutex_unlock(&j->lock);
+
+    return address;
+}
+
+static void j1939_rx_claim(struct usbcan_j1939 *j,
+                           const struct usbcan_j1939_msg *msg) {
+    if (msg->len < 8 || msg->src >= USBCAN_J1939_NULL_ADDR) {
+        return;
+    }
+
+    uint64_t name = 0;
+    for (int i = 7; i >= 0; i--) {
+        name = name << 8 | msg->data[i];
+    }
+
+    pthread_mutex_lock(&j->lock);
+    j->taken[msg->src / 32] |= 1U << (msg->src % 32);
+
+    int32_t claim = -1;
+    if (j->claiming && msg->src == j->address && name != j->config.name) {
+        // The lower NAME keeps the address; the loser moves or gives up.
+        if (j->config.name > name) {
+            j->address = j1939_next_address(j);
+            j->claim_us = usbcan_now_us();
+        }
+        claim = j->address;
+    }
+    pthread_mutex_unlock(&j->lock);
+
+    if (claim >= 0) {
+        j1939_send_claim(j, (uint8_t)claim);
+    }
+}
+
+static void j1939_rx_request(struct usbcan_j1939 *j,
+                             const struct usbcan_j1939_msg *msg) {
+    if (msg->len < 3 ||
+        j1939_get_pgn(msg->data) != USBCAN_J1939_PGN_ADDRESS_CLAIMED) {
+        return;
+    }
+
+    pthread_mutex_lock(&j->lock);
+    int32_t claim = -1;
+    if (j->claiming &&
+        (msg->dst == USBCAN_J1939_GLOBAL_ADDR || msg->dst == j->address)) {
+        claim = j->address;
+    }
+    pthread_mutex_unlock(&j->lock);
+
+    if (claim >= 0) {
+        j1939_send_claim(j, (uint8_t)claim);
+    }
+}
+
+// Transport protocol reception
+
+static uint8_t j1939_rx_address(struct usbcan_j1939 *j) {
+    pthread_mutex_lock(&j->lock);
+    uint8_t address = j->address;
+    pthread_mutex_unlock(&j->lock);
+
+    return address;
+}
+
+static void j1939_session_free(struct usbcan_j1939 *j,
+                               struct j1939_session *s) {
+    if (s->bam) {
+        j->bam[s->src] = NULL;
+    } else {
+        j->cmdt[s->src] = NULL;
+    }
+    s->active = false;
+}
+
+static struct j1939_session *j1939_session_alloc(struct usbcan_j1939 *j,
+                                                 bool bam, uint8_t src,
+                                                 uint64_t now_us) {
+    struct j1939_session **table = bam ? j->bam : j->cmdt;
+    struct j1939_session *s = table[src];
+
+    // A new announcement from the same source replaces its transfer.
+    if (s == NULL) {
+        for (uint32_t i = 0; i < USBCAN_J1939_SESSIONS; i++) {
+            struct j1939_session *c = &j->sessions[i];
+            if (c->active && now_us - c->last_us > J1939_T1_US) {
+                j1939_session_free(j, c);
+            }
+            if (!c->active) {
+                s = c;
+                break;
+            }
+        }
+    }
+
+    if (s != NULL) {
+        s->active = true;
+        s->bam = bam;
+        s->src = src;
+        table[src] = s;
+    }
+
+    return s;
+}
+
+static void j1939_rx_cm(struct usbcan_j1939 *j,
+                        const struct usbcan_j1939_msg *msg, uint64_t now_us) {
+    if (msg->len < 8) {
+        return;
+    }
+
+    uint8_t ctrl = msg->data[0];
+    uint32_t pgn = j1939_get_pgn(msg->data + 5);
+    uint8_t address = j1939_rx_address(j);
+
+    if (ctrl == J1939_CM_BAM || ctrl == J1939_CM_RTS) {
+        bool bam = ctrl == J1939_CM_BAM;
+        if (bam != (msg->dst == USBCAN_J1939_GLOBAL_ADDR) ||
+            (!bam && msg->dst != address)) {
+            return;
+        }
+
+        uint32_t len = msg->data[1] | (uint32_t)msg->data[2] << 8;
+        uint8_t packets = msg->data[3];
+        if (len <= 8 || len > USBCAN_J1939_MAX_LEN ||
+            packets != (len + 6) / 7) {
+            if (!bam) {
+                j1939_send_abort(j, msg->src, address, J1939_ABORT_RESOURCES,
+                                 pgn);
+            }
+            return;
+        }
+
+        struct j1939_session *s = j1939_session_alloc(j, bam, msg->src, now_us);
+        if (s == NULL) {
+            if (!bam) {
+                j1939_send_abort(j, msg->src, address, J1939_ABORT_BUSY, pgn);
+            }
+            return;
+        }
+
+        s->pgn = pgn;
+        s->len = len;
+        s->priority = msg->priority;
+        s->dst = msg->dst;
+        s->packets = packets;
+        s->next = 1;
+        s->last_us = now_us;
+
+        if (!bam) {
+            s->window = msg->data[4] > 0 ? msg->data[4] : 0xFF;
+            uint8_t n = packets < s->window ? packets : s->window;
+            s->window_end = n;
+            j1939_send_cm(j, msg->src, address, J1939_CM_CTS, n, 1, 0xFF, 0xFF,
+                          pgn);
+        }
+        return;
+    }
+
+    if (msg->dst != address) {
+        return;
+    }
+
+    if (ctrl == J1939_CM_ABORT && j->cmdt[msg->src] != NULL &&
+        j->cmdt[msg->src]->pgn == pgn) {
+        j1939_session_free(j, j->cmdt[msg->src]);
+    }
+
+    if (ctrl == J1939_CM_CTS || ctrl == J1939_CM_EOMA ||
+        ctrl == J1939_CM_ABORT) {
+        pthread_mutex_lock(&j->lock);
+        if (j->tx_active && msg->src == j->tx_dst && pgn == j->tx_pgn) {
+            j->tx_ctrl = ctrl;
+            j->tx_cts_packets = msg->data[1];
+            j->tx_cts_next = msg->data[2];
+            j->tx_event = true;
+            pthread_cond_signal(&j->cond);
+        }
+        pthread_mutex_unlock(&j->lock);
+    }
+}
+
+static void j1939_rx_dt(struct usbcan_j1939 *j,
+                        const struct usbcan_j1939_msg *msg, uint64_t now_us) {
+    if (msg->len < 8) {
+        return;
+    }
+
+    struct j1939_session *s;
+    uint8_t address = USBCAN_J1939_NULL_ADDR;
+    if (msg->dst == USBCAN_J1939_GLOBAL_ADDR) {
+        s = j->bam[msg->src];
+    } else {
+        address = j1939_rx_address(j);
+        s = msg->dst == address ? j->cmdt[msg->src] : NULL;
+    }
+
+    if (s == NULL) {
+        return;
+    }
+
+    if (msg->data[0] != s->next) {
+        if (!s->bam) {
+            j1939_send_abort(j, s->src, address, J1939_ABORT_SEQUENCE, s->pgn);
+        }
+        j1939_session_free(j, s);
+        return;
+    }
+
+    uint32_t pos = (s->next - 1) * 7;
+    uint32_t n = s->len - pos < 7 ? s->len - pos : 7;
+    memcpy(s->data + pos, msg->data + 1, n);
+    s->last_us = now_us;
+
+    if (s->next++ == s->packets) {
+        if (!s->bam) {
+            j1939_send_cm(j, s->src, address, J1939_CM_EOMA, (uint8_t)s->len,
+                          (uint8_t)(s->len >> 8), s->packets, 0xFF, s->pgn);
+        }
+
+        struct usbcan_j1939_msg out = {s->pgn, s->priority, s->src, s->dst,
+                                       msg->timestamp, s->len, s->data};
+        j1939_session_free(j, s);
+        j1939_dispatch(j, &out);
+    } else if (!s->bam && s->next > s->window_end) {
+        uint8_t remaining = s->packets - s->window_end;
+        uint8_t n = remaining < s->window ? remaining : s->window;
+        s->window_end += n;
+        j1939_send_cm(j, s->src, address, J1939_CM_CTS, n, s->next, 0xFF, 0xFF,
+                      s->pgn);
+    }
+}
+
+void usbcan_j1939_callback(uint32_t dev, uint32_t bus, struct usbcan_msg *msgs,
+                           uint32_t n, void *arg) {
+#pragma unused(dev)
+#pragma unused(bus)
+    struct usbcan_j1939 *j = (struct usbcan_j1939 *)arg;
+    struct usbcan_j1939 *outer = delivering;
+    uint64_t now_us = usbcan_now_us();
+
+    delivering = j;
+
+    for (uint32_t i = 0; i < n; i++) {
+        canid_t can_id = msgs[i].frame.can_id;
+        if ((can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_ERR_FLAG)) !=
+            CAN_EFF_FLAG) {
+            continue;
+        }
+
+        uint32_t pf = (can_id >> 16) & 0xFF;
+        uint32_t ps = (can_id >> 8) & 0xFF;
+        struct usbcan_j1939_msg msg;
+        msg.pgn = (can_id >> 8) & 0x3FF00;
+        msg.priority = (can_id >> 26) & 0x7;
+        msg.src = can_id & 0xFF;
+        msg.timestamp = msgs[i].timestamp;
+        msg.len = msgs[i].frame.can_dlc;
+        msg.data = msgs[i].frame.data;
+
+        if (pf < 240) {
+            msg.dst = (uint8_t)ps;
+        } else {
+            msg.pgn |= ps;
+            msg.dst = USBCAN_J1939_GLOBAL_ADDR;
+        }
+
+        switch (msg.pgn) {
+        case J1939_PGN_TP_CM:
+            j1939_rx_cm(j, &msg, now_us);
+            continue;
+        case J1939_PGN_TP_DT:
+            j1939_rx_dt(j, &msg, now_us);
+            continue;
+        case USBCAN_J1939_PGN_ADDRESS_CLAIMED:
+            j1939_rx_claim(j, &msg);
+            break;
+        case USBCAN_J1939_PGN_REQUEST:
+            j1939_rx_request(j, &msg);
+            break;
+        }
+
+        j1939_dispatch(j, &msg);
+    }
+
+    delivering = outer;
+}
+
+// Transport protocol transmission
+
+static void j1939_dt_frame(struct can_frame *frame, canid_t can_id,
+                           const uint8_t *data, uint32_t len, uint8_t seq) {
+    uint32_t pos = (seq - 1) * 7;
+    uint32_t n = len - pos < 7 ? len - pos : 7;
+
+    frame->can_id = can_id;
+    frame->can_dlc = 8;
+    frame->data[0] = seq;
+    memcpy(frame->data + 1, data + pos, n);
+    memset(frame->data + 1 + n, 0xFF, 7 - n);
+}
+
+static bool j1939_send_bam(struct usbcan_j1939 *j, uint32_t pgn, uint8_t src,
+                           const uint8_t *data, uint32_t len) {
+    uint8_t packets = (uint8_t)((len + 6) / 7);
+    uint32_t gap_us =
+        (j->config.bam_gap_ms > 0 ? j->config.bam_gap_ms : J1939_BAM_GAP_MS) *
+        1000;
+    canid_t can_id =
+        j1939_id(7, J1939_PGN_TP_DT, USBCAN_J1939_GLOBAL_ADDR, src);
+    struct can_frame frame;
+
+    j1939_send_cm(j, USBCAN_J1939_GLOBAL_ADDR, src, J1939_CM_BAM, (uint8_t)len,
+                  (uint8_t)(len >> 8), packets, 0xFF, pgn);
+
+    uint64_t deadline_us = usbcan_now_us();
+    for (uint32_t seq = 1; seq <= packets; seq++) {
+        deadline_us += gap_us;
+        usbcan_sleep_until(deadline_us);
+
+        j1939_dt_frame(&frame, can_id, data, len, (uint8_t)seq);
+        if (usbcan_send(j->dev, j->bus, &frame) != 1) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Waits for the receiver's next CTS, EOMA or abort. Returns false on
+// timeout.
+static bool j1939_wait_cm(struct usbcan_j1939 *j, uint32_t timeout_ms) {
+    uint64_t deadline_us = usbcan_now_us() + (uint64_t)timeout_ms * 1000;
+
+    while (!j->tx_event) {
+        if (!usbcan_cond_wait_until(&j->cond, &j->lock, deadline_us)) {
+            return false;
+        }
+    }
+    j->tx_event = false;
+
+    return true;
+}
+
+static bool j1939_send_cmdt(struct usbcan_j1939 *j, uint32_t pgn, uint8_t dst,
+                            uint8_t src, const uint8_t *data, uint32_t len) {
+    uint8_t packets = (uint8_t)((len + 6) / 7);
+    canid_t can_id = j1939_id(7, J1939_PGN_TP_DT, dst, src);
+    struct can_frame frames[255];
+    bool status = false;
+
+    pthread_mutex_lock(&j->lock);
+    j->tx_active = true;
+    j->tx_event = false;
+    j->tx_pgn = pgn;
+    j->tx_dst = dst;
+    pthread_mutex_unlock(&j->lock);
+
+    j1939_send_cm(j, dst, src, J1939_CM_RTS, (uint8_t)len, (uint8_t)(len >> 8),
+                  packets, 0xFF, pgn);
+
+    uint32_t timeout_ms = J1939_T3_MS;
+    for (;;) {
+        pthread_mutex_lock(&j->lock);
+        bool event = j1939_wait_cm(j, timeout_ms);
+        uint8_t ctrl = j->tx_ctrl;
+        uint8_t n = j->tx_cts_packets;
+        uint8_t next = j->tx_cts_next;
+        pthread_mutex_unlock(&j->lock);
+
+        if (!event) {
+            j1939_send_abort(j, dst, src, J1939_ABORT_TIMEOUT, pgn);
+            break;
+        }
+
+        if (ctrl == J1939_CM_EOMA) {
+            status = true;
+            break;
+        }
+
+        if (ctrl != J1939_CM_CTS) {
+            break;
+        }
+
+        // A CTS for no packets holds the transfer open.
+        if (n == 0) {
+            timeout_ms = J1939_T4_MS;
+            continue;
+        }
+
+        if (next == 0 || next > packets) {
+            j1939_send_abort(j, dst, src, J1939_ABORT_SEQUENCE, pgn);
+            break;
+        }
+
+        uint32_t count = 0;
+        for (uint32_t seq = next; seq <= packets && count < n; seq++) {
+            j1939_dt_frame(&frames[count++], can_id, data, len, (uint8_t)seq);
+        }
+
+        if (usbcan_send_n(j->dev, j->bus, frames, count) != count) {
+            break;
+        }
+        timeout_ms = J1939_T3_MS;
+    }
+
+    pthread_mutex_lock(&j->lock);
+    j->tx_active = false;
+    pthread_mutex_unlock(&j->lock);
+
+    return status;
+}
+
+bool usbcan_j1939_send(struct usbcan_j1939 *j, uint32_t pgn, uint8_t priority,
+                       uint8_t dst, const uint8_t *data, uint32_t len) {
+    uint8_t src = usbcan_j1939_address(j);
+    if (src == USBCAN_J1939_NULL_ADDR || j1939_pgn_slot(pgn) < 0 ||
+        len > USBCAN_J1939_MAX_LEN) {
+        return false;
+    }
+
+    if (len <= 8) {
+        return j1939_send_frame(j, priority, pgn, dst, src, data, (uint8_t)len);
+    }
+
+    // A CTS would have to be delivered by this thread, and BAM gaps would
+    // hold up delivery on both buses of the device.
+    if (delivering == j || usbcan_on_dispatcher(j->dev)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&j->send_lock);
+    bool status = dst == USBCAN_J1939_GLOBAL_ADDR
+        ? j1939_send_bam(j, pgn, src, data, len)
+        : j1939_send_cmdt(j, pgn, dst, src, data, len);
+    pthread_mutex_unlock(&j->send_lock);
+
+    return status;
+}
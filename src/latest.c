@@ -0,0 +1,229 @@
+/*
+
+  latest.c -- lock-free last-value cache of received frames
+
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "usbcan.h"
+#include "usbcan_internal.h"
+
+/*
+  The bus's dispatcher is the only writer. Each entry is a seqlock: the
+  writer makes seq odd, stores the frame and makes seq even again, and a
+  reader retries until it sees the same even seq before and after its
+  copy, so readers never block the writer or each other. Extended IDs
+  claim open-addressing slots by publishing can_id after the first
+  frame is stored; slots are never reused, and once the table is three
+  quarters full further extended IDs are not cached.
+
+  The cache is allocated the first time a bus is initialized with
+  USBCAN_FLAG_LAST_VALUE and freed only by usbcan_library_close, so
+  readers can never see it freed.
+*/
+
+#define LATEST_EFF_SLOTS 4096
+#define LATEST_EFF_MAX (LATEST_EFF_SLOTS / 4 * 3)
+#define LATEST_EMPTY 0xFFFFFFFF
+#define LATEST_SPINS 64
+
+struct usbcan_latest_entry {
+    uint32_t seq;
+    canid_t can_id;
+    uint32_t timestamp;
+    uint32_t dlc;
+    uint64_t data;
+};
+
+struct usbcan_latest {
+    uint32_t eff_used;
+    struct usbcan_latest_entry sff[CAN_SFF_MASK + 1];
+    struct usbcan_latest_entry eff[LATEST_EFF_SLOTS];
+};
+
+struct usbcan_latest *usbcan_latest_alloc() {
+    struct usbcan_latest *l =
+        (struct usbcan_latest *)calloc(1, sizeof(struct usbcan_latest));
+    if (l == NULL) {
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i <= CAN_SFF_MASK; i++) {
+        l->sff[i].can_id = LATEST_EMPTY;
+    }
+    for (uint32_t i = 0; i < LATEST_EFF_SLOTS; i++) {
+        l->eff[i].can_id = LATEST_EMPTY;
+    }
+
+    return l;
+}
+
+static void latest_store(struct usbcan_latest_entry *e,
+                         const struct usbcan_msg *msg, bool publish_id) {
+    uint64_t data;
+    memcpy(&data, msg->frame.data, sizeof(data));
+
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (!publish_id) {
+        __atomic_store_n(&e->can_id, msg->frame.can_id, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&e->timestamp, msg->timestamp, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->dlc, msg->frame.can_dlc, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->data, data, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+
+    if (publish_id) {
+        __atomic_store_n(&e->can_id, msg->frame.can_id, __ATOMIC_RELEASE);
+    }
+}
+
+static bool latest_load(struct usbcan_latest_entry *e, struct usbcan_msg *msg) {
+    uint32_t seq;
+    canid_t can_id;
+    uint32_t timestamp, dlc;
+    uint64_t data;
+
+    do {
+        // A writer preempted mid-store leaves seq odd until it runs again,
+        // which on an oversubscribed host may be a whole timeslice away.
+        for (uint32_t spins = 0;
+             (seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE)) & 1;
+             spins++) {
+            if (spins >= LATEST_SPINS) {
+                sched_yield();
+            }
+        }
+
+        can_id = __atomic_load_n(&e->can_id, __ATOMIC_RELAXED);
+        timestamp = __atomic_load_n(&e->timestamp, __ATOMIC_RELAXED);
+        dlc = __atomic_load_n(&e->dlc, __ATOMIC_RELAXED);
+        data = __atomic_load_n(&e->data, __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq);
+
+    if (can_id == LATEST_EMPTY) {
+        return false;
+    }
+
+    memset(msg, 0, sizeof(*msg));
+    msg->timestamp = timestamp;
+    msg->frame.can_id = can_id;
+    msg->frame.can_dlc = (uint8_t)dlc;
+    memcpy(msg->frame.data, &data, sizeof(data));
+
+    return true;
+}
+
+// Returns the entry for can_id, or NULL if it has none. When claim is
+// set an empty slot is claimed for a new extended ID; *claimed then
+// tells the caller to publish the ID with its first frame.
+static struct usbcan_latest_entry *latest_slot(struct usbcan_latest *l,
+                                               canid_t can_id, bool claim,
+                                               bool *claimed) {
+    if ((can_id & CAN_EFF_FLAG) == 0) {
+        return &l->sff[can_id & CAN_SFF_MASK];
+    }
+
+    canid_t id = can_id & CAN_EFF_MASK;
+    for (uint32_t h = id * 0x9E3779B1U;; h++) {
+        struct usbcan_latest_entry *e = &l->eff[h % LATEST_EFF_SLOTS];
+        canid_t slot_id = __atomic_load_n(&e->can_id, __ATOMIC_ACQUIRE);
+
+        if (slot_id == LATEST_EMPTY) {
+            if (!claim || l->eff_used == LATEST_EFF_MAX) {
+                return NULL;
+            }
+            l->eff_used++;
+            *claimed = true;
+            return e;
+        }
+
+        if ((slot_id & CAN_EFF_MASK) == id) {
+            return e;
+        }
+    }
+}
+
+void usbcan_latest_update(struct usbcan_latest *l, struct usbcan_msg *msgs,
+                          uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        if ((msgs[i].frame.can_id & CAN_ERR_FLAG) > 0) {
+            continue;
+        }
+
+        bool claimed = false;
+        struct usbcan_latest_entry *e =
+            latest_slot(l, msgs[i].frame.can_id, true, &claimed);
+        if (e != NULL) {
+            latest_store(e, &msgs[i], claimed);
+        }
+    }
+}
+
+static struct usbcan_latest *latest_get(uint32_t dev, uint32_t bus) {
+    struct usbcan_bus *b = usbcan_get_bus(dev, bus);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    return __atomic_load_n(&b->latest, __ATOMIC_ACQUIRE);
+}
+
+bool usbcan_get_latest(uint32_t dev, uint32_t bus, canid_t can_id,
+                       struct usbcan_msg *msg) {
+    struct usbcan_latest *l = latest_get(dev, bus);
+    if (l == NULL) {
+        return false;
+    }
+
+    bool claimed = false;
+    struct usbcan_latest_entry *e = latest_slot(l, can_id, false, &claimed);
+    if (e == NULL || !latest_load(e, msg)) {
+        return false;
+    }
+
+    // A standard slot is shared by data and remote frames of one ID, and
+    // the flags of an extended slot are those of its latest frame.
+    return ((msg->frame.can_id ^ can_id) & CAN_EFF_FLAG) == 0;
+}
+
+uint32_t usbcan_snapshot_latest(uint32_t dev, uint32_t bus,
+                                struct usbcan_msg *msgs, uint32_t max) {
+    struct usbcan_latest *l = latest_get(dev, bus);
+    if (l == NULL) {
+        return 0;
+    }
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i <= CAN_SFF_MASK && n < max; i++) {
+        n += latest_load(&l->sff[i], &msgs[n]);
+    }
+    for (uint32_t i = 0; i < LATEST_EFF_SLOTS && n < max; i++) {
+        n += latest_load(&l->eff[i], &msgs[n]);
+    }
+
+    return n;
+}
@@ -0,0 +1,327 @@
+/*
+
+  merge.c -- one time-ordered stream from the frames of many buses
+
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "usbcan.h"
+#include "usbcan_merge.h"
+#include "usbcan_internal.h"
+
+/*
+  usbcan_merge_callback stamps each frame with a time on the host's
+  monotonic clock and appends it to a ring per bus, so the rings are
+  each in time order. Adapters count their timestamps from their own
+  start, so they cannot be compared across devices; with tick_us the
+  frames of a batch are instead dated back from the batch's arrival by
+  how much earlier the adapter saw them, which keeps the adapter's
+  resolution within a batch. A bus's times never go backwards.
+
+  A merge thread k-way merges the rings: it finds the ring with the
+  earliest head and takes frames from it up to the next ring's head, so
+  a run of frames from one bus costs one scan of the rings. A frame is
+  only taken once it is window_us old, giving frames of other buses
+  that were dated earlier but dispatched later the time to arrive.
+  Frames arriving later than that are delivered as soon as possible and
+  counted as late.
+*/
+
+struct merge_entry {
+    uint64_t time_us;
+    struct usbcan_msg msg;
+};
+
+struct merge_source {
+    struct merge_entry *entries;
+    uint32_t head;
+    uint32_t tail;
+    uint64_t last_us;
+};
+
+struct usbcan_merge {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool stopping;
+    struct usbcan_merge_config config;
+    struct merge_source *sources; // by dev * MAX_BUSES + bus
+    uint32_t num_sources;
+    uint32_t mask;
+    uint64_t last_us; // of the newest frame delivered
+    struct usbcan_bus_msg *out; // owned by the thread
+    struct usbcan_merge_stats stats;
+};
+
+static uint64_t merge_earliest(struct usbcan_merge *m) {
+    uint64_t earliest_us = UINT64_MAX;
+    for (uint32_t i = 0; i < m->num_sources; i++) {
+        struct merge_source *s = &m->sources[i];
+        if (s->head != s->tail &&
+            s->entries[s->head & m->mask].time_us < earliest_us) {
+            earliest_us = s->entries[s->head & m->mask].time_us;
+        }
+    }
+
+    return earliest_us;
+}
+
+// Fills out with the frames dated up to horizon_us, in time order.
+static uint32_t merge_fill(struct usbcan_merge *m, uint64_t horizon_us) {
+    uint32_t n = 0;
+    uint32_t late = 0;
+
+    while (n < m->config.batch_max) {
+        uint32_t first = UINT32_MAX;
+        uint64_t first_us = UINT64_MAX, next_us = UINT64_MAX;
+        for (uint32_t i = 0; i < m->num_sources; i++) {
+            struct merge_source *s = &m->sources[i];
+            if (s->head == s->tail) {
+                continue;
+            }
+
+            uint64_t time_us = s->entries[s->head & m->mask].time_us;
+            if (time_us < first_us) {
+                next_us = first_us;
+                first_us = time_us;
+                first = i;
+            } else if (time_us < next_us) {
+                next_us = time_us;
+            }
+        }
+
+        if (first == UINT32_MAX || first_us > horizon_us) {
+            break;
+        }
+        if (next_us > horizon_us) {
+            next_us = horizon_us;
+        }
+
+        struct merge_source *s = &m->sources[first];
+        while (n < m->config.batch_max && s->head != s->tail) {
+            struct merge_entry *e = &s->entries[s->head & m->mask];
+            if (e->time_us > next_us) {
+                break;
+            }
+
+            if (e->time_us < m->last_us) {
+                late++;
+            } else {
+                m->last_us = e->time_us;
+            }
+
+            m->out[n].dev = first / MAX_BUSES;
+            m->out[n].bus = first % MAX_BUSES;
+            m->out[n].msg = e->msg;
+            n++;
+            s->head++;
+        }
+    }
+
+    usbcan_count(&m->stats.late, late);
+
+    return n;
+}
+
+static void *merge_thread(void *arg) {
+    struct usbcan_merge *m = (struct usbcan_merge *)arg;
+
+    pthread_mutex_lock(&m->lock);
+    for (;;) {
+        uint64_t now_us = usbcan_now_us();
+        uint64_t horizon_us = 0;
+        if (m->stopping) {
+            horizon_us = UINT64_MAX;
+        } else if (now_us > m->config.window_us) {
+            horizon_us = now_us - m->config.window_us;
+        }
+
+        uint32_t n = merge_fill(m, horizon_us);
+        if (n > 0) {
+            usbcan_count(&m->stats.delivered, n);
+            pthread_mutex_unlock(&m->lock);
+            m->config.cb(m->out, n, m->config.arg);
+            pthread_mutex_lock(&m->lock);
+            continue;
+        }
+
+        if (m->stopping) {
+            break;
+        }
+
+        uint64_t earliest_us = merge_earliest(m);
+        if (earliest_us == UINT64_MAX) {
+            pthread_cond_wait(&m->cond, &m->lock);
+            continue;
+        }
+
+        uint64_t due_us = earliest_us + m->config.window_us;
+        if (due_us > now_us) {
+            usbcan_cond_wait_until(&m->cond, &m->lock, due_us);
+        }
+    }
+    pthread_mutex_unlock(&m->lock);
+
+    return NULL;
+}
+
+struct usbcan_merge *usbcan_merge_open(struct usbcan_merge_config *config) {
+    uint32_t num_sources = usbcan_num_devs() * MAX_BUSES;
+    if (config->cb == NULL || num_sources == 0) {
+        return NULL;
+    }
+
+    struct usbcan_merge *m =
+        (struct usbcan_merge *)calloc(1, sizeof(struct usbcan_merge));
+    if (m == NULL) {
+        return NULL;
+    }
+
+    uint32_t len =
+        config->queue_len > 0 ? config->queue_len : USBCAN_QUEUE_LEN;
+    uint32_t cap = 1;
+    while (cap < len && cap < 0x80000000) {
+        cap <<= 1;
+    }
+
+    m->config = *config;
+    if (m->config.window_us == 0) {
+        m->config.window_us = USBCAN_MERGE_WINDOW_US;
+    }
+    if (m->config.batch_max == 0) {
+        m->config.batch_max = USBCAN_BATCH_MAX;
+    }
+    m->num_sources = num_sources;
+    m->mask = cap - 1;
+
+    m->sources = (struct merge_source *)calloc(num_sources,
+                                               sizeof(struct merge_source));
+    m->out = (struct usbcan_bus_msg *)malloc(m->config.batch_max *
+                                             sizeof(struct usbcan_bus_msg));
+    if (m->sources == NULL || m->out == NULL) {
+        goto merge_open_error;
+    }
+
+    for (uint32_t i = 0; i < num_sources; i++) {
+        m->sources[i].entries =
+            (struct merge_entry *)malloc(cap * sizeof(struct merge_entry));
+        if (m->sources[i].entries == NULL) {
+            goto merge_open_error;
+        }
+    }
+
+    pthread_mutex_init(&m->lock, NULL);
+    usbcan_cond_init(&m->cond);
+
+    if (pthread_create(&m->thread, NULL, merge_thread, m) != 0) {
+        pthread_cond_destroy(&m->cond);
+        pthread_mutex_destroy(&m->lock);
+        goto merge_open_error;
+    }
+
+    return m;
+
+  merge_open_error:
+    for (uint32_t i = 0; m->sources != NULL && i < num_sources; i++) {
+        free(m->sources[i].entries);
+    }
+    free(m->sources);
+    free(m->out);
+    free(m);
+    return NULL;
+}
+
+// Delivers every waiting frame before returning.
+void usbcan_merge_close(struct usbcan_merge *m) {
+    if (m == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&m->lock);
+    m->stopping = true;
+    pthread_cond_signal(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+
+    pthread_join(m->thread, NULL);
+
+    pthread_cond_destroy(&m->cond);
+    pthread_mutex_destroy(&m->lock);
+    for (uint32_t i = 0; i < m->num_sources; i++) {
+        free(m->sources[i].entries);
+    }
+    free(m->sources);
+    free(m->out);
+    free(m);
+}
+
+void usbcan_merge_callback(uint32_t dev, uint32_t bus, struct usbcan_msg *msgs,
+                           uint32_t n, void *arg) {
+    struct usbcan_merge *m = (struct usbcan_merge *)arg;
+    uint32_t i = dev * MAX_BUSES + bus;
+    uint32_t kept = 0;
+
+    // Read under the lock, so frames dated by arrival reach the rings in
+    // time order.
+    pthread_mutex_lock(&m->lock);
+    uint64_t now_us = usbcan_now_us();
+
+    if (bus < MAX_BUSES && i < m->num_sources) {
+        struct merge_source *s = &m->sources[i];
+        bool empty = s->head == s->tail;
+        uint32_t cap = m->mask + 1;
+
+        for (; kept < n && s->tail - s->head < cap; kept++) {
+            uint64_t time_us = now_us;
+            if (m->config.tick_us > 0) {
+                uint64_t ago_us =
+                    (uint64_t)(msgs[n - 1].timestamp - msgs[kept].timestamp) *
+                    m->config.tick_us;
+                time_us = ago_us < now_us ? now_us - ago_us : 0;
+            }
+            if (time_us < s->last_us) {
+                time_us = s->last_us;
+            }
+            s->last_us = time_us;
+
+            struct merge_entry *e = &s->entries[s->tail++ & m->mask];
+            e->time_us = time_us;
+            e->msg = msgs[kept];
+        }
+
+        // A ring that was empty may now hold the earliest frame.
+        if (empty && kept > 0) {
+            pthread_cond_signal(&m->cond);
+        }
+    }
+
+    usbcan_count(&m->stats.received, n);
+    usbcan_count(&m->stats.dropped, n - kept);
+    pthread_mutex_unlock(&m->lock);
+}
+
+void usbcan_merge_get_stats(struct usbcan_merge *m,
+                            struct usbcan_merge_stats *stats) {
+    stats->received = __atomic_load_n(&m->stats.received, __ATOMIC_RELAXED);
+    stats->delivered = __atomic_load_n(&m->stats.delivered, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&m->stats.dropped, __ATOMIC_RELAXED);
+    stats->late = __atomic_load_n(&m->stats.late, __ATOMIC_RELAXED);
+}
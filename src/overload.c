@@ -0,0 +1,633 @@
+/*
+
+  overload.c -- bounded hand-off to a callback thread with overload policies
+
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+*/
+
+#ifdef __linux__
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "usbcan.h"
+#include "usbcan_internal.h"
+
+/*
+  With an overload policy the dispatcher copies frames into a ring of
+  overload_len and returns to draining the adapter, and a thread per bus
+  takes them off in batches of up to batch_max and calls back. What
+  happens when the consumer falls behind and the ring fills is the
+  policy:
+
+    BLOCK        the dispatcher waits for room, as it would have waited
+                 for the callback without a ring
+    DROP_OLDEST  the oldest queued frames make room (evicted)
+    DROP_NEWEST  arriving frames are discarded (rejected)
+    KEEP_LATEST  an arriving frame overwrites the queued frame with the
+                 same ID in place (replaced), or else evicts the oldest
+
+  USBCAN_FLAG_WORKER asks for the thread alone, and defaults the policy
+  to DROP_NEWEST: like the adapter's own FIFO, a bus that cannot keep
+  up loses its newest frames, and never holds up the driver's thread,
+  which drains both buses of the device.
+
+  With config.workers above one there is a ring and thread per worker,
+  and each frame goes to the worker its ID hashes to, so frames with the
+  same ID are still delivered in order, by the same thread, while the
+  bus's other IDs are called back concurrently. Each worker takes its
+  frames as its own batches and fills its own SoA columns.
+
+  The ring's lock is taken inside rx_lock. The thread never takes
+  rx_lock, but its callback may, so a bus being stopped or
+  re-initialized waits for the threads only after releasing rx_lock,
+  holding a reference that keeps the rings from being freed meanwhile.
+  The thread delivers from its own copy of the callback, which changes
+  only under both locks.
+*/
+
+static uint32_t overload_hash(struct usbcan_overload *o, canid_t can_id) {
+    uint32_t h = can_id * 2654435761U;
+
+    return (h ^ (h >> 15)) & o->mask;
+}
+
+// A different multiplier from overload_hash, so a worker's IDs still
+// spread over its slots.
+static uint32_t overload_shard(struct usbcan_overload *o, canid_t can_id) {
+    uint32_t h = can_id * 0x85EBCA6BU;
+
+    return (uint32_t)(((uint64_t)(h ^ (h >> 16)) * o->shards) >> 32);
+}
+
+// Wakes a dispatcher routing to several workers that found no room in
+// any of their rings.
+static void overload_room(struct usbcan_overload *o) {
+    pthread_mutex_lock(&o->room_lock);
+    o->room_seq++;
+    pthread_cond_broadcast(&o->room);
+    pthread_mutex_unlock(&o->room_lock);
+}
+
+static void *overload_worker(void *arg) {
+    struct usbcan_overload *o = (struct usbcan_overload *)arg;
+
+    pthread_mutex_lock(&o->lock);
+    for (;;) {
+        uint32_t n = o->tail - o->head;
+        if (n == 0 || (o->cb == NULL && o->soa_cb == NULL)) {
+            if (o->stopping) {
+                break;
+            }
+            pthread_cond_wait(&o->ready, &o->lock);
+            continue;
+        }
+
+        if (n > o->batch_max) {
+            n = o->batch_max;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            o->batch[i] = o->msgs[(o->head + i) & o->mask];
+        }
+        o->head += n;
+
+        usbcan_cb cb = o->cb;
+        usbcan_soa_cb soa_cb = o->soa_cb;
+        void *cb_arg = o->arg;
+        o->busy = true;
+        pthread_cond_broadcast(&o->space);
+        pthread_mutex_unlock(&o->lock);
+
+        struct usbcan_overload *first = o - o->shard;
+        if (o->shards > 1 &&
+            __atomic_load_n(&first->room_wanted, __ATOMIC_RELAXED)) {
+            overload_room(first);
+        }
+
+        if (soa_cb != NULL) {
+            soa_cb(o->dev, o->bus, usbcan_soa_fill(o->soa, o->batch, n),
+                   cb_arg);
+        } else {
+            cb(o->dev, o->bus, o->batch, n, cb_arg);
+        }
+        // The bus's workers count deliveries concurrently.
+        __atomic_fetch_add(&o->b->stats.delivered, n, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&o->lock);
+        o->busy = false;
+        pthread_cond_broadcast(&o->space);
+    }
+    pthread_mutex_unlock(&o->lock);
+
+    return NULL;
+}
+
+// Pins the thread to config->worker_cpus, or with several workers to
+// each of its CPUs in turn, and, with a non-zero worker_priority, runs
+// it under SCHED_FIFO at that priority, which usually needs
+// CAP_SYS_NICE.
+static bool overload_schedule(struct usbcan_overload *o,
+                              struct usbcan_bus_config *config) {
+    if (config->worker_cpus != 0) {
+#ifdef __linux__
+        uint32_t ncpus = __builtin_popcountll(config->worker_cpus);
+        uint32_t nth = o->shard % ncpus;
+
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu = 0; cpu < 64; cpu++) {
+            if ((config->worker_cpus & (1ULL << cpu)) == 0) {
+                continue;
+            }
+            if (o->shards == 1 || nth == 0) {
+                CPU_SET(cpu, &cpus);
+            }
+            nth--;
+        }
+        if (pthread_setaffinity_np(o->thread, sizeof(cpus), &cpus) != 0) {
+            return false;
+        }
+#else
+        return false;
+#endif
+    }
+
+    if (config->worker_priority != 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = config->worker_priority;
+        if (pthread_setschedparam(o->thread, SCHED_FIFO, &param) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool overload_start(struct usbcan_overload *o,
+                           struct usbcan_bus_config *config) {
+    uint32_t len =
+        config->overload_len > 0 ? config->overload_len : USBCAN_QUEUE_LEN;
+    uint32_t cap = 1;
+    while (cap < len && cap < 0x80000000) {
+        cap <<= 1;
+    }
+
+    o->mask = cap - 1;
+    o->batch_max = config->batch_max > 0 ? config->batch_max : USBCAN_BATCH_MAX;
+    o->msgs = (struct usbcan_msg *)malloc(cap * sizeof(struct usbcan_msg));
+    o->batch =
+        (struct usbcan_msg *)malloc(o->batch_max * sizeof(struct usbcan_msg));
+    if (o->policy == USBCAN_OVERLOAD_KEEP_LATEST) {
+        o->slots = (struct usbcan_overload_slot *)calloc(
+            cap, sizeof(struct usbcan_overload_slot));
+    }
+    if ((config->flags & USBCAN_FLAG_SOA) > 0) {
+        o->soa = usbcan_soa_alloc();
+    }
+
+    if (o->msgs == NULL || o->batch == NULL ||
+        (o->policy == USBCAN_OVERLOAD_KEEP_LATEST && o->slots == NULL) ||
+        ((config->flags & USBCAN_FLAG_SOA) > 0 &&
+         (o->soa == NULL || !usbcan_soa_reserve(o->soa, o->batch_max)))) {
+        return false;
+    }
+
+    pthread_mutex_init(&o->lock, NULL);
+    pthread_cond_init(&o->ready, NULL);
+    pthread_cond_init(&o->space, NULL);
+
+    if (pthread_create(&o->thread, NULL, overload_worker, o) != 0) {
+        pthread_cond_destroy(&o->space);
+        pthread_cond_destroy(&o->ready);
+        pthread_mutex_destroy(&o->lock);
+        return false;
+    }
+    o->started = true;
+
+    return overload_schedule(o, config);
+}
+
+static struct usbcan_overload *
+overload_alloc(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+               struct usbcan_bus_config *config) {
+    uint32_t shards = config->workers > 1 ? config->workers : 1;
+
+    struct usbcan_overload *o = (struct usbcan_overload *)calloc(
+        shards, sizeof(struct usbcan_overload));
+    if (o == NULL) {
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < shards; i++) {
+        o[i].shard = i;
+        o[i].shards = shards;
+        o[i].policy = config->overload != USBCAN_OVERLOAD_NONE
+            ? config->overload
+            : USBCAN_OVERLOAD_DROP_NEWEST;
+        o[i].dev = dev;
+        o[i].bus = bus;
+        o[i].b = b;
+    }
+
+    // Several workers are routed a dispatch at a time; see overload_route.
+    if (shards > 1) {
+        pthread_mutex_init(&o->room_lock, NULL);
+        pthread_cond_init(&o->room, NULL);
+
+        o->route_cap =
+            config->batch_max > 0 ? config->batch_max : USBCAN_BATCH_MAX;
+        o->routed = (struct usbcan_msg *)malloc(o->route_cap *
+                                                sizeof(struct usbcan_msg));
+        o->route = (uint32_t *)malloc(o->route_cap * sizeof(uint32_t));
+        o->runs = (uint32_t *)malloc(2 * shards * sizeof(uint32_t));
+        if (o->routed == NULL || o->route == NULL || o->runs == NULL) {
+            usbcan_overload_free(o);
+            return NULL;
+        }
+    }
+
+    for (uint32_t i = 0; i < shards; i++) {
+        if (!overload_start(&o[i], config)) {
+            usbcan_overload_free(o);
+            return NULL;
+        }
+    }
+
+    return o;
+}
+
+// Has the threads deliver whatever is queued, unless the callback is
+// gone, and waits for them to exit. Frames pushed after that stay queued
+// until the rings are freed.
+static void overload_stop(struct usbcan_overload *o) {
+    bool stopped[o->shards];
+
+    // All the workers drain at once.
+    for (uint32_t i = 0; i < o->shards; i++) {
+        stopped[i] = true;
+        if (o[i].started) {
+            pthread_mutex_lock(&o[i].lock);
+            stopped[i] = o[i].stopping;
+            o[i].stopping = true;
+            pthread_cond_signal(&o[i].ready);
+            pthread_mutex_unlock(&o[i].lock);
+        }
+    }
+    if (o->shards > 1) {
+        overload_room(o);
+    }
+
+    for (uint32_t i = 0; i < o->shards; i++) {
+        if (!stopped[i]) {
+            pthread_join(o[i].thread, NULL);
+        }
+    }
+}
+
+void usbcan_overload_free(struct usbcan_overload *o) {
+    if (o == NULL) {
+        return;
+    }
+
+    overload_stop(o);
+
+    for (uint32_t i = 0; i < o->shards; i++) {
+        if (o[i].started) {
+            usbcan_count(&o[i].b->stats.dropped, o[i].tail - o[i].head);
+
+            pthread_cond_destroy(&o[i].space);
+            pthread_cond_destroy(&o[i].ready);
+            pthread_mutex_destroy(&o[i].lock);
+        }
+        usbcan_soa_free(o[i].soa);
+        free(o[i].slots);
+        free(o[i].batch);
+        free(o[i].msgs);
+    }
+    if (o->shards > 1) {
+        pthread_cond_destroy(&o->room);
+        pthread_mutex_destroy(&o->room_lock);
+    }
+    free(o->runs);
+    free(o->route);
+    free(o->routed);
+    free(o);
+}
+
+// Takes a reference to the bus's rings, with rx_lock held, so they can
+// be waited for once it is released.
+static struct usbcan_overload *overload_get(struct usbcan_bus *b) {
+    struct usbcan_overload *o = b->overload;
+    if (o != NULL) {
+        o->users++;
+    }
+
+    return o;
+}
+
+// Drops a reference and frees the rings if they were replaced meanwhile.
+static void overload_put(struct usbcan_bus *b, struct usbcan_overload *o) {
+    if (o == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&b->rx_lock);
+    bool last = --o->users == 0 && o->detached;
+    pthread_mutex_unlock(&b->rx_lock);
+
+    if (last) {
+        usbcan_overload_free(o);
+    }
+}
+
+bool usbcan_overload_init(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+                          struct usbcan_bus_config *config, bool enabled) {
+    struct usbcan_overload *o = NULL;
+    if (enabled) {
+        o = overload_alloc(dev, bus, b, config);
+        if (o == NULL) {
+            return false;
+        }
+    }
+
+    // The old threads finish their queues before the new ones, or the
+    // dispatcher itself, call back. Frames arriving once they are done
+    // are counted as dropped when the old rings are freed.
+    pthread_mutex_lock(&b->rx_lock);
+    struct usbcan_overload *old = overload_get(b);
+    pthread_mutex_unlock(&b->rx_lock);
+
+    if (old != NULL) {
+        overload_stop(old);
+    }
+
+    pthread_mutex_lock(&b->rx_lock);
+    if (old != NULL) {
+        old->detached = true;
+    }
+    b->overload = o;
+    usbcan_overload_set_cb(b);
+    pthread_mutex_unlock(&b->rx_lock);
+
+    overload_put(b, old);
+
+    return true;
+}
+
+// Called with rx_lock held whenever the bus's callback changes. Once the
+// callback is removed, queued frames are dropped; usbcan_overload_idle
+// then waits for the threads to leave the callback.
+void usbcan_overload_set_cb(struct usbcan_bus *b) {
+    struct usbcan_overload *o = b->overload;
+    if (o == NULL) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < o->shards; i++) {
+        pthread_mutex_lock(&o[i].lock);
+        o[i].cb = b->cb;
+        o[i].soa_cb = b->soa_cb;
+        o[i].arg = b->arg;
+
+        if (o[i].cb == NULL && o[i].soa_cb == NULL) {
+            usbcan_count(&b->stats.dropped, o[i].tail - o[i].head);
+            o[i].head = o[i].tail;
+        } else {
+            pthread_cond_signal(&o[i].ready);
+        }
+        pthread_mutex_unlock(&o[i].lock);
+    }
+}
+
+// Called without rx_lock once the callback is removed; returns when no
+// thread of the bus is still in it.
+void usbcan_overload_idle(struct usbcan_bus *b) {
+    pthread_mutex_lock(&b->rx_lock);
+    struct usbcan_overload *o = overload_get(b);
+    pthread_mutex_unlock(&b->rx_lock);
+
+    if (o == NULL) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < o->shards; i++) {
+        pthread_mutex_lock(&o[i].lock);
+        while (o[i].busy) {
+            pthread_cond_wait(&o[i].space, &o[i].lock);
+        }
+        pthread_mutex_unlock(&o[i].lock);
+    }
+
+    overload_put(b, o);
+}
+
+struct overload_counts {
+    uint32_t evicted;
+    uint32_t rejected;
+    uint32_t replaced;
+    uint32_t stalls;
+};
+
+// Queues msgs on the worker's ring and returns how many it took, queued
+// or lost to the policy. Under BLOCK, unless wait is set, it stops at a
+// full ring rather than waiting for room there.
+static uint32_t overload_push(struct usbcan_overload *o,
+                              struct usbcan_msg *msgs, uint32_t n, bool wait,
+                              struct overload_counts *counts) {
+    uint32_t cap = o->mask + 1;
+    uint32_t queued = 0;
+    uint32_t i;
+
+    pthread_mutex_lock(&o->lock);
+
+    for (i = 0; i < n; i++) {
+        if (o->tail - o->head == cap) {
+            if (o->policy == USBCAN_OVERLOAD_BLOCK) {
+                if (!o->stopping) {
+                    if (!wait) {
+                        break;
+                    }
+                    counts->stalls++;
+                    pthread_cond_signal(&o->ready);
+                    while (o->tail - o->head == cap && !o->stopping) {
+                        pthread_cond_wait(&o->space, &o->lock);
+                    }
+                }
+                if (o->tail - o->head == cap) {
+                    counts->rejected += n - i;
+                    i = n;
+                    break;
+                }
+            } else if (o->policy == USBCAN_OVERLOAD_DROP_NEWEST) {
+                counts->rejected += n - i;
+                i = n;
+                break;
+            } else {
+                if (o->policy == USBCAN_OVERLOAD_KEEP_LATEST) {
+                    struct usbcan_overload_slot *slot =
+                        &o->slots[overload_hash(o, msgs[i].frame.can_id)];
+                    if (slot->can_id == msgs[i].frame.can_id &&
+                        slot->pos - o->head < cap &&
+                        o->msgs[slot->pos & o->mask].frame.can_id ==
+                            slot->can_id) {
+                        o->msgs[slot->pos & o->mask] = msgs[i];
+                        counts->replaced++;
+                        continue;
+                    }
+                }
+
+                o->head++;
+                counts->evicted++;
+            }
+        }
+
+        if (o->policy == USBCAN_OVERLOAD_KEEP_LATEST) {
+            struct usbcan_overload_slot *slot =
+                &o->slots[overload_hash(o, msgs[i].frame.can_id)];
+            slot->can_id = msgs[i].frame.can_id;
+            slot->pos = o->tail;
+        }
+        o->msgs[o->tail++ & o->mask] = msgs[i];
+        queued++;
+    }
+
+    if (queued > 0) {
+        pthread_cond_signal(&o->ready);
+    }
+    pthread_mutex_unlock(&o->lock);
+
+    return i;
+}
+
+// Groups up to route_cap frames by worker, keeping their order within
+// each, and queues every worker's run. Under BLOCK the runs are queued
+// in turns as far as the rings have room, waiting only when none has,
+// so a full ring holds up its own worker's frames but not the others';
+// the buffers grow to the largest dispatch, so that covers all of it.
+static void overload_route(struct usbcan_overload *o, struct usbcan_msg *msgs,
+                           uint32_t n, struct overload_counts *counts) {
+    uint32_t *first = o->runs;
+    uint32_t *last = o->runs + o->shards;
+
+    memset(last, 0, o->shards * sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; i++) {
+        o->route[i] = overload_shard(o, msgs[i].frame.can_id);
+        last[o->route[i]]++;
+    }
+
+    uint32_t pos = 0;
+    for (uint32_t s = 0; s < o->shards; s++) {
+        first[s] = pos;
+        pos += last[s];
+        last[s] = first[s];
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        o->routed[last[o->route[i]]++] = msgs[i];
+    }
+
+    for (;;) {
+        // A worker taking frames from here on bumps room_seq.
+        pthread_mutex_lock(&o->room_lock);
+        uint32_t seq = o->room_seq;
+        __atomic_store_n(&o->room_wanted, true, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&o->room_lock);
+
+        bool pending = false;
+        bool queued = false;
+        for (uint32_t s = 0; s < o->shards; s++) {
+            if (first[s] < last[s]) {
+                uint32_t m = overload_push(&o[s], &o->routed[first[s]],
+                                           last[s] - first[s], false, counts);
+                first[s] += m;
+                pending = pending || first[s] < last[s];
+                queued = queued || m > 0;
+            }
+        }
+
+        if (!pending) {
+            break;
+        }
+        if (!queued) {
+            counts->stalls++;
+            for (uint32_t s = 0; s < o->shards; s++) {
+                pthread_mutex_lock(&o[s].lock);
+                pthread_cond_signal(&o[s].ready);
+                pthread_mutex_unlock(&o[s].lock);
+            }
+
+            pthread_mutex_lock(&o->room_lock);
+            while (o->room_seq == seq) {
+                pthread_cond_wait(&o->room, &o->room_lock);
+            }
+            pthread_mutex_unlock(&o->room_lock);
+        }
+    }
+
+    __atomic_store_n(&o->room_wanted, false, __ATOMIC_RELAXED);
+}
+
+// Grows the routing buffers to n frames, keeping their size if it cannot.
+static void overload_reserve(struct usbcan_overload *o, uint32_t n) {
+    struct usbcan_msg *routed = (struct usbcan_msg *)realloc(
+        o->routed, n * sizeof(struct usbcan_msg));
+    if (routed == NULL) {
+        return;
+    }
+    o->routed = routed;
+
+    uint32_t *route = (uint32_t *)realloc(o->route, n * sizeof(uint32_t));
+    if (route == NULL) {
+        return;
+    }
+    o->route = route;
+    o->route_cap = n;
+}
+
+// Called by usbcan_deliver with rx_lock held.
+void usbcan_overload_push(struct usbcan_bus *b, struct usbcan_msg *msgs,
+                          uint32_t n) {
+    struct usbcan_overload *o = b->overload;
+    struct overload_counts counts;
+    memset(&counts, 0, sizeof(counts));
+
+    if (o->shards > 1 && o->route_cap < n) {
+        overload_reserve(o, n);
+    }
+
+    if (o->shards == 1) {
+        overload_push(o, msgs, n, true, &counts);
+    } else {
+        for (uint32_t i = 0; i < n; i += o->route_cap) {
+            overload_route(o, &msgs[i],
+                           n - i < o->route_cap ? n - i : o->route_cap,
+                           &counts);
+        }
+    }
+
+    usbcan_count(&b->stats.dropped,
+                 counts.evicted + counts.rejected + counts.replaced);
+    usbcan_count(&b->stats.evicted, counts.evicted);
+    usbcan_count(&b->stats.rejected, counts.rejected);
+    usbcan_count(&b->stats.replaced, counts.replaced);
+    usbcan_count(&b->stats.stalls, counts.stalls);
+}
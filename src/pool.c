@@ -0,0 +1,179 @@
+/*
+
+  pool.c -- reference-counted receive batches for retaining consumers
+
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "usbcan.h"
+#include "usbcan_internal.h"
+
+/*
+  A bus initialized with USBCAN_FLAG_RETAIN converts received frames
+  straight into a batch taken from its pool, and the callback is handed
+  that batch's frames. The library holds one reference while the
+  callback runs; usbcan_retain adds another that the consumer drops with
+  usbcan_release from any thread, and the last release puts the batch
+  back on the pool's free list.
+
+  The pool is allocated once, in one block, and is never grown: when
+  every batch is out, frames are counted as dropped and the exhaustion
+  is counted, rather than anything being allocated on the receive path.
+  The bus holds a reference to its pool and so does every batch out, so
+  a pool replaced by re-initialization or library_close lives until its
+  last batch comes back.
+*/
+
+struct usbcan_pool *usbcan_pool_alloc(uint32_t batches, uint32_t cap) {
+    struct usbcan_pool *p =
+        (struct usbcan_pool *)calloc(1, sizeof(struct usbcan_pool));
+    if (p == NULL) {
+        return NULL;
+    }
+
+    p->batches =
+        (struct usbcan_batch *)calloc(batches, sizeof(struct usbcan_batch));
+    p->msgs = (struct usbcan_msg *)calloc((size_t)batches * cap,
+                                          sizeof(struct usbcan_msg));
+    if (p->batches == NULL || p->msgs == NULL) {
+        free(p->batches);
+        free(p->msgs);
+        free(p);
+        return NULL;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    p->refs = 1;
+    p->num_batches = batches;
+    p->cap = cap;
+
+    for (uint32_t i = 0; i < batches; i++) {
+        struct usbcan_batch *batch = &p->batches[i];
+        batch->pool = p;
+        batch->msgs = p->msgs + (size_t)i * cap;
+        batch->next = p->free;
+        p->free = batch;
+    }
+
+    return p;
+}
+
+static void pool_unref(struct usbcan_pool *p) {
+    // Called with p->lock held; unlocks it.
+    bool last = --p->refs == 0;
+    pthread_mutex_unlock(&p->lock);
+
+    if (last) {
+        pthread_mutex_destroy(&p->lock);
+        free(p->batches);
+        free(p->msgs);
+        free(p);
+    }
+}
+
+void usbcan_pool_detach(struct usbcan_pool *p) {
+    if (p == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    pool_unref(p);
+}
+
+// Takes a free batch holding one reference, or returns NULL.
+struct usbcan_batch *usbcan_pool_get(struct usbcan_pool *p) {
+    pthread_mutex_lock(&p->lock);
+    struct usbcan_batch *batch = p->free;
+    if (batch != NULL) {
+        p->free = batch->next;
+        p->refs++;
+        batch->refs = 1;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return batch;
+}
+
+void usbcan_release(struct usbcan_batch *batch) {
+    if (batch == NULL ||
+        __atomic_sub_fetch(&batch->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    struct usbcan_pool *p = batch->pool;
+    pthread_mutex_lock(&p->lock);
+    batch->next = p->free;
+    p->free = batch;
+    pool_unref(p);
+}
+
+struct usbcan_batch *usbcan_retain(uint32_t dev, uint32_t bus,
+                                   struct usbcan_msg *msgs) {
+    struct usbcan_bus *b = usbcan_get_bus(dev, bus);
+    if (b == NULL || b->pool == NULL) {
+        return NULL;
+    }
+
+    // Only meaningful inside the bus's callback, on the thread holding
+    // rx_lock, while the batch being delivered is current.
+    struct usbcan_batch *batch = b->pool->current;
+    if (batch == NULL || msgs < batch->msgs ||
+        msgs >= batch->msgs + b->pool->cap) {
+        return NULL;
+    }
+
+    __atomic_add_fetch(&batch->refs, 1, __ATOMIC_RELAXED);
+
+    return batch;
+}
+
+// Called by usbcan_deliver with rx_lock held. Frames the dispatcher
+// converted into the current batch are passed as they are; anything
+// else is copied into a batch of its own.
+void usbcan_pool_deliver(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+                         struct usbcan_msg *msgs, uint32_t n) {
+    struct usbcan_pool *p = b->pool;
+    struct usbcan_batch *current = p->current;
+    struct usbcan_batch *batch = current;
+
+    if (batch == NULL || msgs < batch->msgs || msgs >= batch->msgs + p->cap) {
+        batch = usbcan_pool_get(p);
+        if (batch == NULL) {
+            usbcan_count(&b->stats.dropped, n);
+            usbcan_count(&b->stats.exhausted, 1);
+            return;
+        }
+
+        n = n < p->cap ? n : p->cap;
+        memcpy(batch->msgs, msgs, n * sizeof(struct usbcan_msg));
+        msgs = batch->msgs;
+        p->current = batch;
+    }
+
+    b->cb(dev, bus, msgs, n, b->arg);
+    usbcan_count(&b->stats.delivered, n);
+
+    if (batch != current) {
+        p->current = current;
+        usbcan_release(batch);
+    }
+}
@@ -0,0 +1,153 @@
+/*
+
+  soa.c -- column-per-field delivery of received batches
+
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbcan.h"
+#include "usbcan_internal.h"
+
+/*
+  The dispatcher works on struct usbcan_msg throughout, since change
+  suppression, the last-value cache and ISO-TP all want whole frames, and
+  splits a batch into columns only at delivery, in one pass over it.
+  Columns are per bus, reused across calls, and aligned to a cache line
+  so consumers can run vector loads over them from index 0.
+*/
+
+#define SOA_ALIGN 64
+
+static void *soa_alloc(size_t size) {
+    void *p = NULL;
+    if (posix_memalign(&p, SOA_ALIGN, size) != 0) {
+        return NULL;
+    }
+
+    return p;
+}
+
+void usbcan_soa_free(struct usbcan_soa_buf *s) {
+    if (s == NULL) {
+        return;
+    }
+
+    free(s->batch.ids);
+    free(s->batch.flags);
+    free(s->batch.dlc);
+    free(s->batch.timestamps);
+    free(s->batch.data);
+    free(s);
+}
+
+bool usbcan_soa_reserve(struct usbcan_soa_buf *s, uint32_t n) {
+    if (s->cap >= n) {
+        return true;
+    }
+
+    struct usbcan_soa batch;
+    batch.ids = (uint32_t *)soa_alloc(n * sizeof(uint32_t));
+    batch.flags = (uint8_t *)soa_alloc(n * sizeof(uint8_t));
+    batch.dlc = (uint8_t *)soa_alloc(n * sizeof(uint8_t));
+    batch.timestamps = (uint64_t *)soa_alloc(n * sizeof(uint64_t));
+    batch.data = (uint64_t *)soa_alloc(n * sizeof(uint64_t));
+
+    if (batch.ids == NULL || batch.flags == NULL || batch.dlc == NULL ||
+        batch.timestamps == NULL || batch.data == NULL) {
+        free(batch.ids);
+        free(batch.flags);
+        free(batch.dlc);
+        free(batch.timestamps);
+        free(batch.data);
+        return false;
+    }
+
+    free(s->batch.ids);
+    free(s->batch.flags);
+    free(s->batch.dlc);
+    free(s->batch.timestamps);
+    free(s->batch.data);
+
+    batch.n = 0;
+    s->batch = batch;
+    s->cap = n;
+
+    return true;
+}
+
+struct usbcan_soa_buf *usbcan_soa_alloc() {
+    struct usbcan_soa_buf *s =
+        (struct usbcan_soa_buf *)calloc(1, sizeof(struct usbcan_soa_buf));
+    if (s == NULL) {
+        return NULL;
+    }
+
+    if (!usbcan_soa_reserve(s, USBCAN_BATCH_MAX)) {
+        free(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+// Splits msgs into the columns, which must hold n frames.
+const struct usbcan_soa *usbcan_soa_fill(struct usbcan_soa_buf *s,
+                                         struct usbcan_msg *msgs, uint32_t n) {
+    struct usbcan_soa *batch = &s->batch;
+    for (uint32_t i = 0; i < n; i++) {
+        canid_t can_id = msgs[i].frame.can_id;
+
+        batch->ids[i] = (can_id & (CAN_EFF_FLAG | CAN_ERR_FLAG)) > 0
+            ? can_id & CAN_EFF_MASK
+            : can_id & CAN_SFF_MASK;
+        batch->flags[i] = ((can_id & CAN_EFF_FLAG) > 0 ? USBCAN_SOA_EFF : 0) |
+            ((can_id & CAN_RTR_FLAG) > 0 ? USBCAN_SOA_RTR : 0) |
+            ((can_id & CAN_ERR_FLAG) > 0 ? USBCAN_SOA_ERR : 0);
+        batch->dlc[i] = msgs[i].frame.can_dlc;
+
+        // The adapter's 32-bit timestamp, carried past its wraparound.
+        uint32_t timestamp = msgs[i].timestamp;
+        if (s->last_timestamp - timestamp > 0x80000000U &&
+            timestamp < s->last_timestamp) {
+            s->epoch += 1ULL << 32;
+        }
+        s->last_timestamp = timestamp;
+        batch->timestamps[i] = s->epoch | timestamp;
+
+        memcpy(&batch->data[i], msgs[i].frame.data, sizeof(uint64_t));
+    }
+    batch->n = n;
+
+    return batch;
+}
+
+// Called with rx_lock held, by usbcan_deliver and the coalescing flush.
+void usbcan_soa_deliver(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+                        struct usbcan_msg *msgs, uint32_t n) {
+    struct usbcan_soa_buf *s = b->soa;
+    if (!usbcan_soa_reserve(s, n)) {
+        usbcan_count(&b->stats.dropped, n);
+        return;
+    }
+
+    b->soa_cb(dev, bus, usbcan_soa_fill(s, msgs, n), b->arg);
+    usbcan_count(&b->stats.delivered, n);
+}
@@ -0,0 +1,307 @@
+/*
+
+  trace.c -- in-process recorder of dispatch and send timings
+
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "usbcan.h"
+#include "usbcan_internal.h"
+
+/*
+  Each thread that passes a traced stage while recording appends events
+  to a buffer of its own without locking: it alone writes the buffer and
+  publishes the count. Threads find their buffers through slots, which
+  are linked into a list when first used and never freed, only handed
+  to another thread once theirs exits.
+
+  Stopping clears usbcan_tracing and then waits until no slot is busy
+  before taking the buffers. A thread marks its slot busy before checking
+  the flag, and allocates a buffer only while busy, so none can be
+  inside an append, or start one, once the buffers are taken. Slots
+  remember the recording they were filled for, so a buffer taken by one
+  usbcan_trace_stop is not used again.
+
+  The file is Chrome trace-event JSON, which chrome://tracing and
+  Perfetto open: a complete ("X") event per stage, with the dispatch
+  nesting the stages within it.
+*/
+
+struct trace_event {
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint32_t n;
+    uint8_t stage;
+    uint8_t dev;
+    uint8_t bus;
+};
+
+struct trace_buf {
+    uint32_t tid;
+    uint32_t cap;
+    uint32_t n;
+    uint32_t dropped;
+    struct trace_event events[];
+};
+
+struct trace_slot {
+    struct trace_slot *next;
+    bool used;
+    bool busy;
+    uint64_t generation;
+    struct trace_buf *buf;
+};
+
+bool usbcan_tracing = false;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    pthread_key_t key;
+    uint64_t generation;
+    uint32_t events;
+    uint32_t threads;
+    struct trace_slot *slots;
+} tracer = {.lock = PTHREAD_MUTEX_INITIALIZER, .once = PTHREAD_ONCE_INIT};
+
+static __thread struct trace_slot *trace_local
+    __attribute__((tls_model("initial-exec")));
+
+static const char *TRACE_STAGES[] = {
+    "dispatch", "receive_num", "receive", "convert",
+    "deliver",  "send",        "transmit",
+};
+
+uint64_t usbcan_trace_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Hands the slot of an exiting thread on, with any buffer it filled.
+static void trace_slot_release(void *arg) {
+    struct trace_slot *slot = (struct trace_slot *)arg;
+
+    __atomic_store_n(&slot->used, false, __ATOMIC_RELEASE);
+}
+
+static void trace_key_init() {
+    pthread_key_create(&tracer.key, trace_slot_release);
+}
+
+static struct trace_slot *trace_slot_get() {
+    if (trace_local != NULL) {
+        return trace_local;
+    }
+
+    struct trace_slot *slot = __atomic_load_n(&tracer.slots, __ATOMIC_ACQUIRE);
+    for (; slot != NULL; slot = slot->next) {
+        bool used = false;
+        if (__atomic_compare_exchange_n(&slot->used, &used, true, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (slot == NULL) {
+        slot = (struct trace_slot *)calloc(1, sizeof(struct trace_slot));
+        if (slot == NULL) {
+            return NULL;
+        }
+        slot->used = true;
+        slot->next = __atomic_load_n(&tracer.slots, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&tracer.slots, &slot->next, slot,
+                                            true, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+
+    pthread_once(&tracer.once, trace_key_init);
+    pthread_setspecific(tracer.key, slot);
+    trace_local = slot;
+
+    return slot;
+}
+
+static struct trace_buf *trace_buf_alloc() {
+    uint32_t events = __atomic_load_n(&tracer.events, __ATOMIC_RELAXED);
+    struct trace_buf *buf = (struct trace_buf *)calloc(
+        1, sizeof(struct trace_buf) + events * sizeof(struct trace_event));
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    buf->cap = events;
+    buf->tid = __atomic_add_fetch(&tracer.threads, 1, __ATOMIC_RELAXED);
+
+    return buf;
+}
+
+void usbcan_trace_record(enum usbcan_stage stage, uint64_t start_ns,
+                         uint32_t dev, uint32_t bus, uint32_t n) {
+    uint64_t end_ns = usbcan_trace_now_ns();
+
+    struct trace_slot *slot = trace_slot_get();
+    if (slot == NULL) {
+        return;
+    }
+
+    __atomic_store_n(&slot->busy, true, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&usbcan_tracing, __ATOMIC_SEQ_CST)) {
+        uint64_t generation =
+            __atomic_load_n(&tracer.generation, __ATOMIC_RELAXED);
+        if (slot->buf == NULL || slot->generation != generation) {
+            slot->buf = trace_buf_alloc();
+            slot->generation = generation;
+        }
+
+        struct trace_buf *buf = slot->buf;
+        if (buf != NULL && buf->n < buf->cap) {
+            struct trace_event *e = &buf->events[buf->n];
+            e->start_ns = start_ns;
+            e->end_ns = end_ns;
+            e->n = n;
+            e->stage = stage;
+            e->dev = dev;
+            e->bus = bus;
+            buf->n++;
+        } else if (buf != NULL) {
+            buf->dropped++;
+        }
+    }
+    __atomic_store_n(&slot->busy, false, __ATOMIC_RELEASE);
+}
+
+bool usbcan_trace_start(uint32_t events) {
+    pthread_mutex_lock(&tracer.lock);
+    bool status = !__atomic_load_n(&usbcan_tracing, __ATOMIC_RELAXED);
+    if (status) {
+        __atomic_store_n(&tracer.events,
+                         events > 0 ? events : USBCAN_TRACE_EVENTS,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&tracer.generation, tracer.generation + 1,
+                         __ATOMIC_RELEASE);
+        __atomic_store_n(&usbcan_tracing, true, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&tracer.lock);
+
+    return status;
+}
+
+static bool trace_write(const char *path, struct trace_buf **bufs,
+                        uint32_t num_bufs) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return false;
+    }
+
+    // Events are appended as they end, so the dispatch that nests a
+    // thread's first stages comes after them.
+    uint64_t base_ns = UINT64_MAX;
+    for (uint32_t i = 0; i < num_bufs; i++) {
+        for (uint32_t j = 0; j < bufs[i]->n; j++) {
+            if (bufs[i]->events[j].start_ns < base_ns) {
+                base_ns = bufs[i]->events[j].start_ns;
+            }
+        }
+    }
+
+    const char *sep = "";
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (uint32_t i = 0; i < num_bufs; i++) {
+        struct trace_buf *buf = bufs[i];
+        fprintf(f,
+                "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%u,\"args\":{\"name\":\"usbcan %u\"}}",
+                sep, buf->tid, buf->tid);
+        sep = ",\n";
+
+        for (uint32_t j = 0; j < buf->n; j++) {
+            struct trace_event *e = &buf->events[j];
+            fprintf(f,
+                    ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                    "\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"args\":{\"dev\":%u,\"bus\":%u,\"n\":%u}}",
+                    TRACE_STAGES[e->stage], buf->tid,
+                    (e->start_ns - base_ns) / 1e3,
+                    (e->end_ns - e->start_ns) / 1e3, e->dev, e->bus, e->n);
+        }
+        if (buf->dropped > 0) {
+            fprintf(f,
+                    ",\n{\"name\":\"dropped\",\"ph\":\"C\",\"pid\":1,"
+                    "\"tid\":%u,\"ts\":0,\"args\":{\"events\":%u}}",
+                    buf->tid, buf->dropped);
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    return fclose(f) == 0;
+}
+
+// Stops recording and, unless path is NULL, writes what was recorded.
+bool usbcan_trace_stop(const char *path) {
+    pthread_mutex_lock(&tracer.lock);
+    if (!__atomic_load_n(&usbcan_tracing, __ATOMIC_RELAXED)) {
+        pthread_mutex_unlock(&tracer.lock);
+        return false;
+    }
+    __atomic_store_n(&usbcan_tracing, false, __ATOMIC_SEQ_CST);
+
+    // Slots linked after this find recording already stopped.
+    uint32_t num_bufs = 0;
+    struct trace_slot *slots = __atomic_load_n(&tracer.slots, __ATOMIC_ACQUIRE);
+    for (struct trace_slot *slot = slots; slot != NULL; slot = slot->next) {
+        while (__atomic_load_n(&slot->busy, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+        if (slot->buf != NULL) {
+            num_bufs++;
+        }
+    }
+
+    struct trace_buf **bufs =
+        (struct trace_buf **)malloc((num_bufs + 1) * sizeof(*bufs));
+    num_bufs = 0;
+    for (struct trace_slot *slot = slots; slot != NULL; slot = slot->next) {
+        if (slot->buf != NULL && bufs != NULL) {
+            bufs[num_bufs++] = slot->buf;
+        } else {
+            free(slot->buf);
+        }
+        slot->buf = NULL;
+    }
+    __atomic_store_n(&tracer.threads, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&tracer.lock);
+
+    bool status = bufs != NULL &&
+        (path == NULL || trace_write(path, bufs, num_bufs));
+
+    for (uint32_t i = 0; i < num_bufs; i++) {
+        free(bufs[i]);
+    }
+    free(bufs);
+
+    return status;
+}
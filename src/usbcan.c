@@ -24,125 +24,510 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include "usbcan.h"
+#include "usbcan_j1939.h"
 #include "ginkgo.h"
+#include "usbcan_internal.h"
 
-struct usbcan_cb_entry {
-    uint32_t dev;
-    uint32_t bus;
-    usbcan_cb cb;
-    void *arg;
-    struct usbcan_cb_entry *next;
-};
-
-struct usbcan_state {
-    uint32_t type;
-    uint32_t num_devs;
-    uint32_t *devs;
-    struct usbcan_cb_entry *callbacks;
-    struct usbcan_cb_entry *tail;
-};
+// Upper bound on extra drain passes per dispatch while recovering from an
+// overflow, so a flooded bus cannot hold its rx_lock indefinitely.
+#define USBCAN_DRAIN_ROUNDS 16
 
-struct usbcan_state state;
+struct usbcan_state state = {.lock = PTHREAD_RWLOCK_INITIALIZER};
 
 void usbcan_callback_dispatcher(uint32_t dev, uint32_t bus, uint32_t n);
 
-bool usbcan_library_init() {
-    state.type = VCI_USBCAN2;
+uint64_t usbcan_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    state.callbacks = state.tail = NULL;
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Sleeps until usbcan_now_us() reaches deadline_us. Pacing loops advance
+// the deadline by their interval so sleep overshoot does not accumulate.
+void usbcan_sleep_until(uint64_t deadline_us) {
+#ifdef __linux__
+    struct timespec ts;
+    ts.tv_sec = deadline_us / 1000000;
+    ts.tv_nsec = (deadline_us % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR) {
+    }
+#else
+    uint64_t now_us = usbcan_now_us();
+    if (now_us < deadline_us) {
+        struct timespec ts;
+        ts.tv_sec = (deadline_us - now_us) / 1000000;
+        ts.tv_nsec = ((deadline_us - now_us) % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+#endif
+}
 
-    state.num_devs = VCI_ScanDevice(1);
-    if (state.num_devs == 0) {
+// Condition variables waited on with usbcan_cond_wait_until are
+// initialized here, so their deadlines are on the usbcan_now_us clock
+// and a step of the wall clock cannot move them.
+void usbcan_cond_init(pthread_cond_t *cond) {
+#ifdef __linux__
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+#else
+    pthread_cond_init(cond, NULL);
+#endif
+}
+
+// Waits on cond until it is signalled or usbcan_now_us() reaches
+// deadline_us. Returns false on timeout.
+bool usbcan_cond_wait_until(pthread_cond_t *cond, pthread_mutex_t *lock,
+                            uint64_t deadline_us) {
+    struct timespec ts;
+#ifdef __linux__
+    ts.tv_sec = deadline_us / 1000000;
+    ts.tv_nsec = (deadline_us % 1000000) * 1000;
+
+    return pthread_cond_timedwait(cond, lock, &ts) != ETIMEDOUT;
+#else
+    // Without monotonic condition variables, wait for the time remaining.
+    uint64_t now_us = usbcan_now_us();
+    if (now_us >= deadline_us) {
         return false;
     }
+    ts.tv_sec = (deadline_us - now_us) / 1000000;
+    ts.tv_nsec = ((deadline_us - now_us) % 1000000) * 1000;
 
-    state.devs = (uint32_t *)calloc(state.num_devs, sizeof(uint32_t));
+    return pthread_cond_timedwait_relative_np(cond, lock, &ts) != ETIMEDOUT;
+#endif
+}
 
-    return true;
+struct usbcan_bus *usbcan_get_bus(uint32_t dev, uint32_t bus) {
+    if (state.num_devs <= dev || MAX_BUSES <= bus) {
+        return NULL;
+    }
+
+    return &state.devs[dev].buses[bus];
 }
 
-bool usbcan_library_close() {
-    struct usbcan_cb_entry *cbe = state.callbacks;
+struct usbcan_queue *usbcan_queue_alloc(uint32_t len) {
+    uint32_t cap = 1;
+    while (cap < len && cap < 0x80000000) {
+        cap <<= 1;
+    }
+
+    struct usbcan_queue *q =
+        (struct usbcan_queue *)calloc(1, sizeof(struct usbcan_queue));
+    if (q == NULL) {
+        return NULL;
+    }
+
+    q->msgs = (struct usbcan_msg *)calloc(cap, sizeof(struct usbcan_msg));
+    if (q->msgs == NULL) {
+        free(q);
+        return NULL;
+    }
+    q->mask = cap - 1;
+
+#ifdef __linux__
+    q->fds[0] = q->fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (q->fds[0] < 0) {
+        goto queue_alloc_error;
+    }
+#else
+    if (pipe(q->fds) != 0) {
+        goto queue_alloc_error;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(q->fds[i], F_SETFL, fcntl(q->fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(q->fds[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
+    pthread_mutex_init(&q->lock, NULL);
+
+    return q;
+
+  queue_alloc_error:
+    free(q->msgs);
+    free(q);
+    return NULL;
+}
+
+void usbcan_queue_free(struct usbcan_queue *q) {
+    if (q == NULL) {
+        return;
+    }
+
+    close(q->fds[0]);
+    if (q->fds[1] != q->fds[0]) {
+        close(q->fds[1]);
+    }
+    pthread_mutex_destroy(&q->lock);
+    free(q->msgs);
+    free(q);
+}
+
+// Frames beyond the ring's capacity are dropped; returns the number
+// queued. The fd is written only when the ring goes from drained to
+// non-empty, so a burst of any size costs the consumer a single wakeup.
+uint32_t usbcan_queue_push(struct usbcan_queue *q, struct usbcan_msg *msgs,
+                           uint32_t n) {
+    pthread_mutex_lock(&q->lock);
+
+    uint32_t space = q->mask + 1 - (q->tail - q->head);
+    if (n > space) {
+        n = space;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        q->msgs[(q->tail + i) & q->mask] = msgs[i];
+    }
+    q->tail += n;
+
+    if (n > 0 && !q->signaled) {
+#ifdef __linux__
+        uint64_t one = 1;
+        ssize_t written = write(q->fds[1], &one, sizeof(one));
+#else
+        uint8_t one = 1;
+        ssize_t written = write(q->fds[1], &one, sizeof(one));
+#endif
+        q->signaled = written > 0;
+    }
 
-    while (cbe != NULL) {
-        usbcan_deregister_callback(cbe->dev, cbe->bus);
-        cbe = cbe->next;
+    pthread_mutex_unlock(&q->lock);
+
+    return n;
+}
+
+uint32_t usbcan_queue_pop(struct usbcan_queue *q, struct usbcan_msg *msgs,
+                          uint32_t max) {
+    pthread_mutex_lock(&q->lock);
+
+    uint32_t n = q->tail - q->head;
+    if (n > max) {
+        n = max;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        msgs[i] = q->msgs[(q->head + i) & q->mask];
+    }
+    q->head += n;
+
+    if (q->head == q->tail && q->signaled) {
+        uint64_t buf;
+        while (read(q->fds[0], &buf, sizeof(buf)) > 0) {
+        }
+        q->signaled = false;
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    return n;
+}
+
+bool usbcan_library_init() {
+    uint32_t num_devs = VCI_ScanDevice(1);
+    if (num_devs == 0) {
+        return false;
+    }
+
+    struct usbcan_dev *devs =
+        (struct usbcan_dev *)calloc(num_devs, sizeof(struct usbcan_dev));
+    if (devs == NULL) {
+        return false;
+    }
+
+    for (uint32_t dev = 0; dev < num_devs; dev++) {
+        pthread_mutex_init(&devs[dev].lock, NULL);
+        pthread_mutex_init(&devs[dev].flusher.lock, NULL);
+        usbcan_cond_init(&devs[dev].flusher.cond);
+
+        for (uint32_t bus = 0; bus < MAX_BUSES; bus++) {
+            pthread_mutex_init(&devs[dev].buses[bus].tx_lock, NULL);
+            pthread_mutex_init(&devs[dev].buses[bus].rx_lock, NULL);
+            pthread_cond_init(&devs[dev].buses[bus].coalesce.flushed, NULL);
+        }
     }
 
+    pthread_rwlock_wrlock(&state.lock);
+    state.type = VCI_USBCAN2;
+    state.num_devs = num_devs;
+    state.devs = devs;
+    pthread_rwlock_unlock(&state.lock);
+
+    return true;
+}
+
+bool usbcan_library_close() {
+    bool status = true;
+
     for (uint32_t dev = 0; dev < state.num_devs; dev++) {
-        if (state.devs[dev] > 0) {
-            int ginkgo_status = VCI_CloseDevice(state.type, dev);
+        for (uint32_t bus = 0; bus < MAX_BUSES; bus++) {
+            usbcan_deregister_callback(dev, bus);
+        }
+
+        pthread_mutex_lock(&state.devs[dev].lock);
+        if (state.devs[dev].receive_cb) {
+            int ginkgo_status = VCI_LogoutReceiveCallback(dev);
             if (ginkgo_status == STATUS_ERR) {
-                return false;
+                status = false;
             }
 
-            ginkgo_status = VCI_LogoutReceiveCallback(dev);
+            state.devs[dev].receive_cb = false;
+        }
+
+        if (state.devs[dev].open) {
+            int ginkgo_status = VCI_CloseDevice(state.type, dev);
             if (ginkgo_status == STATUS_ERR) {
-                return false;
+                status = false;
             }
+
+            state.devs[dev].open = false;
         }
+        pthread_mutex_unlock(&state.devs[dev].lock);
     }
 
-    return true;
+    usbcan_coalesce_stop();
+
+    pthread_rwlock_wrlock(&state.lock);
+    struct usbcan_dev *devs = state.devs;
+    uint32_t num_devs = state.num_devs;
+    state.devs = NULL;
+    state.num_devs = 0;
+    pthread_rwlock_unlock(&state.lock);
+
+    for (uint32_t dev = 0; dev < num_devs; dev++) {
+        for (uint32_t bus = 0; bus < MAX_BUSES; bus++) {
+            pthread_mutex_destroy(&devs[dev].buses[bus].tx_lock);
+            pthread_mutex_destroy(&devs[dev].buses[bus].rx_lock);
+            pthread_cond_destroy(&devs[dev].buses[bus].coalesce.flushed);
+            free(devs[dev].buses[bus].tx_buf);
+            free(devs[dev].buses[bus].rx_buf);
+            free(devs[dev].buses[bus].rx_msgs);
+            usbcan_queue_free(devs[dev].buses[bus].queue);
+            free(devs[dev].buses[bus].changes);
+            free(devs[dev].buses[bus].latest);
+            free(devs[dev].buses[bus].coalesce.msgs);
+            free(devs[dev].buses[bus].coalesce.spare);
+            usbcan_pool_detach(devs[dev].buses[bus].pool);
+            usbcan_soa_free(devs[dev].buses[bus].soa);
+            usbcan_overload_free(devs[dev].buses[bus].overload);
+        }
+        pthread_cond_destroy(&devs[dev].flusher.cond);
+        pthread_mutex_destroy(&devs[dev].flusher.lock);
+        pthread_mutex_destroy(&devs[dev].lock);
+    }
+    free(devs);
+
+    return status;
 }
 
-bool usbcan_dev_init(uint32_t dev) {
+bool usbcan_dev_init(uint32_t dev, bool receive_cb) {
     if (state.num_devs <= dev) {
         return false;
     }
 
-    if (state.devs[dev] > 0) {
-        return true;
-    }
+    bool status = false;
+    int ginkgo_status;
 
-    int ginkgo_status = VCI_OpenDevice(state.type, dev, 0);
-    if (ginkgo_status == STATUS_ERR) {
-        return false;
+    pthread_mutex_lock(&state.devs[dev].lock);
+    if (!state.devs[dev].open) {
+        ginkgo_status = VCI_OpenDevice(state.type, dev, 0);
+        if (ginkgo_status == STATUS_ERR) {
+            goto dev_init_cleanup;
+        }
+
+        state.devs[dev].open = true;
     }
 
-    ginkgo_status =
-        VCI_RegisterReceiveCallback(dev, usbcan_callback_dispatcher);
-    if (ginkgo_status == STATUS_ERR) {
-        return false;
+    // Polled buses are drained by usbcan_poll, so the driver callback is
+    // only registered once some bus on the device wants callbacks.
+    if (receive_cb && !state.devs[dev].receive_cb) {
+        ginkgo_status =
+            VCI_RegisterReceiveCallback(dev, usbcan_callback_dispatcher);
+        if (ginkgo_status == STATUS_ERR) {
+            goto dev_init_cleanup;
+        }
+
+        state.devs[dev].receive_cb = true;
     }
 
-    state.devs[dev] = 1;
+    status = true;
 
-    return true;
-}
+  dev_init_cleanup:
+    pthread_mutex_unlock(&state.devs[dev].lock);
 
-bool usbcan_init(uint32_t dev, uint32_t bus, struct usbcan_bus_config *config) {
-    bool status = usbcan_dev_init(dev);
-    if (!status) {
-        return false;
-    }
+    return status;
+}
 
+bool usbcan_init_can(uint32_t dev, uint32_t bus, uint32_t speed, uint8_t mode) {
     VCI_INIT_CONFIG_EX init_config;
     init_config.CAN_ABOM = 0;
-    init_config.CAN_Mode = 0;
-    init_config.CAN_BRP = CAN_SPEEDS[config->speed][0];
-    init_config.CAN_BS1 = CAN_SPEEDS[config->speed][1];
-    init_config.CAN_BS2 = CAN_SPEEDS[config->speed][2];
-    init_config.CAN_SJW = CAN_SPEEDS[config->speed][3];
+    init_config.CAN_Mode = mode;
+    init_config.CAN_BRP = CAN_SPEEDS[speed][0];
+    init_config.CAN_BS1 = CAN_SPEEDS[speed][1];
+    init_config.CAN_BS2 = CAN_SPEEDS[speed][2];
+    init_config.CAN_SJW = CAN_SPEEDS[speed][3];
     init_config.CAN_NART = 1;
     init_config.CAN_RFLM = 0;
     init_config.CAN_TXFP = 1;
     init_config.CAN_RELAY = 0;
 
+    usbcan_filters_forget(dev, bus);
     uint32_t ginkgo_status = VCI_InitCANEx(state.type, dev, bus, &init_config);
     if (ginkgo_status == STATUS_ERR) {
         return false;
     }
 
+    return true;
+}
+
+bool usbcan_init(uint32_t dev, uint32_t bus, struct usbcan_bus_config *config) {
+    struct usbcan_bus *b = usbcan_get_bus(dev, bus);
+    if (b == NULL) {
+        return false;
+    }
+
+    // A transfer's TP.CM and TP.DT frames have different IDs, so several
+    // workers would take them to different threads.
+    if (config->workers > 1 && config->cb == usbcan_j1939_callback) {
+        return false;
+    }
+
+    bool poll = (config->flags & USBCAN_FLAG_POLL) > 0;
+    bool queued = (config->flags & USBCAN_FLAG_QUEUE) > 0 && !poll;
+
+    // The ring, and so the fd, outlives re-initialization so epoll
+    // registrations stay valid.
+    if (queued && b->queue == NULL) {
+        struct usbcan_queue *q = usbcan_queue_alloc(
+            config->queue_len > 0 ? config->queue_len : USBCAN_QUEUE_LEN);
+        if (q == NULL) {
+            return false;
+        }
+
+        pthread_mutex_lock(&b->rx_lock);
+        b->queue = q;
+        pthread_mutex_unlock(&b->rx_lock);
+    }
+
+    bool status = usbcan_dev_init(dev, !poll);
+    if (!status) {
+        return false;
+    }
+
+    bool latest = (config->flags & USBCAN_FLAG_LAST_VALUE) > 0;
+    if (latest && b->latest == NULL) {
+        struct usbcan_latest *l = usbcan_latest_alloc();
+        if (l == NULL) {
+            return false;
+        }
+
+        pthread_mutex_lock(&b->rx_lock);
+        __atomic_store_n(&b->latest, l, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&b->rx_lock);
+    }
+
+    struct usbcan_changes *changes = NULL;
+    if ((config->flags & USBCAN_FLAG_CHANGES_ONLY) > 0) {
+        changes = usbcan_changes_alloc(config);
+        if (changes == NULL) {
+            return false;
+        }
+    }
+
+    // The columns, like the ring, are kept across re-initialization.
+    bool soa = (config->flags & USBCAN_FLAG_SOA) > 0 && !poll && !queued;
+    if (soa && b->soa == NULL) {
+        struct usbcan_soa_buf *s = usbcan_soa_alloc();
+        if (s == NULL) {
+            free(changes);
+            return false;
+        }
+
+        pthread_mutex_lock(&b->rx_lock);
+        b->soa = s;
+        pthread_mutex_unlock(&b->rx_lock);
+    }
+
+    bool overload = (config->overload != USBCAN_OVERLOAD_NONE ||
+                     (config->flags & USBCAN_FLAG_WORKER) > 0 ||
+                     config->workers > 1) &&
+        !poll && !queued;
+
+    struct usbcan_pool *pool = NULL;
+    bool retain = (config->flags & USBCAN_FLAG_RETAIN) > 0 && !poll &&
+        !queued && !soa && !overload;
+    if (retain) {
+        pool = usbcan_pool_alloc(
+            config->pool_batches > 0 ? config->pool_batches
+                                     : USBCAN_POOL_BATCHES,
+            config->batch_max > 0 ? config->batch_max : USBCAN_BATCH_MAX);
+        if (pool == NULL) {
+            free(changes);
+            return false;
+        }
+    }
+
+    pthread_mutex_lock(&b->rx_lock);
+    b->poll = poll;
+    b->queued = queued;
+    b->latest_enabled = latest;
+    struct usbcan_changes *old_changes = b->changes;
+    b->changes = changes;
+    struct usbcan_pool *old_pool = b->pool;
+    b->pool = pool;
+    pthread_mutex_unlock(&b->rx_lock);
+
+    free(old_changes);
+    usbcan_pool_detach(old_pool);
+
+    uint8_t mode = (config->flags & USBCAN_FLAG_SILENT) > 0 ? USBCAN_MODE_SILENT
+                                                            : USBCAN_MODE_NORMAL;
+    if (!usbcan_init_can(dev, bus, config->speed, mode)) {
+        return false;
+    }
+
+    usbcan_errors_init(dev, bus, b, config);
+    if (!usbcan_coalesce_init(dev, bus, b, config,
+                              !poll && !queued && !retain && !overload)) {
+        return false;
+    }
+    if (!usbcan_overload_init(dev, bus, b, config, overload)) {
+        return false;
+    }
+
     if (config->num_filters == 0) {
         usbcan_clear_filters(dev, bus);
     } else {
         usbcan_set_filters(dev, bus, config->filters, config->num_filters);
     }
 
-    if (config->cb != NULL) {
+    if (soa && config->soa_cb != NULL) {
+        pthread_mutex_lock(&b->rx_lock);
+        status = b->cb == NULL && b->soa_cb == NULL;
+        if (status) {
+            b->soa_cb = config->soa_cb;
+            b->arg = config->arg;
+            usbcan_overload_set_cb(b);
+        }
+        pthread_mutex_unlock(&b->rx_lock);
+        if (!status) {
+            return false;
+        }
+    } else if (config->cb != NULL && !poll && !queued) {
         status = usbcan_register_callback(dev, bus, config->cb, config->arg);
         if (!status) {
             return false;
@@ -162,6 +547,7 @@ bool usbcan_start(uint32_t dev, uint32_t bus) {
 }
 
 bool usbcan_reset(uint32_t dev, uint32_t bus) {
+    usbcan_filters_forget(dev, bus);
     VCI_ResetCAN(state.type, dev, bus);
 
     return true;
@@ -180,15 +566,38 @@ uint32_t usbcan_send(uint32_t dev, uint32_t bus, struct can_frame *frame) {
 
 uint32_t usbcan_send_n(uint32_t dev, uint32_t bus, struct can_frame *frames,
                        uint32_t n) {
-    PVCI_CAN_OBJ msgs = (PVCI_CAN_OBJ)calloc(n, sizeof(VCI_CAN_OBJ));
+    struct usbcan_bus *b = usbcan_get_bus(dev, bus);
+    if (b == NULL || n == 0) {
+        return 0;
+    }
+
+    USBCAN_PROBE(send_entry, dev, bus, n);
+    uint64_t send_ns = usbcan_trace_clock();
+
+    pthread_mutex_lock(&b->tx_lock);
+
+    if (b->tx_cap < n) {
+        PVCI_CAN_OBJ tx_buf =
+            (PVCI_CAN_OBJ)realloc(b->tx_buf, n * sizeof(VCI_CAN_OBJ));
+        if (tx_buf == NULL) {
+            pthread_mutex_unlock(&b->tx_lock);
+            USBCAN_PROBE(send_return, dev, bus, 0);
+            return 0;
+        }
+        b->tx_buf = tx_buf;
+        b->tx_cap = n;
+    }
+
+    PVCI_CAN_OBJ msgs = b->tx_buf;
+    memset(msgs, 0, n * sizeof(VCI_CAN_OBJ));
 
     for (uint32_t i = 0; i < n; i++) {
         msgs[i].ID = (frames[i].can_id & CAN_EFF_FLAG) > 0
             ? frames[i].can_id & CAN_EFF_MASK
             : frames[i].can_id & CAN_SFF_MASK;
-        msgs[1].SendType = 0;
-        msgs[1].RemoteFlag = (frames[i].can_id & CAN_RTR_FLAG) > 0 ? 1 : 0;
-        msgs[1].ExternFlag = (frames[i].can_id & CAN_EFF_FLAG) > 0 ? 1 : 0;
+        msgs[i].SendType = 0;
+        msgs[i].RemoteFlag = (frames[i].can_id & CAN_RTR_FLAG) > 0 ? 1 : 0;
+        msgs[i].ExternFlag = (frames[i].can_id & CAN_EFF_FLAG) > 0 ? 1 : 0;
 
         for (int j = 0; j < frames[i].can_dlc; j++) {
             msgs[i].Data[j] = frames[i].data[j];
@@ -196,186 +605,381 @@ uint32_t usbcan_send_n(uint32_t dev, uint32_t bus, struct can_frame *frames,
         msgs[i].DataLen = frames[i].can_dlc;
     }
 
+    USBCAN_PROBE(transmit_entry, dev, bus, n);
+    uint64_t transmit_ns = usbcan_trace_clock();
     int sent = VCI_Transmit(state.type, dev, bus, msgs, n);
+    usbcan_trace(USBCAN_STAGE_TRANSMIT, transmit_ns, dev, bus, sent);
+    USBCAN_PROBE(transmit_return, dev, bus, sent);
 
-    free(msgs);
+    pthread_mutex_unlock(&b->tx_lock);
+
+    usbcan_trace(USBCAN_STAGE_SEND, send_ns, dev, bus, sent);
+    USBCAN_PROBE(send_return, dev, bus, sent);
 
     return sent;
 }
 
-bool usbcan_set_filters(uint32_t dev, uint32_t bus, struct can_filter *filters,
-                        uint8_t num_filters) {
-    usbcan_clear_filters(dev, bus);
-
-    if (num_filters >= MAX_FILTERS) {
-        return false;
-    }
-
-    for (int i = 0; i < num_filters; i++) {
-        int mode = 1;
-
-        if (filters[i].can_mask == 0 && filters[i].can_id > 0) {
-            mode = 0;
+bool usbcan_rx_reserve(struct usbcan_bus *b, uint32_t n) {
+    if (b->rx_cap < n) {
+        PVCI_CAN_OBJ rx_buf =
+            (PVCI_CAN_OBJ)realloc(b->rx_buf, n * sizeof(VCI_CAN_OBJ));
+        if (rx_buf == NULL) {
+            return false;
         }
+        b->rx_buf = rx_buf;
 
-        VCI_FILTER_CONFIG filter_config;
-        filter_config.FilterIndex = i;
-        filter_config.Enable = 1;
-        filter_config.ExtFrame = 0;
-        filter_config.FilterMode = mode;
-        filter_config.ID_IDE = (filters[i].can_id & CAN_EFF_FLAG) > 0 ? 1 : 0;
-        filter_config.ID_RTR = (filters[i].can_id & CAN_RTR_FLAG) > 0 ? 1 : 0;
-        filter_config.ID_Std_Ext = (filters[i].can_id & CAN_EFF_FLAG) > 0
-            ? filters[i].can_id & CAN_EFF_MASK
-            : filters[i].can_id & CAN_SFF_MASK;
-        filter_config.MASK_IDE =
-            (filters[i].can_mask & CAN_EFF_FLAG) > 0 ? 1 : 0;
-        filter_config.MASK_RTR =
-            (filters[i].can_mask & CAN_RTR_FLAG) > 0 ? 1 : 0;
-        filter_config.MASK_Std_Ext = (filters[i].can_mask & CAN_EFF_FLAG) > 0
-            ? filters[i].can_mask & CAN_EFF_MASK
-            : filters[i].can_mask & CAN_SFF_MASK;
-
-        int ginkgo_status = VCI_SetFilter(state.type, dev, bus, &filter_config);
-        if (ginkgo_status == STATUS_ERR) {
+        struct usbcan_msg *rx_msgs = (struct usbcan_msg *)realloc(
+            b->rx_msgs, n * sizeof(struct usbcan_msg));
+        if (rx_msgs == NULL) {
             return false;
         }
+        b->rx_msgs = rx_msgs;
+        b->rx_cap = n;
     }
 
     return true;
 }
 
-bool usbcan_clear_filters(uint32_t dev, uint32_t bus) {
-    for (int i = 0; i < MAX_FILTERS; i++) {
-        VCI_FILTER_CONFIG filter_config;
-        filter_config.FilterIndex = i;
-        filter_config.Enable = 1;
-        filter_config.ExtFrame = 0;
-        filter_config.FilterMode = 0;
-        filter_config.ID_IDE = 0;
-        filter_config.ID_RTR = 0;
-        filter_config.ID_Std_Ext = 0;
-        filter_config.MASK_IDE = 0;
-        filter_config.MASK_RTR = 0;
-        filter_config.MASK_Std_Ext = 0;
-
-        int ginkgo_status = VCI_SetFilter(state.type, dev, bus, &filter_config);
-        if (ginkgo_status == STATUS_ERR) {
-            return false;
-        }
+void usbcan_msg_from_vci(struct usbcan_msg *msg, PVCI_CAN_OBJ vci_msg) {
+    msg->frame.can_id = vci_msg->ID;
+    msg->timestamp = vci_msg->TimeFlag > 0 ? vci_msg->TimeStamp : 0;
+
+    if (vci_msg->RemoteFlag > 0) {
+        msg->frame.can_id |= CAN_RTR_FLAG;
     }
 
-    return true;
-}
+    if (vci_msg->ExternFlag > 0) {
+        msg->frame.can_id |= CAN_EFF_FLAG;
+    }
 
-struct usbcan_cb_entry *usbcan_get_callback(uint32_t dev, uint32_t bus) {
-    struct usbcan_cb_entry *cbe = state.callbacks;
+    uint8_t dlc = vci_msg->DataLen > 8 ? 8 : vci_msg->DataLen;
+    msg->frame.can_dlc = dlc;
+    memset(msg->frame.data, 0, sizeof(msg->frame.data));
+    memcpy(msg->frame.data, vci_msg->Data, dlc);
+}
 
-    while (cbe != NULL) {
-        if (cbe->dev == dev && cbe->bus == bus) {
-            return cbe;
+void usbcan_deliver(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+                    struct usbcan_msg *msgs, uint32_t n) {
+    if (b->queued) {
+        uint32_t queued = usbcan_queue_push(b->queue, msgs, n);
+        usbcan_count(&b->stats.delivered, queued);
+        usbcan_count(&b->stats.dropped, n - queued);
+    } else if (b->pool != NULL) {
+        if (b->cb != NULL) {
+            usbcan_pool_deliver(dev, bus, b, msgs, n);
         }
-        cbe = cbe->next;
+    } else if (b->overload != NULL) {
+        if (b->cb != NULL || b->soa_cb != NULL) {
+            usbcan_overload_push(b, msgs, n);
+        }
+    } else if (b->coalesce.enabled) {
+        usbcan_coalesce(dev, bus, b, msgs, n, usbcan_now_us());
+    } else if (b->soa_cb != NULL) {
+        usbcan_soa_deliver(dev, bus, b, msgs, n);
+    } else if (b->cb != NULL) {
+        b->cb(dev, bus, msgs, n, b->arg);
+        usbcan_count(&b->stats.delivered, n);
     }
+}
 
-    return NULL;
+// The device whose receive callback this thread is running, plus one.
+static __thread uint32_t dispatching
+    __attribute__((tls_model("initial-exec")));
+
+// Frames of dev cannot be received until a caller on this thread returns.
+bool usbcan_on_dispatcher(uint32_t dev) {
+    return dispatching == dev + 1;
+}
+
+// Marks a thread delivering dev's frames outside the dispatcher, so the
+// same calls are refused there.
+void usbcan_set_dispatcher(uint32_t dev) {
+    dispatching = dev + 1;
+}
+
+void usbcan_clear_dispatcher() {
+    dispatching = 0;
 }
 
 void usbcan_callback_dispatcher(uint32_t dev, uint32_t bus, uint32_t n) {
 #pragma unused(n)
-    struct usbcan_cb_entry *cbe = usbcan_get_callback(dev, bus);
+    pthread_rwlock_rdlock(&state.lock);
+
+    struct usbcan_bus *b = usbcan_get_bus(dev, bus);
+    if (b == NULL) {
+        goto dispatcher_unlock_state;
+    }
+
+    dispatching = dev + 1;
+
+    USBCAN_PROBE(dispatch_entry, dev, bus, 0);
+    uint64_t dispatch_ns = usbcan_trace_clock();
+    uint32_t dispatched = 0;
 
-    if (cbe != NULL) {
-        int msgs_avail = VCI_GetReceiveNum(state.type, dev, bus);
+    pthread_mutex_lock(&b->rx_lock);
 
-        PVCI_CAN_OBJ vci_msgs =
-            (PVCI_CAN_OBJ)calloc(msgs_avail, sizeof(VCI_CAN_OBJ));
-        struct usbcan_msg *msgs =
-            (struct usbcan_msg *)calloc(msgs_avail, sizeof(struct usbcan_msg));
+    if (b->cb != NULL || b->soa_cb != NULL || b->queued || b->isotp != NULL) {
+        uint64_t now_us = usbcan_now_us();
+        USBCAN_PROBE(receive_num_entry, dev, bus, 0);
+        uint64_t stage_ns = usbcan_trace_clock();
+        uint32_t msgs_avail = VCI_GetReceiveNum(state.type, dev, bus);
+        usbcan_trace(USBCAN_STAGE_RECEIVE_NUM, stage_ns, dev, bus, msgs_avail);
+        USBCAN_PROBE(receive_num_return, dev, bus, msgs_avail);
+        if (msgs_avail >= 0xFFFFFFFF) {
+            b->errors.due = true;
+            msgs_avail = 0;
+        }
+        usbcan_errors_received(b, msgs_avail, now_us);
 
+        struct usbcan_msg *msgs;
         uint32_t msgs_read;
+        uint32_t rounds = 0;
         while (msgs_avail > 0) {
-            msgs_read = 0;
+            uint32_t msgs_want = msgs_avail;
+
+            // Retaining buses convert straight into a pooled batch.
+            struct usbcan_batch *batch = NULL;
+            if (b->pool != NULL && b->cb != NULL) {
+                batch = usbcan_pool_get(b->pool);
+                if (batch != NULL && b->pool->cap < msgs_want) {
+                    msgs_want = b->pool->cap;
+                }
+            }
+
+            if (!usbcan_rx_reserve(b, msgs_want)) {
+                usbcan_release(batch);
+                break;
+            }
+
+            msgs = b->rx_msgs;
+            if (batch != NULL) {
+                msgs = batch->msgs;
+                b->pool->current = batch;
+            }
+
+            USBCAN_PROBE(receive_entry, dev, bus, msgs_want);
+            stage_ns = usbcan_trace_clock();
             msgs_read =
-                VCI_Receive(state.type, dev, bus, vci_msgs, msgs_avail, -1);
-            if (msgs_read == 0 || msgs_read >= 0xFFFFFFFF) {
-                goto dispatcher_cleanup;
+                VCI_Receive(state.type, dev, bus, b->rx_buf, msgs_want, -1);
+            usbcan_trace(USBCAN_STAGE_RECEIVE, stage_ns, dev, bus, msgs_read);
+            USBCAN_PROBE(receive_return, dev, bus, msgs_read);
+            if (msgs_read >= 0xFFFFFFFF || msgs_read == 0) {
+                if (msgs_read > 0) {
+                    b->errors.due = true;
+                }
+                if (batch != NULL) {
+                    b->pool->current = NULL;
+                    usbcan_release(batch);
+                }
+                break;
             }
 
+            stage_ns = usbcan_trace_clock();
             for (uint32_t i = 0; i < msgs_read; i++) {
-                msgs[i].frame.can_id = vci_msgs[i].ID;
+                usbcan_msg_from_vci(&msgs[i], &b->rx_buf[i]);
+            }
+            usbcan_trace(USBCAN_STAGE_CONVERT, stage_ns, dev, bus, msgs_read);
+            USBCAN_PROBE(convert_return, dev, bus, msgs_read);
+            usbcan_count(&b->stats.received, msgs_read);
+            dispatched += msgs_read;
+            b->errors.timestamp = msgs[msgs_read - 1].timestamp;
 
-                if (vci_msgs[i].TimeFlag > 0) {
-                    msgs[i].timestamp = vci_msgs[i].TimeStamp;
-                }
+            USBCAN_PROBE(deliver_entry, dev, bus, msgs_read);
+            stage_ns = usbcan_trace_clock();
 
-                if (vci_msgs[i].RemoteFlag > 0) {
-                    msgs[i].frame.can_id |= CAN_RTR_FLAG;
-                }
+            if (b->latest_enabled) {
+                usbcan_latest_update(b->latest, msgs, msgs_read);
+            }
 
-                if (vci_msgs[i].ExternFlag > 0) {
-                    msgs[i].frame.can_id |= CAN_EFF_FLAG;
-                }
+            if (b->isotp != NULL) {
+                usbcan_isotp_receive(b->isotp, msgs, msgs_read);
+            }
 
-                msgs[i].frame.can_dlc = vci_msgs[i].DataLen;
-                for (int j = 0; j < vci_msgs[i].DataLen; j++) {
-                    msgs[i].frame.data[j] = vci_msgs[i].Data[j];
-                }
+            uint32_t msgs_kept = msgs_read;
+            if (b->changes != NULL) {
+                msgs_kept = usbcan_changes_filter(b->changes, msgs, msgs_read,
+                                                  usbcan_now_us());
+                usbcan_count(&b->stats.suppressed, msgs_read - msgs_kept);
+            }
+
+            if (msgs_kept > 0) {
+                usbcan_deliver(dev, bus, b, msgs, msgs_kept);
+            }
+
+            usbcan_trace(USBCAN_STAGE_DELIVER, stage_ns, dev, bus, msgs_kept);
+            USBCAN_PROBE(deliver_return, dev, bus, msgs_kept);
+
+            if (batch != NULL) {
+                b->pool->current = NULL;
+                usbcan_release(batch);
             }
-            cbe->cb(dev, bus, msgs, msgs_read, cbe->arg);
 
             msgs_avail -= msgs_read;
+
+            // After an overflow, take what arrived meanwhile now rather
+            // than on the next callback.
+            if (msgs_avail == 0 && b->errors.draining &&
+                ++rounds < USBCAN_DRAIN_ROUNDS) {
+                msgs_avail = VCI_GetReceiveNum(state.type, dev, bus);
+                if (msgs_avail >= 0xFFFFFFFF) {
+                    msgs_avail = 0;
+                }
+            }
+        }
+
+        struct usbcan_msg error;
+        if (usbcan_errors_sample(dev, bus, b, &error, now_us)) {
+            usbcan_deliver(dev, bus, b, &error, 1);
         }
-      dispatcher_cleanup:
-        free(msgs);
-        free(vci_msgs);
     }
+
+    pthread_mutex_unlock(&b->rx_lock);
+    dispatching = 0;
+
+    usbcan_trace(USBCAN_STAGE_DISPATCH, dispatch_ns, dev, bus, dispatched);
+    USBCAN_PROBE(dispatch_return, dev, bus, dispatched);
+
+  dispatcher_unlock_state:
+    pthread_rwlock_unlock(&state.lock);
 }
 
-bool usbcan_register_callback(uint32_t dev, uint32_t bus, usbcan_cb cb,
-                              void *arg) {
-    struct usbcan_cb_entry *cbe = usbcan_get_callback(dev, bus);
+uint32_t usbcan_poll(uint32_t dev_mask, struct usbcan_bus_msg *msgs,
+                     uint32_t max) {
+    uint32_t n = 0;
 
-    if (cbe != NULL) {
-        return false;
+    for (uint32_t dev = 0; dev < state.num_devs && dev < 32; dev++) {
+        if ((dev_mask & (1U << dev)) == 0) {
+            continue;
+        }
+
+        for (uint32_t bus = 0; bus < MAX_BUSES && n < max; bus++) {
+            struct usbcan_bus *b = &state.devs[dev].buses[bus];
+
+            pthread_mutex_lock(&b->rx_lock);
+            if (!b->poll || !usbcan_rx_reserve(b, max - n)) {
+                pthread_mutex_unlock(&b->rx_lock);
+                continue;
+            }
+
+            uint32_t msgs_read =
+                VCI_Receive(state.type, dev, bus, b->rx_buf, max - n, 0);
+            if (msgs_read >= 0xFFFFFFFF) {
+                b->errors.due = true;
+                msgs_read = 0;
+            }
+
+            for (uint32_t i = 0; i < msgs_read; i++) {
+                msgs[n + i].dev = dev;
+                msgs[n + i].bus = bus;
+                usbcan_msg_from_vci(&msgs[n + i].msg, &b->rx_buf[i]);
+
+                if (b->latest_enabled) {
+                    usbcan_latest_update(b->latest, &msgs[n + i].msg, 1);
+                }
+            }
+            usbcan_count(&b->stats.received, msgs_read);
+            if (msgs_read > 0) {
+                b->errors.timestamp = msgs[n + msgs_read - 1].msg.timestamp;
+            }
+            n += msgs_read;
+
+            if (n < max && usbcan_errors_sample(dev, bus, b, &msgs[n].msg,
+                                                usbcan_now_us())) {
+                msgs[n].dev = dev;
+                msgs[n].bus = bus;
+                msgs_read++;
+                n++;
+            }
+            usbcan_count(&b->stats.delivered, msgs_read);
+            pthread_mutex_unlock(&b->rx_lock);
+        }
     }
 
-    cbe = (struct usbcan_cb_entry *)calloc(1, sizeof(struct usbcan_cb_entry));
-    cbe->dev = dev;
-    cbe->bus = bus;
-    cbe->cb = cb;
-    cbe->arg = arg;
-    cbe->next = NULL;
+    return n;
+}
 
-    if (state.tail != NULL) {
-        state.tail->next = cbe;
-    } else {
-        state.callbacks = cbe;
+int usbcan_event_fd(uint32_t dev, uint32_t bus) {
+    struct usbcan_bus *b = usbcan_get_bus(dev, bus);
+    if (b == NULL || b->queue == NULL) {
+        return -1;
+    }
+
+    return b->queue->fds[0];
+}
+
+uint32_t usbcan_drain(uint32_t dev, uint32_t bus, struct usbcan_msg *msgs,
+                      uint32_t max) {
+    struct usbcan_bus *b = usbcan_get_bus(dev, bus);
+    if (b == NULL || b->queue == NULL) {
+        return 0;
+    }
+
+    return usbcan_queue_pop(b->queue, msgs, max);
+}
+
+bool usbcan_get_stats(uint32_t dev, uint32_t bus,
+                      struct usbcan_bus_stats *stats) {
+    struct usbcan_bus *b = usbcan_get_bus(dev, bus);
+    if (b == NULL) {
+        return false;
     }
-    state.tail = cbe;
+
+    stats->received = __atomic_load_n(&b->stats.received, __ATOMIC_RELAXED);
+    stats->delivered = __atomic_load_n(&b->stats.delivered, __ATOMIC_RELAXED);
+    stats->suppressed =
+        __atomic_load_n(&b->stats.suppressed, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&b->stats.dropped, __ATOMIC_RELAXED);
+    stats->overflows = __atomic_load_n(&b->stats.overflows, __ATOMIC_RELAXED);
+    stats->lost = __atomic_load_n(&b->stats.lost, __ATOMIC_RELAXED);
+    stats->errors = __atomic_load_n(&b->stats.errors, __ATOMIC_RELAXED);
+    stats->exhausted = __atomic_load_n(&b->stats.exhausted, __ATOMIC_RELAXED);
+    stats->evicted = __atomic_load_n(&b->stats.evicted, __ATOMIC_RELAXED);
+    stats->rejected = __atomic_load_n(&b->stats.rejected, __ATOMIC_RELAXED);
+    stats->replaced = __atomic_load_n(&b->stats.replaced, __ATOMIC_RELAXED);
+    stats->stalls = __atomic_load_n(&b->stats.stalls, __ATOMIC_RELAXED);
 
     return true;
 }
 
-bool usbcan_deregister_callback(uint32_t dev, uint32_t bus) {
-    struct usbcan_cb_entry *cbe = usbcan_get_callback(dev, bus);
-    struct usbcan_cb_entry *pred_cbe = state.callbacks;
+bool usbcan_register_callback(uint32_t dev, uint32_t bus, usbcan_cb cb,
+                              void *arg) {
+    struct usbcan_bus *b = usbcan_get_bus(dev, bus);
+    if (b == NULL) {
+        return false;
+    }
 
-    if (cbe != NULL) {
-        if (pred_cbe != cbe) {
-            while (pred_cbe->next != cbe) {
-                pred_cbe = pred_cbe->next;
-            }
-        }
+    bool status = false;
 
-        pred_cbe->next = cbe->next;
+    pthread_mutex_lock(&b->rx_lock);
+    if (b->cb == NULL && b->soa_cb == NULL &&
+        (cb != usbcan_j1939_callback || b->overload == NULL ||
+         b->overload->shards == 1)) {
+        b->cb = cb;
+        b->arg = arg;
+        usbcan_overload_set_cb(b);
+        status = true;
+    }
+    pthread_mutex_unlock(&b->rx_lock);
 
-        if (state.tail == cbe) {
-            state.tail = pred_cbe;
-        }
+    return status;
+}
 
-        free(cbe);
+bool usbcan_deregister_callback(uint32_t dev, uint32_t bus) {
+    struct usbcan_bus *b = usbcan_get_bus(dev, bus);
+    if (b == NULL) {
+        return true;
     }
 
+    pthread_mutex_lock(&b->rx_lock);
+    usbcan_coalesce_flush(dev, bus, b);
+    b->cb = NULL;
+    b->soa_cb = NULL;
+    b->arg = NULL;
+    usbcan_overload_set_cb(b);
+    pthread_mutex_unlock(&b->rx_lock);
+
+    // Callback threads may themselves be waiting for rx_lock.
+    usbcan_overload_idle(b);
+
     return true;
 }
@@ -0,0 +1,397 @@
+/*
+  Copyright 2015 Benjamin Black
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#pragma once
+
+// Library state shared between the source files of libusbcan. Not
+// installed and not part of the API.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "usbcan.h"
+#include "ginkgo.h"
+
+/*
+  Locking
+
+  state.lock is held for reading by the dispatcher for the whole of a
+  dispatch and for writing only while usbcan_library_init/close swap the
+  device table, so in-flight callbacks never see it freed under them.
+
+  Each device has a lock serializing VCI_OpenDevice. Each bus has its own
+  tx_lock, so sends on different buses and devices proceed concurrently,
+  and an rx_lock held while its callback runs, so usbcan_stop and
+  usbcan_deregister_callback return only once that bus is quiescent.
+
+  A queued bus's ring has its own lock, taken only for the push and the
+  drain, so an application thread draining it never waits on the driver.
+  The ring of a bus with an overload policy likewise has a lock taken
+  inside rx_lock; the thread calling back from it never takes rx_lock,
+  though its callback may, so it is waited for without rx_lock held.
+*/
+
+struct usbcan_queue {
+    pthread_mutex_t lock;
+    struct usbcan_msg *msgs;
+    uint32_t mask;
+    uint32_t head;
+    uint32_t tail;
+    int fds[2]; // [read, write]; the same eventfd twice on Linux
+    bool signaled;
+};
+
+// Overflow and controller error tracking, updated by whoever holds the
+// bus's rx_lock. See errors.c.
+struct usbcan_errors {
+    bool enabled;
+    bool due;
+    bool overflow;
+    bool draining;
+    uint8_t state;
+    uint32_t buffer_size;
+    uint32_t timestamp;
+    uint64_t rate;
+    uint64_t last_us;
+    uint64_t interval_us;
+    uint64_t sample_us;
+};
+
+// Frames held back for a larger callback batch, flushed once min are
+// held or the oldest has waited hold_us. See coalesce.c.
+struct usbcan_coalesce {
+    bool enabled;
+    bool adaptive;
+    bool flushing; // the flusher is delivering spare
+    uint32_t min;
+    uint32_t max;
+    uint64_t hold_us;
+    struct usbcan_msg *msgs;
+    struct usbcan_msg *spare;
+    uint32_t n;
+    uint32_t cap;
+    uint64_t since_us;
+    pthread_cond_t flushed;
+};
+
+// A device's thread delivering held frames once their hold expires.
+struct usbcan_flusher {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool running;
+    uint64_t deadline_us;
+};
+
+// The filter banks as last programmed, so changes rewrite only the banks
+// that differ. See filters.c.
+struct usbcan_filters {
+    VCI_FILTER_CONFIG banks[MAX_FILTERS];
+    bool known[MAX_FILTERS];
+};
+
+// Receive batches handed to retaining consumers. See pool.c.
+struct usbcan_batch {
+    struct usbcan_pool *pool;
+    struct usbcan_batch *next;
+    uint32_t refs;
+    struct usbcan_msg *msgs;
+};
+
+struct usbcan_pool {
+    pthread_mutex_t lock;
+    uint32_t refs;
+    struct usbcan_batch *free;
+    struct usbcan_batch *batches;
+    struct usbcan_msg *msgs;
+    uint32_t num_batches;
+    uint32_t cap;
+    struct usbcan_batch *current; // being filled or delivered, under rx_lock
+};
+
+// Per-bus columns for USBCAN_FLAG_SOA delivery. See soa.c.
+struct usbcan_soa_buf {
+    struct usbcan_soa batch;
+    uint32_t cap;
+    uint32_t last_timestamp;
+    uint64_t epoch;
+};
+
+// A bounded ring between the dispatcher and a thread that calls back,
+// with the bus's overload policy applied when it fills, one of shards
+// when frames are spread across several threads by ID. See overload.c.
+struct usbcan_overload_slot {
+    canid_t can_id;
+    uint32_t pos;
+};
+
+struct usbcan_overload {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    pthread_t thread;
+    bool started;
+    bool stopping;
+    bool busy; // in the callback
+    bool detached; // no longer the bus's; freed by the last user
+    uint32_t users; // waiting without rx_lock; counted in shard 0
+    uint32_t shard;
+    uint32_t shards;
+    uint32_t policy;
+    uint32_t dev;
+    uint32_t bus;
+    struct usbcan_bus *b;
+    usbcan_cb cb;
+    usbcan_soa_cb soa_cb;
+    void *arg;
+    struct usbcan_msg *msgs;
+    struct usbcan_overload_slot *slots; // newest queued position by ID
+    uint32_t mask;
+    uint32_t head;
+    uint32_t tail;
+    struct usbcan_msg *batch; // owned by the thread
+    uint32_t batch_max;
+    struct usbcan_soa_buf *soa; // owned by the thread
+    struct usbcan_msg *routed; // frames grouped by worker; shard 0's
+    uint32_t *route; // each frame's worker
+    uint32_t *runs; // each worker's first and past-last routed frame
+    uint32_t route_cap;
+    pthread_mutex_t room_lock; // shard 0's, for room in any ring
+    pthread_cond_t room;
+    uint32_t room_seq;
+    bool room_wanted;
+};
+
+struct usbcan_changes;
+struct usbcan_latest;
+struct usbcan_isotp;
+
+struct usbcan_bus {
+    pthread_mutex_t tx_lock;
+    PVCI_CAN_OBJ tx_buf;
+    uint32_t tx_cap;
+
+    pthread_mutex_t rx_lock;
+    PVCI_CAN_OBJ rx_buf;
+    struct usbcan_msg *rx_msgs;
+    uint32_t rx_cap;
+    bool poll;
+    bool queued;
+    struct usbcan_queue *queue;
+    struct usbcan_changes *changes;
+    struct usbcan_latest *latest;
+    bool latest_enabled;
+    struct usbcan_errors errors;
+    struct usbcan_coalesce coalesce;
+    struct usbcan_isotp *isotp;
+    struct usbcan_filters filters;
+    struct usbcan_pool *pool;
+    struct usbcan_soa_buf *soa;
+    struct usbcan_overload *overload; // shards of them
+    usbcan_cb cb;
+    usbcan_soa_cb soa_cb;
+    void *arg;
+
+    struct usbcan_bus_stats stats;
+};
+
+struct usbcan_dev {
+    pthread_mutex_t lock;
+    bool open;
+    bool receive_cb;
+    bool info_read;
+    bool info_valid;
+    VCI_BOARD_INFO_EX info;
+    struct usbcan_flusher flusher;
+    struct usbcan_bus buses[MAX_BUSES];
+};
+
+struct usbcan_state {
+    pthread_rwlock_t lock;
+    uint32_t type;
+    uint32_t num_devs;
+    struct usbcan_dev *devs;
+};
+
+extern struct usbcan_state state;
+
+struct usbcan_bus *usbcan_get_bus(uint32_t dev, uint32_t bus);
+bool usbcan_dev_init(uint32_t dev, bool receive_cb);
+
+// VCI_INIT_CONFIG_EX.CAN_Mode values
+#define USBCAN_MODE_NORMAL 0
+#define USBCAN_MODE_SILENT 2
+
+bool usbcan_init_can(uint32_t dev, uint32_t bus, uint32_t speed, uint8_t mode);
+void usbcan_deliver(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+                    struct usbcan_msg *msgs, uint32_t n);
+bool usbcan_on_dispatcher(uint32_t dev);
+void usbcan_set_dispatcher(uint32_t dev);
+void usbcan_clear_dispatcher();
+uint64_t usbcan_now_us();
+void usbcan_sleep_until(uint64_t deadline_us);
+void usbcan_cond_init(pthread_cond_t *cond);
+bool usbcan_cond_wait_until(pthread_cond_t *cond, pthread_mutex_t *lock,
+                            uint64_t deadline_us);
+
+// Counters have a single writer, the bus's dispatcher, and are read
+// without locking by usbcan_get_stats.
+static inline void usbcan_count(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+struct usbcan_changes *usbcan_changes_alloc(struct usbcan_bus_config *config);
+uint32_t usbcan_changes_filter(struct usbcan_changes *changes,
+                               struct usbcan_msg *msgs, uint32_t n,
+                               uint64_t now_us);
+
+struct usbcan_latest *usbcan_latest_alloc();
+void usbcan_latest_update(struct usbcan_latest *latest,
+                          struct usbcan_msg *msgs, uint32_t n);
+
+void usbcan_isotp_receive(struct usbcan_isotp *sessions,
+                          struct usbcan_msg *msgs, uint32_t n);
+
+void usbcan_filters_forget(uint32_t dev, uint32_t bus);
+
+void usbcan_errors_init(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+                        struct usbcan_bus_config *config);
+void usbcan_errors_received(struct usbcan_bus *b, uint32_t avail,
+                            uint64_t now_us);
+bool usbcan_errors_sample(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+                          struct usbcan_msg *msg, uint64_t now_us);
+
+bool usbcan_coalesce_init(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+                          struct usbcan_bus_config *config, bool enabled);
+void usbcan_coalesce(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+                     struct usbcan_msg *msgs, uint32_t n, uint64_t now_us);
+void usbcan_coalesce_flush(uint32_t dev, uint32_t bus, struct usbcan_bus *b);
+void usbcan_coalesce_stop();
+
+struct usbcan_pool *usbcan_pool_alloc(uint32_t batches, uint32_t cap);
+void usbcan_pool_detach(struct usbcan_pool *p);
+struct usbcan_batch *usbcan_pool_get(struct usbcan_pool *p);
+void usbcan_pool_deliver(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+                         struct usbcan_msg *msgs, uint32_t n);
+
+struct usbcan_soa_buf *usbcan_soa_alloc();
+void usbcan_soa_free(struct usbcan_soa_buf *s);
+bool usbcan_soa_reserve(struct usbcan_soa_buf *s, uint32_t n);
+const struct usbcan_soa *usbcan_soa_fill(struct usbcan_soa_buf *s,
+                                         struct usbcan_msg *msgs, uint32_t n);
+void usbcan_soa_deliver(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+                        struct usbcan_msg *msgs, uint32_t n);
+
+bool usbcan_overload_init(uint32_t dev, uint32_t bus, struct usbcan_bus *b,
+                          struct usbcan_bus_config *config, bool enabled);
+void usbcan_overload_push(struct usbcan_bus *b, struct usbcan_msg *msgs,
+                          uint32_t n);
+void usbcan_overload_set_cb(struct usbcan_bus *b);
+void usbcan_overload_idle(struct usbcan_bus *b);
+void usbcan_overload_free(struct usbcan_overload *o);
+
+/*
+  Static probes, provider usbcan, each with the arguments (dev, bus, n)
+  as 32-bit values, for bpftrace, perf and SystemTap:
+
+    dispatch_entry/return     usbcan_callback_dispatcher; n frames read
+    receive_num_entry/return  VCI_GetReceiveNum; n frames waiting
+    receive_entry/return      VCI_Receive; n frames asked for, then read
+    convert_return            conversion of the n frames read
+    deliver_entry/return      filtering and delivery of n frames
+    send_entry/return         usbcan_send_n; n frames given, then sent
+    transmit_entry/return     VCI_Transmit; n frames, then sent
+
+  A probe is a single nop until a tracer attaches. They come from
+  <sys/sdt.h> where it is installed, or else on x86-64 ELF systems are
+  written out in its note format here.
+*/
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define USBCAN_SDT_H
+#endif
+#endif
+
+#if defined(USBCAN_SDT_H)
+#include <sys/sdt.h>
+#define USBCAN_PROBE(name, dev, bus, n)                                       \
+    DTRACE_PROBE3(usbcan, name, (uint32_t)(dev), (uint32_t)(bus),             \
+                  (uint32_t)(n))
+#elif defined(__ELF__) && defined(__x86_64__)
+#define USBCAN_PROBE(name, dev, bus, n)                                       \
+    __asm__ __volatile__(                                                     \
+        "990: nop\n"                                                          \
+        ".pushsection .note.stapsdt,\"?\",\"note\"\n"                         \
+        ".balign 4\n"                                                         \
+        ".4byte 992f-991f, 994f-993f, 3\n"                                    \
+        "991: .asciz \"stapsdt\"\n"                                           \
+        "992: .balign 4\n"                                                    \
+        "993: .8byte 990b\n"                                                  \
+        ".8byte _.stapsdt.base\n"                                             \
+        ".8byte 0\n"                                                          \
+        ".asciz \"usbcan\"\n"                                                 \
+        ".asciz \"" #name "\"\n"                                              \
+        ".asciz \"4@%0 4@%1 4@%2\"\n"                                         \
+        "994: .balign 4\n"                                                    \
+        ".popsection\n"                                                       \
+        ".ifndef _.stapsdt.base\n"                                            \
+        ".pushsection .stapsdt.base,\"aG\",\"progbits\","                     \
+        ".stapsdt.base,comdat\n"                                              \
+        ".weak _.stapsdt.base\n"                                              \
+        ".hidden _.stapsdt.base\n"                                            \
+        "_.stapsdt.base: .space 1\n"                                          \
+        ".size _.stapsdt.base, 1\n"                                           \
+        ".popsection\n"                                                       \
+        ".endif\n"                                                            \
+        :                                                                     \
+        : "nor"((uint32_t)(dev)), "nor"((uint32_t)(bus)),                     \
+          "nor"((uint32_t)(n)))
+#else
+#define USBCAN_PROBE(name, dev, bus, n)
+#endif
+
+// Stages recorded by usbcan_trace_start. See trace.c.
+enum usbcan_stage {
+    USBCAN_STAGE_DISPATCH,
+    USBCAN_STAGE_RECEIVE_NUM,
+    USBCAN_STAGE_RECEIVE,
+    USBCAN_STAGE_CONVERT,
+    USBCAN_STAGE_DELIVER,
+    USBCAN_STAGE_SEND,
+    USBCAN_STAGE_TRANSMIT,
+};
+
+extern bool usbcan_tracing;
+
+uint64_t usbcan_trace_now_ns();
+void usbcan_trace_record(enum usbcan_stage stage, uint64_t start_ns,
+                         uint32_t dev, uint32_t bus, uint32_t n);
+
+// The start of a stage for usbcan_trace, or 0 when not recording.
+static inline uint64_t usbcan_trace_clock() {
+    return __atomic_load_n(&usbcan_tracing, __ATOMIC_RELAXED)
+        ? usbcan_trace_now_ns()
+        : 0;
+}
+
+static inline void usbcan_trace(enum usbcan_stage stage, uint64_t start_ns,
+                                uint32_t dev, uint32_t bus, uint32_t n) {
+    if (start_ns != 0) {
+        usbcan_trace_record(stage, start_ns, dev, bus, n);
+    }
+}
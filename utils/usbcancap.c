@@ -0,0 +1,286 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "getopt.h"
+#include "usbcan.h"
+#include "usbcan_capture.h"
+
+static volatile sig_atomic_t stopping = 0;
+
+static const uint32_t CAP_SPEEDS[][2] = {
+    // kbit/s, speed
+    {1000, CAN_SPEED_1000KBPS}, {500, CAN_SPEED_500KBPS},
+    {250, CAN_SPEED_250KBPS},   {125, CAN_SPEED_125KBPS},
+    {100, CAN_SPEED_100KBPS},   {83, CAN_SPEED_83KBPS},
+    {50, CAN_SPEED_50KBPS},     {20, CAN_SPEED_20KBPS},
+    {10, CAN_SPEED_10KBPS},
+};
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void usbcancap_exit_handler(int signal) {
+#pragma unused(signal)
+
+    stopping = 1;
+}
+
+void usbcancap_callback(uint32_t dev, uint32_t bus, struct usbcan_msg *msgs,
+                        uint32_t n, void *arg) {
+    usbcan_capture_write((struct usbcan_capture *)arg, dev, bus, msgs, n);
+}
+
+// Prints what a closed capture holds against its size on disk.
+static void report_capture(const char *path) {
+    struct stat st;
+    struct usbcan_capture_reader *r = usbcan_capture_map(path);
+    if (r == NULL || stat(path, &st) != 0) {
+        if (r != NULL) {
+            usbcan_capture_unmap(r);
+        }
+        return;
+    }
+
+    struct usbcan_capture_info info;
+    usbcan_capture_info(r, &info);
+    fprintf(stderr, "Captured %llu frames in %llu blocks, %llu bytes, "
+            "%.2f bytes/frame\n",
+            (unsigned long long)info.frames, (unsigned long long)info.blocks,
+            (unsigned long long)st.st_size,
+            info.frames > 0 ? (double)st.st_size / info.frames : 0);
+    usbcan_capture_unmap(r);
+}
+
+void usage() {
+    fprintf(stderr,
+            "usage: usbcancap --write FILE [--dev N] [--bus N] [--speed KBPS]\n"
+            "                 [--compact]\n"
+            "       usbcancap --read FILE [--id ID] [--mask MASK] [--from S]\n"
+            "                 [--to S] [--count] [--linear]\n"
+            "Times are seconds from the start of the capture. --linear\n"
+            "decodes every block instead of using the index.\n");
+    exit(-1);
+}
+
+static int record(const char *path, uint32_t dev, uint32_t bus,
+                  uint32_t kbps, uint32_t flags) {
+    uint32_t speed = UINT32_MAX;
+    for (uint32_t i = 0; i < sizeof(CAP_SPEEDS) / sizeof(CAP_SPEEDS[0]); i++) {
+        if (CAP_SPEEDS[i][0] == kbps) {
+            speed = CAP_SPEEDS[i][1];
+        }
+    }
+    if (speed == UINT32_MAX) {
+        usage();
+    }
+
+    struct usbcan_capture *cap = usbcan_capture_open(path, 0, flags);
+    if (cap == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    if (!usbcan_library_init()) {
+        exit(-1);
+    }
+
+    struct usbcan_bus_config config;
+    memset(&config, 0, sizeof(config));
+    config.speed = speed;
+    config.cb = usbcancap_callback;
+    config.arg = cap;
+
+    if (!usbcan_init(dev, bus, &config) || !usbcan_start(dev, bus)) {
+        exit(-1);
+    }
+
+    while (!stopping) {
+        pause();
+    }
+
+    usbcan_stop(dev, bus);
+    usbcan_library_close();
+
+    if (!usbcan_capture_close(cap)) {
+        return -1;
+    }
+    report_capture(path);
+
+    return 0;
+}
+
+static void print_rec(const struct usbcan_capture_rec *rec, uint64_t start_us) {
+    const struct can_frame *frame = &rec->frame;
+    printf("(%.6f) usbcan%u:%u  %*X   [%u] ", (rec->time_us - start_us) / 1e6,
+           rec->dev, rec->bus, (frame->can_id & CAN_EFF_FLAG) > 0 ? 8 : 3,
+           frame->can_id & CAN_EFF_MASK, frame->can_dlc);
+    for (int j = 0; j < frame->can_dlc && j < 8; j++) {
+        printf(" %02X", frame->data[j]);
+    }
+    printf("\n");
+}
+
+// Decodes every block and matches each record, as a reader without the
+// index would, to check and time the indexed query against.
+static uint64_t query_linear(const struct usbcan_capture_reader *r,
+                             const struct usbcan_capture_info *info,
+                             const struct usbcan_capture_query *q,
+                             bool count_only) {
+    struct usbcan_capture_rec *recs = (struct usbcan_capture_rec *)calloc(
+        info->block_frames, sizeof(struct usbcan_capture_rec));
+    if (recs == NULL) {
+        return 0;
+    }
+
+    uint64_t to_us = q->to_us > 0 ? q->to_us : UINT64_MAX;
+    uint64_t matched = 0;
+    for (uint64_t b = 0; b < info->blocks; b++) {
+        uint32_t n = usbcan_capture_read_block(r, b, recs);
+        for (uint32_t i = 0; i < n; i++) {
+            const struct usbcan_capture_rec *rec = &recs[i];
+            if (rec->time_us < q->from_us || rec->time_us > to_us ||
+                ((rec->frame.can_id ^ q->can_id) & q->can_mask) != 0) {
+                continue;
+            }
+            matched++;
+            if (!count_only) {
+                print_rec(rec, info->start_us);
+            }
+        }
+    }
+
+    free(recs);
+
+    return matched;
+}
+
+static int query(const char *path, struct usbcan_capture_query *q,
+                 double from, double to, bool count_only, bool linear) {
+    uint64_t start_us = now_us();
+    struct usbcan_capture_reader *r = usbcan_capture_map(path);
+    if (r == NULL) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        return -1;
+    }
+
+    struct usbcan_capture_info info;
+    usbcan_capture_info(r, &info);
+    q->from_us = info.start_us + (uint64_t)(from * 1000000);
+    q->to_us = to > 0 ? info.start_us + (uint64_t)(to * 1000000) : 0;
+
+    if (linear) {
+        uint64_t matched = query_linear(r, &info, q, count_only);
+        fprintf(stderr, "%llu frames matched, all %llu blocks read in "
+                "%.1f ms\n",
+                (unsigned long long)matched, (unsigned long long)info.blocks,
+                (now_us() - start_us) / 1e3);
+        usbcan_capture_unmap(r);
+        return 0;
+    }
+
+    struct usbcan_capture_cursor *c = usbcan_capture_query(r, q);
+    if (c == NULL) {
+        usbcan_capture_unmap(r);
+        return -1;
+    }
+
+    uint64_t matched = 0;
+    const struct usbcan_capture_rec *rec;
+    while ((rec = usbcan_capture_next(c)) != NULL) {
+        matched++;
+        if (!count_only) {
+            print_rec(rec, info.start_us);
+        }
+    }
+
+    fprintf(stderr, "%llu frames matched, %llu of %llu blocks read in "
+            "%.1f ms%s\n",
+            (unsigned long long)matched,
+            (unsigned long long)usbcan_capture_blocks_read(c),
+            (unsigned long long)info.blocks, (now_us() - start_us) / 1e3,
+            info.indexed ? "" : " (index rebuilt)");
+
+    usbcan_capture_cursor_free(c);
+    usbcan_capture_unmap(r);
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *write_path = NULL, *read_path = NULL;
+    uint32_t dev = 0, bus = 0, kbps = 500, flags = 0;
+    double from = 0, to = 0;
+    bool count_only = false, linear = false;
+
+    struct usbcan_capture_query q;
+    memset(&q, 0, sizeof(q));
+
+    setbuf(stdout, NULL);
+
+    struct sigaction int_act;
+    memset(&int_act, 0, sizeof(int_act));
+    int_act.sa_handler = usbcancap_exit_handler;
+    sigaction(SIGINT, &int_act, NULL);
+    sigaction(SIGTERM, &int_act, NULL);
+
+    const char *ch;
+    while ((ch = GETOPT(argc, argv)) != NULL) {
+        GETOPT_SWITCH(ch) {
+          GETOPT_OPTARG("--write") : write_path = optarg;
+            break;
+          GETOPT_OPTARG("--read") : read_path = optarg;
+            break;
+          GETOPT_OPTARG("--dev") : dev = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--bus") : bus = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--speed") : kbps = atoi(optarg);
+            break;
+          GETOPT_OPT("--compact") : flags |= USBCAN_CAPTURE_COMPACT;
+            break;
+          GETOPT_OPTARG("--id") :
+            q.can_id = strtoul(optarg, NULL, 0);
+            if (q.can_id > CAN_SFF_MASK) {
+                q.can_id |= CAN_EFF_FLAG;
+            }
+            if (q.can_mask == 0) {
+                q.can_mask = CAN_EFF_FLAG | CAN_EFF_MASK;
+            }
+            break;
+          GETOPT_OPTARG("--mask") : q.can_mask = strtoul(optarg, NULL, 0);
+            break;
+          GETOPT_OPTARG("--from") : from = atof(optarg);
+            break;
+          GETOPT_OPTARG("--to") : to = atof(optarg);
+            break;
+          GETOPT_OPT("--count") : count_only = true;
+            break;
+          GETOPT_OPT("--linear") : linear = true;
+            break;
+          GETOPT_DEFAULT:
+            usage();
+        }
+    }
+
+    if (write_path != NULL) {
+        return record(write_path, dev, bus, kbps, flags);
+    }
+    if (read_path != NULL) {
+        return query(read_path, &q, from, to, count_only, linear);
+    }
+
+    usage();
+
+    return 0;
+}
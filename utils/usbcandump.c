@@ -3,41 +3,91 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <signal.h>
 
 #include "getopt.h"
 #include "usbcan.h"
+#include "usbcan_merge.h"
 
 uint32_t count = 0;
+struct usbcan_merge *merge = NULL;
 
 void usbcandump_exit_handler(int signal) {
 #pragma unused(signal)
 
     usbcan_library_close();
+    usbcan_merge_close(merge);
 
     exit(0);
 }
 
+static void usbcandump_print(uint32_t dev, uint32_t bus,
+                             struct usbcan_msg *msg) {
+    count++;
+    printf(" usbcan%i:%i  %3X   [%i] ", dev, bus, msg->frame.can_id,
+           msg->frame.can_dlc);
+    for (int j = 0; j < 8; j++) {
+        printf(" %02X", msg->frame.data[j]);
+    }
+    printf(" %i\n", count);
+}
+
 void usbcandump_callback(uint32_t dev, uint32_t bus, struct usbcan_msg *msgs,
                          uint32_t n, void *arg) {
 #pragma unused(arg)
     for (uint32_t i = 0; i < n; i++) {
-        count++;
-        printf(" usbcan%i:%i  %3X   [%i] ", dev, bus, msgs[i].frame.can_id,
-               msgs[i].frame.can_dlc);
-        for (int j = 0; j < 8; j++) {
-            printf(" %02X", msgs[i].frame.data[j]);
-        }
-        printf(" %i\n", count);
+        usbcandump_print(dev, bus, &msgs[i]);
+    }
+}
+
+void usbcandump_merge_callback(struct usbcan_bus_msg *msgs, uint32_t n,
+                               void *arg) {
+#pragma unused(arg)
+    for (uint32_t i = 0; i < n; i++) {
+        usbcandump_print(msgs[i].dev, msgs[i].bus, &msgs[i].msg);
     }
 }
 
 void usage() {
+    fprintf(stderr,
+            "usage: usbcandump [--dev N] [--bus N]\n"
+            "       usbcandump --all [--window US] [--tick US]\n"
+            "--all dumps every bus of every adapter as one stream in time\n"
+            "order, holding frames back --window microseconds to sort them.\n"
+            "--tick is the adapter timestamp period, to date frames by it.\n");
     exit(-1);
 }
 
+// Starts every bus of every adapter into one merged stream.
+static void usbcandump_all(struct usbcan_merge_config *merge_config) {
+    merge_config->cb = usbcandump_merge_callback;
+    merge = usbcan_merge_open(merge_config);
+    if (merge == NULL) {
+        exit(-1);
+    }
+
+    struct usbcan_bus_config config;
+    memset(&config, 0, sizeof(config));
+    config.speed = CAN_SPEED_500KBPS;
+    config.cb = usbcan_merge_callback;
+    config.arg = merge;
+
+    for (uint32_t dev = 0; dev < usbcan_num_devs(); dev++) {
+        for (uint32_t bus = 0; bus < MAX_BUSES; bus++) {
+            if (!usbcan_init(dev, bus, &config) || !usbcan_start(dev, bus)) {
+                exit(-1);
+            }
+        }
+    }
+}
+
 int main(int argc, char **argv) {
     uint32_t dev = 0, bus = 0;
+    bool all = false;
+
+    struct usbcan_merge_config merge_config;
+    memset(&merge_config, 0, sizeof(merge_config));
 
     struct sigaction int_act;
     int_act.sa_handler = usbcandump_exit_handler;
@@ -52,6 +102,12 @@ int main(int argc, char **argv) {
             break;
           GETOPT_OPTARG("--bus") : bus = atoi(optarg);
             break;
+          GETOPT_OPT("--all") : all = true;
+            break;
+          GETOPT_OPTARG("--window") : merge_config.window_us = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--tick") : merge_config.tick_us = atoi(optarg);
+            break;
           GETOPT_DEFAULT:
             usage();
         }
@@ -61,7 +117,15 @@ int main(int argc, char **argv) {
         exit(-1);
     }
 
+    if (all) {
+        usbcandump_all(&merge_config);
+        for (;;) {
+            pause();
+        }
+    }
+
     struct usbcan_bus_config config;
+    memset(&config, 0, sizeof(config));
     config.speed = CAN_SPEED_500KBPS;
     config.filters = NULL;
     config.num_filters = 0;
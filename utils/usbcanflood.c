@@ -3,57 +3,806 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/time.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "getopt.h"
 #include "usbcan.h"
+#include "usbcan_merge.h"
+#include "usbcan_capture.h"
 
-int32_t s_count = 0, r_count = 0, errors = 0, batches = 0, r_batches = 0;
+/*
+  Sends paced traffic on one bus and measures it as received on another.
 
-void usbcandump_exit_handler(int signal) {
-#pragma unused(signal)
+  Every tracked frame carries a 24-bit sequence number in bytes 0-2 and,
+  when it has at least 6 bytes, the low 24 bits of its send time in
+  microseconds in bytes 3-5; remaining bytes follow --payload. Both
+  buses are driven by this process, so send and receive times come from
+  the same clock and their difference is the one-way latency.
 
-    usbcan_library_close();
+  The receiving bus is read in its callback, or with --rx by a thread of
+  this process that busy-polls it or waits on its event descriptor, so
+  the latency of each delivery path can be compared under the same load.
+  --rx copy and --rx retain hand each batch from the callback to such a
+  thread instead, as a copy or as a batch retained from the bus's pool.
+  --rx soa takes batches one column per field and rebuilds the frames to
+  track them. --scan times a pass over every batch's IDs and payloads,
+  as frames with --rx callback and as columns with --rx soa, to compare
+  the two layouts.
+  --slow-us makes the callback a slow consumer, which with --overload
+  shows what each overload policy does with the frames it cannot take.
+
+  --reverse-rate sends a second stream the other way, to a callback on
+  the sending bus that costs --reverse-slow-us per frame. When both buses
+  are on one adapter they share its driver thread, so this shows how far
+  a slow neighbour delays the measured bus, and --worker how well a
+  callback thread per bus isolates them. --workers shards the receiving
+  bus's callbacks across several threads by CAN ID, so a slow consumer
+  keeps up with that many times the load; frames of different IDs then
+  arrive reordered.
+
+  --filter-churn keeps changing the receiving bus's hardware filters
+  between two sets that differ in one filter and both pass the flood, so
+  the cost of a change and any frame lost to it show.
+
+  --capture also records the receiving bus to a capture file, raw or
+  with --compact delta-encoded, to give usbcancap --read a file of known
+  content to query and compare the two encodings' size.
+
+  --merge feeds the receiving bus, and the sending bus's reverse stream,
+  through a merged stream, so its latency includes the merge window.
+*/
+
+#define FLOOD_SEQ_MASK 0xFFFFFF
+#define FLOOD_WINDOW 65536
+#define FLOOD_LATENCY_BUCKETS 100000 // 1 us each
+#define FLOOD_DRAIN_US 500000
+
+#define FLOOD_PAYLOAD_RANDOM 0
+#define FLOOD_PAYLOAD_ZERO 1
+#define FLOOD_PAYLOAD_ONES 2
+
+#define FLOOD_RX_CALLBACK 0
+#define FLOOD_RX_POLL 1
+#define FLOOD_RX_QUEUE 2
+#define FLOOD_RX_COPY 3
+#define FLOOD_RX_RETAIN 4
+#define FLOOD_RX_SOA 5
+#define FLOOD_RX_BATCH 256
+#define FLOOD_HANDOFF_LEN 1024
+
+static const char *FLOOD_RX_MODES[] = {"callback", "poll", "queue", "copy",
+                                       "retain",   "soa"};
+
+// Indexed by USBCAN_OVERLOAD_*.
+static const char *FLOOD_OVERLOADS[] = {"none", "block", "drop-oldest",
+                                        "drop-newest", "keep-latest"};
+
+static const uint32_t FLOOD_SPEEDS[][2] = {
+    // kbit/s, speed
+    {1000, CAN_SPEED_1000KBPS}, {500, CAN_SPEED_500KBPS},
+    {250, CAN_SPEED_250KBPS},   {125, CAN_SPEED_125KBPS},
+    {100, CAN_SPEED_100KBPS},   {83, CAN_SPEED_83KBPS},
+    {50, CAN_SPEED_50KBPS},     {20, CAN_SPEED_20KBPS},
+    {10, CAN_SPEED_10KBPS},
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+// Microseconds the callback spends per frame it is given.
+static uint32_t slow_us = 0;
+
+// Where the callback records what it receives, if anywhere.
+static struct usbcan_capture *capture = NULL;
+
+// The --scan pass: frames with IDs below 0x400 and the XOR of all
+// payloads, kept so the compiler cannot drop the loops, and its cost.
+static struct {
+    bool enabled;
+    uint64_t batches;
+    uint64_t frames;
+    uint64_t ns;
+    uint64_t low_ids;
+    uint64_t xor;
+} scan;
+
+// Batches on their way from the callback to the receiver thread, which
+// frees copies and releases retained batches once it has read them.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct {
+        struct usbcan_batch *batch;
+        struct usbcan_msg *msgs;
+        uint32_t n;
+        uint64_t at_us;
+    } items[FLOOD_HANDOFF_LEN];
+    uint32_t head;
+    uint32_t tail;
+    bool retain;
+    uint64_t copied;
+    uint64_t copied_bytes;
+    uint64_t retained;
+    uint64_t dropped;
+} handoff;
+
+// The reverse stream and its receiving callback on the sending bus.
+static struct {
+    pthread_t thread;
+    uint32_t dev;
+    uint32_t bus;
+    uint32_t rate;
+    uint32_t slow_us;
+    uint64_t end_us;
+    uint64_t sent;
+    uint64_t received;
+} reverse;
+
+// Alternates the receiving bus's filters at rate changes per second.
+static struct {
+    pthread_t thread;
+    uint32_t dev;
+    uint32_t bus;
+    uint32_t rate;
+    bool ext;
+    uint64_t end_us;
+    uint64_t changes;
+    uint64_t failed;
+    uint64_t first_us;
+    uint64_t total_us;
+    uint64_t max_us;
+} churn;
+
+// The merged stream, and the bus whose frames in it are tracked.
+static struct {
+    struct usbcan_merge *merge;
+    uint32_t dev;
+    uint32_t bus;
+} merged;
+
+// Receive side, touched only by the destination bus's callbacks, under
+// rx_lock when they run on several workers, until the sender has stopped
+// and drained.
+static pthread_mutex_t rx_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    uint64_t received;
+    uint64_t unique;
+    uint64_t duplicates;
+    uint64_t reordered;
+    uint64_t foreign;
+    uint64_t max_seq;
+    bool any;
+    uint8_t seen[FLOOD_WINDOW / 8];
+    uint32_t latency[FLOOD_LATENCY_BUCKETS];
+    uint64_t latency_over;
+    uint64_t latency_n;
+    uint64_t latency_max;
+} rx;
+
+// The thread reading the receiving bus outside the callback.
+static struct {
+    pthread_t thread;
+    uint32_t dev;
+    uint32_t bus;
+    volatile bool running;
+    uint64_t wakeups;
+} receiver;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(uint64_t deadline_us) {
+#ifdef __linux__
+    struct timespec ts;
+    ts.tv_sec = deadline_us / 1000000;
+    ts.tv_nsec = (deadline_us % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR && !stopping) {
+    }
+#else
+    uint64_t now = now_us();
+    if (now < deadline_us) {
+        struct timespec ts;
+        ts.tv_sec = (deadline_us - now) / 1000000;
+        ts.tv_nsec = ((deadline_us - now) % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+#endif
+}
+
+static uint32_t xorshift(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return x;
+}
+
+// Bits on the wire for a frame, with worst-case stuffing and the
+// interframe space.
+static uint32_t frame_bits(bool ext, uint8_t dlc) {
+    uint32_t bits = (ext ? 64 : 44) + 8 * dlc;
+    uint32_t stuffed = (ext ? 54 : 34) + 8 * dlc;
+
+    return bits + (stuffed - 1) / 4 + 3;
+}
+
+static bool seen_test_and_set(uint64_t seq) {
+    uint8_t bit = 1 << (seq & 7);
+    uint8_t *byte = &rx.seen[(seq % FLOOD_WINDOW) / 8];
+    bool seen = (*byte & bit) > 0;
+    *byte |= bit;
+
+    return seen;
+}
+
+static void seen_clear(uint64_t seq) {
+    rx.seen[(seq % FLOOD_WINDOW) / 8] &= ~(1 << (seq & 7));
+}
+
+static void track(struct usbcan_msg *msg, uint64_t now) {
+    uint8_t *data = msg->frame.data;
+    uint32_t seq24 = data[0] | (data[1] << 8) | (data[2] << 16);
+
+    // Unwrap against the highest sequence number seen so far.
+    uint64_t seq = seq24;
+    if (rx.any) {
+        uint32_t delta = (seq24 - (uint32_t)rx.max_seq) & FLOOD_SEQ_MASK;
+        seq = delta < (FLOOD_SEQ_MASK + 1) / 2
+            ? rx.max_seq + delta
+            : rx.max_seq - ((FLOOD_SEQ_MASK + 1) - delta);
+    }
+
+    if (!rx.any || seq > rx.max_seq) {
+        uint64_t from = rx.any ? rx.max_seq + 1 : seq;
+        if (seq - from >= FLOOD_WINDOW) {
+            memset(rx.seen, 0, sizeof(rx.seen));
+        } else {
+            for (uint64_t s = from; s <= seq; s++) {
+                seen_clear(s);
+            }
+        }
+        rx.max_seq = seq;
+        rx.any = true;
+    } else if (rx.max_seq - seq >= FLOOD_WINDOW) {
+        // Too old to tell a late frame from a duplicate.
+        rx.reordered++;
+        return;
+    } else if (!seen_test_and_set(seq)) {
+        rx.reordered++;
+    } else {
+        rx.duplicates++;
+        return;
+    }
+
+    seen_test_and_set(seq);
+    rx.unique++;
+
+    if (msg->frame.can_dlc >= 6) {
+        uint32_t sent = data[3] | (data[4] << 8) | (data[5] << 16);
+        uint64_t latency = ((uint32_t)now - sent) & FLOOD_SEQ_MASK;
+
+        rx.latency_n++;
+        if (latency > rx.latency_max) {
+            rx.latency_max = latency;
+        }
+        if (latency < FLOOD_LATENCY_BUCKETS) {
+            rx.latency[latency]++;
+        } else {
+            rx.latency_over++;
+        }
+    }
+}
+
+static void receive(struct usbcan_msg *msg, uint64_t now) {
+    __atomic_add_fetch(&rx.received, 1, __ATOMIC_RELAXED);
+    if ((msg->frame.can_id & CAN_ERR_FLAG) > 0 || msg->frame.can_dlc < 3) {
+        rx.foreign++;
+        return;
+    }
+    track(msg, now);
+}
+
+static void scan_msgs(const struct usbcan_msg *msgs, uint32_t n) {
+    uint64_t start = now_ns();
+    uint64_t low = 0, x = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        low += (msgs[i].frame.can_id & CAN_EFF_MASK) < 0x400;
+        uint64_t word;
+        memcpy(&word, msgs[i].frame.data, sizeof(word));
+        x ^= word;
+    }
+
+    scan.ns += now_ns() - start;
+    scan.batches++;
+    scan.frames += n;
+    scan.low_ids += low;
+    scan.xor ^= x;
+}
+
+static void scan_soa(const struct usbcan_soa *batch) {
+    uint64_t start = now_ns();
+    uint64_t low = 0, x = 0;
+
+    for (uint32_t i = 0; i < batch->n; i++) {
+        low += batch->ids[i] < 0x400;
+    }
+    for (uint32_t i = 0; i < batch->n; i++) {
+        x ^= batch->data[i];
+    }
 
-    exit(0);
+    scan.ns += now_ns() - start;
+    scan.batches++;
+    scan.frames += batch->n;
+    scan.low_ids += low;
+    scan.xor ^= x;
 }
 
-void usbcandump_callback(uint32_t dev, uint32_t bus, struct usbcan_msg *msgs,
-                         uint32_t n, void *arg) {
+void usbcanflood_callback(uint32_t dev, uint32_t bus, struct usbcan_msg *msgs,
+                          uint32_t n, void *arg) {
+#pragma unused(dev)
+#pragma unused(bus)
+#pragma unused(arg)
+
+    uint64_t now = now_us();
+
+    if (capture != NULL) {
+        usbcan_capture_write(capture, dev, bus, msgs, n);
+    }
+
+    pthread_mutex_lock(&rx_lock);
+    if (scan.enabled) {
+        scan_msgs(msgs, n);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        receive(&msgs[i], now);
+    }
+    pthread_mutex_unlock(&rx_lock);
+
+    if (slow_us > 0) {
+        usleep(n * slow_us);
+    }
+}
+
+// Rebuilds each frame from the columns to track it as the other modes do.
+void usbcanflood_soa_callback(uint32_t dev, uint32_t bus,
+                              const struct usbcan_soa *batch, void *arg) {
+#pragma unused(dev)
+#pragma unused(bus)
+#pragma unused(arg)
+
+    uint64_t now = now_us();
+
+    pthread_mutex_lock(&rx_lock);
+    if (scan.enabled) {
+        scan_soa(batch);
+    }
+    for (uint32_t i = 0; i < batch->n; i++) {
+        struct usbcan_msg msg;
+        msg.timestamp = (uint32_t)batch->timestamps[i];
+        msg.frame.can_id = batch->ids[i];
+        msg.frame.can_id |=
+            (batch->flags[i] & USBCAN_SOA_EFF) > 0 ? CAN_EFF_FLAG : 0;
+        msg.frame.can_id |=
+            (batch->flags[i] & USBCAN_SOA_RTR) > 0 ? CAN_RTR_FLAG : 0;
+        msg.frame.can_id |=
+            (batch->flags[i] & USBCAN_SOA_ERR) > 0 ? CAN_ERR_FLAG : 0;
+        msg.frame.can_dlc = batch->dlc[i];
+        memcpy(msg.frame.data, &batch->data[i], sizeof(msg.frame.data));
+        receive(&msg, now);
+    }
+    pthread_mutex_unlock(&rx_lock);
+
+    if (slow_us > 0) {
+        usleep(batch->n * slow_us);
+    }
+}
+
+// Both sets pass every frame of the flood's kind through filter 0; the
+// last filter is an exact ID that differs between them.
+static void *usbcanflood_churn(void *arg) {
+#pragma unused(arg)
+
+    struct can_filter filters[4];
+    canid_t all = churn.ext ? CAN_EFF_FLAG : 0;
+    filters[0].can_id = all;
+    filters[0].can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG;
+    for (uint32_t i = 1; i < 4; i++) {
+        filters[i].can_id = all | i;
+        filters[i].can_mask = CAN_EFF_FLAG | CAN_EFF_MASK;
+    }
+
+    uint64_t start_us = now_us();
+    for (uint64_t k = 0; !stopping; k++) {
+        uint64_t due_us = start_us + k * 1000000 / churn.rate;
+        if (due_us >= churn.end_us) {
+            break;
+        }
+        sleep_until(due_us);
+
+        filters[3].can_id = all | (k % 2 == 0 ? 3 : 4);
+        uint64_t t = now_us();
+        if (!usbcan_set_filters(churn.dev, churn.bus, filters, 4)) {
+            churn.failed++;
+            continue;
+        }
+        t = now_us() - t;
+
+        if (churn.changes == 0) {
+            churn.first_us = t;
+        } else {
+            churn.total_us += t;
+            churn.max_us = t > churn.max_us ? t : churn.max_us;
+        }
+        churn.changes++;
+    }
+
+    return NULL;
+}
+
+// Called by the merge thread with the frames of both buses in time order.
+void usbcanflood_merged_callback(struct usbcan_bus_msg *msgs, uint32_t n,
+                                 void *arg) {
+#pragma unused(arg)
+
+    uint64_t now = now_us();
+    uint32_t tracked = 0;
+
+    pthread_mutex_lock(&rx_lock);
+    for (uint32_t i = 0; i < n; i++) {
+        if (msgs[i].dev == merged.dev && msgs[i].bus == merged.bus) {
+            receive(&msgs[i].msg, now);
+            tracked++;
+        }
+    }
+    pthread_mutex_unlock(&rx_lock);
+    __atomic_add_fetch(&reverse.received, n - tracked, __ATOMIC_RELAXED);
+
+    uint64_t slow = (uint64_t)tracked * slow_us +
+        (uint64_t)(n - tracked) * reverse.slow_us;
+    if (slow > 0) {
+        usleep(slow);
+    }
+}
+
+// Spins on usbcan_poll, as a control loop pinned to a core would.
+static void *usbcanflood_poll(void *arg) {
+#pragma unused(arg)
+
+    struct usbcan_bus_msg msgs[FLOOD_RX_BATCH];
+
+    while (receiver.running) {
+        uint32_t n = usbcan_poll(1U << receiver.dev, msgs, FLOOD_RX_BATCH);
+        uint64_t now = now_us();
+
+        for (uint32_t i = 0; i < n; i++) {
+            receive(&msgs[i].msg, now);
+        }
+    }
+
+    return NULL;
+}
+
+// Sleeps on the bus's event descriptor and drains the queue when woken.
+static void *usbcanflood_drain(void *arg) {
+#pragma unused(arg)
+
+    struct usbcan_msg msgs[FLOOD_RX_BATCH];
+    struct pollfd pfd;
+    pfd.fd = usbcan_event_fd(receiver.dev, receiver.bus);
+    pfd.events = POLLIN;
+
+    while (receiver.running) {
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        receiver.wakeups++;
+
+        uint32_t n;
+        do {
+            n = usbcan_drain(receiver.dev, receiver.bus, msgs,
+                             FLOOD_RX_BATCH);
+            uint64_t now = now_us();
+
+            for (uint32_t i = 0; i < n; i++) {
+                receive(&msgs[i], now);
+            }
+        } while (n == FLOOD_RX_BATCH);
+    }
+
+    return NULL;
+}
+
+// Paces the reverse stream in 1 ms ticks until the main stream ends.
+static void *usbcanflood_reverse(void *arg) {
+#pragma unused(arg)
+
+    struct can_frame frames[FLOOD_RX_BATCH];
+    memset(frames, 0, sizeof(frames));
+    for (uint32_t i = 0; i < FLOOD_RX_BATCH; i++) {
+        frames[i].can_id = 0x7FF;
+        frames[i].can_dlc = 8;
+    }
+
+    uint64_t start_us = now_us();
+    for (uint64_t tick = 1; !stopping; tick++) {
+        uint64_t due_us = start_us + tick * 1000;
+        if (due_us >= reverse.end_us) {
+            break;
+        }
+        sleep_until(due_us);
+
+        uint64_t target = tick * reverse.rate / 1000;
+        while (reverse.sent < target) {
+            uint32_t n = target - reverse.sent < FLOOD_RX_BATCH
+                ? (uint32_t)(target - reverse.sent)
+                : FLOOD_RX_BATCH;
+            uint32_t sent = usbcan_send_n(reverse.dev, reverse.bus, frames, n);
+            reverse.sent += n;
+            if (sent < n) {
+                break;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void usbcanflood_reverse_callback(uint32_t dev, uint32_t bus,
+                                  struct usbcan_msg *msgs, uint32_t n,
+                                  void *arg) {
 #pragma unused(dev)
 #pragma unused(bus)
 #pragma unused(msgs)
 #pragma unused(arg)
 
-    r_batches++;
-    r_count += n;
+    __atomic_add_fetch(&reverse.received, n, __ATOMIC_RELAXED);
+    if (reverse.slow_us > 0) {
+        usleep(n * reverse.slow_us);
+    }
+}
+
+// Queues the batch for the receiver thread, retaining it when the bus
+// allows and copying it otherwise, and waits while the queue is full.
+void usbcanflood_handoff_callback(uint32_t dev, uint32_t bus,
+                                  struct usbcan_msg *msgs, uint32_t n,
+                                  void *arg) {
+#pragma unused(arg)
+
+    uint64_t now = now_us();
+    struct usbcan_batch *batch =
+        handoff.retain ? usbcan_retain(dev, bus, msgs) : NULL;
+
+    if (batch == NULL) {
+        struct usbcan_msg *copy =
+            (struct usbcan_msg *)malloc(n * sizeof(struct usbcan_msg));
+        if (copy == NULL) {
+            pthread_mutex_lock(&handoff.lock);
+            handoff.dropped += n;
+            pthread_mutex_unlock(&handoff.lock);
+            return;
+        }
+        memcpy(copy, msgs, n * sizeof(struct usbcan_msg));
+        msgs = copy;
+    }
+
+    pthread_mutex_lock(&handoff.lock);
+    while (handoff.tail - handoff.head == FLOOD_HANDOFF_LEN &&
+           receiver.running) {
+        pthread_cond_wait(&handoff.cond, &handoff.lock);
+    }
+    if (!receiver.running) {
+        handoff.dropped += n;
+        pthread_mutex_unlock(&handoff.lock);
+        if (batch != NULL) {
+            usbcan_release(batch);
+        } else {
+            free(msgs);
+        }
+        return;
+    }
+
+    uint32_t i = handoff.tail++ % FLOOD_HANDOFF_LEN;
+    handoff.items[i].batch = batch;
+    handoff.items[i].msgs = msgs;
+    handoff.items[i].n = n;
+    handoff.items[i].at_us = now;
+    if (batch != NULL) {
+        handoff.retained++;
+    } else {
+        handoff.copied++;
+        handoff.copied_bytes += n * sizeof(struct usbcan_msg);
+    }
+    pthread_cond_broadcast(&handoff.cond);
+    pthread_mutex_unlock(&handoff.lock);
+}
+
+// Reads the batches handed off by the callback, at --slow-us per frame.
+static void *usbcanflood_consume(void *arg) {
+#pragma unused(arg)
+
+    pthread_mutex_lock(&handoff.lock);
+    while (true) {
+        while (handoff.head == handoff.tail && receiver.running) {
+            pthread_cond_wait(&handoff.cond, &handoff.lock);
+        }
+        if (handoff.head == handoff.tail) {
+            break;
+        }
+
+        uint32_t i = handoff.head++ % FLOOD_HANDOFF_LEN;
+        struct usbcan_batch *batch = handoff.items[i].batch;
+        struct usbcan_msg *msgs = handoff.items[i].msgs;
+        uint32_t n = handoff.items[i].n;
+        uint64_t at_us = handoff.items[i].at_us;
+        pthread_cond_broadcast(&handoff.cond);
+        pthread_mutex_unlock(&handoff.lock);
+
+        for (uint32_t f = 0; f < n; f++) {
+            receive(&msgs[f], at_us);
+        }
+        if (slow_us > 0) {
+            usleep(n * slow_us);
+        }
+        if (batch != NULL) {
+            usbcan_release(batch);
+        } else {
+            free(msgs);
+        }
+
+        pthread_mutex_lock(&handoff.lock);
+    }
+    pthread_mutex_unlock(&handoff.lock);
+
+    return NULL;
 }
 
-void usbcandump_null_callback(uint32_t dev, uint32_t bus,
-                              struct usbcan_msg *msgs, uint32_t n, void *arg) {
+void usbcanflood_null_callback(uint32_t dev, uint32_t bus,
+                               struct usbcan_msg *msgs, uint32_t n,
+                               void *arg) {
 #pragma unused(msgs)
 #pragma unused(arg)
 
-    printf("Received unexpected callback with %u messages %u/%u\n", n, dev,
-           bus);
+    fprintf(stderr, "Received unexpected callback with %u messages %u/%u\n", n,
+            dev, bus);
+}
+
+void usbcanflood_exit_handler(int signal) {
+#pragma unused(signal)
+
+    stopping = 1;
+}
+
+static uint64_t percentile(double p) {
+    uint64_t rank = (uint64_t)(p * rx.latency_n);
+    uint64_t count = 0;
+
+    if (rx.latency_n == 0) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < FLOOD_LATENCY_BUCKETS; i++) {
+        count += rx.latency[i];
+        if (count > rank) {
+            return i;
+        }
+    }
+
+    return rx.latency_max;
+}
+
+static bool parse_range(const char *s, uint32_t *lo, uint32_t *hi) {
+    char *end;
+    *lo = strtoul(s, &end, 0);
+    *hi = *lo;
+    if (*end == '-') {
+        *hi = strtoul(end + 1, &end, 0);
+    }
+
+    return *end == '\0' && *lo <= *hi;
+}
+
+// Prints what a closed capture holds against its size on disk.
+static void report_capture(const char *path) {
+    struct stat st;
+    struct usbcan_capture_reader *r = usbcan_capture_map(path);
+    if (r == NULL || stat(path, &st) != 0) {
+        if (r != NULL) {
+            usbcan_capture_unmap(r);
+        }
+        return;
+    }
+
+    struct usbcan_capture_info info;
+    usbcan_capture_info(r, &info);
+    fprintf(stderr, "Captured %llu frames in %llu blocks, %llu bytes, "
+            "%.2f bytes/frame\n",
+            (unsigned long long)info.frames, (unsigned long long)info.blocks,
+            (unsigned long long)st.st_size,
+            info.frames > 0 ? (double)st.st_size / info.frames : 0);
+    usbcan_capture_unmap(r);
 }
 
 void usage() {
-    printf("nope!\n");
+    fprintf(stderr,
+            "usage: usbcanflood [options]\n"
+            "  --dev-src N --bus-src N   sending bus (0/0)\n"
+            "  --dev-dst N --bus-dst N   receiving bus (0/1)\n"
+            "  --speed KBPS              bit rate (500)\n"
+            "  --rate FPS                frames per second\n"
+            "  --load PERCENT            target bus load (50)\n"
+            "  --duration S              seconds to send (10)\n"
+            "  --batch-size N            frames per send call (1)\n"
+            "  --id ID[-ID]              CAN ID or uniform range (0x100-0x7FF)\n"
+            "  --ext                     send extended IDs\n"
+            "  --dlc N[-N]               DLC or uniform range, 3-8 (8)\n"
+            "  --payload MODE            random, zero or ones (random)\n"
+            "  --seed N                  random seed (1)\n"
+            "  --rx MODE                 callback, poll, queue, copy,\n"
+            "                            retain or soa (callback)\n"
+            "  --scan                    time a pass over IDs and payloads\n"
+            "  --pool-batches N          batches of the retain pool\n"
+            "  --slow-us N               callback time per frame (0)\n"
+            "  --overload POLICY         block, drop-oldest, drop-newest or\n"
+            "                            keep-latest (none)\n"
+            "  --overload-len N          frames the policy's ring holds\n"
+            "  --reverse-rate FPS        frames/s sent back to the sender\n"
+            "  --reverse-slow-us N       its callback time per frame (0)\n"
+            "  --worker                  give each bus a callback thread\n"
+            "  --worker-cpus MASK        CPUs the callback threads may use\n"
+            "  --worker-priority N       SCHED_FIFO priority of the threads\n"
+            "  --workers N               receiving callback threads (1)\n"
+            "  --filter-churn HZ         filter changes per second (0)\n"
+            "  --capture FILE            record the receiving bus to FILE\n"
+            "  --compact                 delta-encode the capture\n"
+            "  --merge                   receive through a merged stream\n"
+            "  --window US               its reorder window\n"
+            "  --tick US                 adapter timestamp period\n");
     exit(-1);
 }
 
 int main(int argc, char **argv) {
     uint32_t dev_src = 0, bus_src = 0;
     uint32_t dev_dst = 0, bus_dst = 1;
-    uint32_t delay = 1, batch_size = 200;
+    uint32_t kbps = 500, rate = 0, load = 50, duration = 10, batch_size = 1;
+    uint32_t id_lo = 0x100, id_hi = 0x7FF, dlc_lo = 8, dlc_hi = 8;
+    uint32_t payload = FLOOD_PAYLOAD_RANDOM, seed = 1;
+    uint32_t rx_mode = FLOOD_RX_CALLBACK;
+    uint32_t overload = USBCAN_OVERLOAD_NONE, overload_len = 0, workers = 0;
+    uint32_t pool_batches = 0;
+    struct usbcan_merge_config merge_config;
+    memset(&merge_config, 0, sizeof(merge_config));
+    bool merge = false;
+    const char *capture_path = NULL;
+    uint32_t capture_flags = 0;
+    uint64_t worker_cpus = 0;
+    int32_t worker_priority = 0;
+    bool ext = false, worker = false;
 
     setbuf(stdout, NULL);
 
     struct sigaction int_act;
-    int_act.sa_handler = usbcandump_exit_handler;
+    memset(&int_act, 0, sizeof(int_act));
+    int_act.sa_handler = usbcanflood_exit_handler;
     sigaction(SIGINT, &int_act, NULL);
 
     const char *ch;
@@ -67,25 +816,176 @@ int main(int argc, char **argv) {
             break;
           GETOPT_OPTARG("--bus-dst") : bus_dst = atoi(optarg);
             break;
-          GETOPT_OPTARG("--delay_ms") : delay = atoi(optarg);
+          GETOPT_OPTARG("--speed") : kbps = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--rate") : rate = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--load") : load = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--duration") : duration = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--batch-size") : batch_size = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--id") :
+            if (!parse_range(optarg, &id_lo, &id_hi)) {
+                usage();
+            }
+            break;
+          GETOPT_OPT("--ext") : ext = true;
+            break;
+          GETOPT_OPTARG("--dlc") :
+            if (!parse_range(optarg, &dlc_lo, &dlc_hi) || dlc_lo < 3 ||
+                dlc_hi > 8) {
+                usage();
+            }
+            break;
+          GETOPT_OPTARG("--payload") :
+            if (strcmp(optarg, "random") == 0) {
+                payload = FLOOD_PAYLOAD_RANDOM;
+            } else if (strcmp(optarg, "zero") == 0) {
+                payload = FLOOD_PAYLOAD_ZERO;
+            } else if (strcmp(optarg, "ones") == 0) {
+                payload = FLOOD_PAYLOAD_ONES;
+            } else {
+                usage();
+            }
+            break;
+          GETOPT_OPTARG("--seed") : seed = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--rx") :
+            if (strcmp(optarg, "callback") == 0) {
+                rx_mode = FLOOD_RX_CALLBACK;
+            } else if (strcmp(optarg, "poll") == 0) {
+                rx_mode = FLOOD_RX_POLL;
+            } else if (strcmp(optarg, "queue") == 0) {
+                rx_mode = FLOOD_RX_QUEUE;
+            } else if (strcmp(optarg, "copy") == 0) {
+                rx_mode = FLOOD_RX_COPY;
+            } else if (strcmp(optarg, "retain") == 0) {
+                rx_mode = FLOOD_RX_RETAIN;
+            } else if (strcmp(optarg, "soa") == 0) {
+                rx_mode = FLOOD_RX_SOA;
+            } else {
+                usage();
+            }
+            break;
+          GETOPT_OPTARG("--slow-us") : slow_us = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--filter-churn") : churn.rate = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--capture") : capture_path = optarg;
+            break;
+          GETOPT_OPT("--compact") : capture_flags |= USBCAN_CAPTURE_COMPACT;
             break;
-          GETOPT_OPTARG("--batch_size") : batch_size = atoi(optarg);
+          GETOPT_OPT("--merge") : merge = true;
+            break;
+          GETOPT_OPTARG("--window") : merge_config.window_us = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--tick") : merge_config.tick_us = atoi(optarg);
+            break;
+          GETOPT_OPT("--scan") : scan.enabled = true;
+            break;
+          GETOPT_OPTARG("--pool-batches") : pool_batches = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--overload") :
+            overload = UINT32_MAX;
+            for (uint32_t i = USBCAN_OVERLOAD_BLOCK;
+                 i <= USBCAN_OVERLOAD_KEEP_LATEST; i++) {
+                if (strcmp(optarg, FLOOD_OVERLOADS[i]) == 0) {
+                    overload = i;
+                }
+            }
+            if (overload == UINT32_MAX) {
+                usage();
+            }
+            break;
+          GETOPT_OPTARG("--overload-len") : overload_len = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--reverse-rate") : reverse.rate = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--reverse-slow-us") :
+            reverse.slow_us = atoi(optarg);
+            break;
+          GETOPT_OPT("--worker") : worker = true;
+            break;
+          GETOPT_OPTARG("--worker-cpus") :
+            worker_cpus = strtoull(optarg, NULL, 0);
+            break;
+          GETOPT_OPTARG("--workers") : workers = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--worker-priority") :
+            worker_priority = atoi(optarg);
             break;
           GETOPT_DEFAULT:
             usage();
         }
     }
 
+    uint32_t speed = UINT32_MAX;
+    for (uint32_t i = 0; i < sizeof(FLOOD_SPEEDS) / sizeof(FLOOD_SPEEDS[0]);
+         i++) {
+        if (FLOOD_SPEEDS[i][0] == kbps) {
+            speed = FLOOD_SPEEDS[i][1];
+        }
+    }
+    if (speed == UINT32_MAX || batch_size == 0 || seed == 0 ||
+        ((merge || capture_path != NULL) && rx_mode != FLOOD_RX_CALLBACK)) {
+        usage();
+    }
+
+    // A load target becomes a frame rate using the mean frame length.
+    if (rate == 0) {
+        uint32_t bits = 0;
+        for (uint32_t dlc = dlc_lo; dlc <= dlc_hi; dlc++) {
+            bits += frame_bits(ext, dlc);
+        }
+        bits /= dlc_hi - dlc_lo + 1;
+        rate = (uint32_t)((uint64_t)kbps * 1000 * load / 100 / bits);
+    }
+    if (rate == 0) {
+        usage();
+    }
+
+    pthread_mutex_init(&handoff.lock, NULL);
+    pthread_cond_init(&handoff.cond, NULL);
+
     if (!usbcan_library_init()) {
         exit(-1);
     }
 
+    if (capture_path != NULL) {
+        capture = usbcan_capture_open(capture_path, 0, capture_flags);
+        if (capture == NULL) {
+            perror(capture_path);
+            exit(-1);
+        }
+    }
+
+    merged.dev = dev_dst;
+    merged.bus = bus_dst;
+    if (merge) {
+        merge_config.cb = usbcanflood_merged_callback;
+        merged.merge = usbcan_merge_open(&merge_config);
+        if (merged.merge == NULL) {
+            exit(-1);
+        }
+    }
+
     struct usbcan_bus_config config;
-    config.speed = GINKGO_CAN_SPEED_500KBPS; // CAN_SPEED_500KBPS;
+    memset(&config, 0, sizeof(config));
+    config.speed = speed;
     config.filters = NULL;
     config.num_filters = 0;
-    config.cb = usbcandump_null_callback;
+    config.cb = reverse.rate > 0 ? usbcanflood_reverse_callback
+                                 : usbcanflood_null_callback;
     config.arg = NULL;
+    if (merge && reverse.rate > 0) {
+        config.cb = usbcan_merge_callback;
+        config.arg = merged.merge;
+    }
+    config.flags = worker ? USBCAN_FLAG_WORKER : 0;
+    config.worker_cpus = worker_cpus;
+    config.worker_priority = worker_priority;
 
     if (!usbcan_init(dev_src, bus_src, &config)) {
         exit(-1);
@@ -95,9 +995,24 @@ int main(int argc, char **argv) {
         exit(-1);
     }
 
-    sleep(1);
-
-    config.cb = usbcandump_callback;
+    config.cb = merge ? usbcan_merge_callback : usbcanflood_callback;
+    config.arg = merged.merge;
+    config.overload = overload;
+    config.overload_len = overload_len;
+    config.workers = workers;
+    config.pool_batches = pool_batches;
+    if (rx_mode == FLOOD_RX_POLL) {
+        config.flags = USBCAN_FLAG_POLL;
+    } else if (rx_mode == FLOOD_RX_QUEUE) {
+        config.flags = USBCAN_FLAG_QUEUE;
+    } else if (rx_mode == FLOOD_RX_COPY || rx_mode == FLOOD_RX_RETAIN) {
+        config.cb = usbcanflood_handoff_callback;
+        config.flags |= rx_mode == FLOOD_RX_RETAIN ? USBCAN_FLAG_RETAIN : 0;
+        handoff.retain = rx_mode == FLOOD_RX_RETAIN;
+    } else if (rx_mode == FLOOD_RX_SOA) {
+        config.soa_cb = usbcanflood_soa_callback;
+        config.flags |= USBCAN_FLAG_SOA;
+    }
     if (!usbcan_init(dev_dst, bus_dst, &config)) {
         exit(-1);
     }
@@ -106,59 +1021,303 @@ int main(int argc, char **argv) {
         exit(-1);
     }
 
-    printf("Initialization complete: %u/%u -> %u/%u\n", dev_src, bus_src,
-           dev_dst, bus_dst);
+    receiver.dev = dev_dst;
+    receiver.bus = bus_dst;
+    receiver.running = true;
+    void *(*read)(void *) = rx_mode == FLOOD_RX_POLL ? usbcanflood_poll
+        : rx_mode == FLOOD_RX_QUEUE                   ? usbcanflood_drain
+                                                      : usbcanflood_consume;
+    if (rx_mode != FLOOD_RX_CALLBACK &&
+        pthread_create(&receiver.thread, NULL, read, NULL) != 0) {
+        exit(-1);
+    }
 
-    sleep(1);
+    printf("Sending %u frames/s for %u s: %u/%u -> %u/%u by %s, "
+           "overload %s%s",
+           rate, duration, dev_src, bus_src, dev_dst, bus_dst,
+           FLOOD_RX_MODES[rx_mode], FLOOD_OVERLOADS[overload],
+           worker ? ", worker" : "");
+    if (workers > 1) {
+        printf(", %u workers", workers);
+    }
+    printf("\n");
 
-    struct timespec ts;
-    ts.tv_sec = 0;
-    ts.tv_nsec = delay + 1000000;
+    struct can_frame *frames =
+        (struct can_frame *)calloc(batch_size, sizeof(struct can_frame));
+    uint64_t sent = 0, errors = 0, late = 0, seq = 0;
+    uint64_t start_us = now_us();
+    uint64_t end_us = start_us + (uint64_t)duration * 1000000;
+    uint64_t report_us = start_us + 1000000;
+    uint64_t report_sent = 0, report_received = 0;
 
-    struct timeval tv;
-    time_t last = 0;
+    churn.dev = dev_dst;
+    churn.bus = bus_dst;
+    churn.ext = ext;
+    churn.end_us = end_us;
+    if (churn.rate > 0 &&
+        pthread_create(&churn.thread, NULL, usbcanflood_churn, NULL) != 0) {
+        exit(-1);
+    }
 
-    if (gettimeofday(&tv, NULL) == 0) {
-        last = tv.tv_sec;
+    reverse.dev = dev_dst;
+    reverse.bus = bus_dst;
+    reverse.end_us = end_us;
+    if (reverse.rate > 0 &&
+        pthread_create(&reverse.thread, NULL, usbcanflood_reverse, NULL) !=
+        0) {
+        exit(-1);
     }
 
-    struct can_frame *frames =
-        (struct can_frame *)calloc(batch_size, sizeof(struct can_frame));
-    for (uint32_t f = 0; f < batch_size; f++) {
-        frames[f].can_id = 0x7FD;
-        frames[f].data[0] = 0x01;
-        frames[f].data[1] = 0x02;
-        frames[f].data[2] = 0x03;
-        frames[f].data[3] = 0x04;
-        frames[f].data[4] = 0x05;
-        frames[f].data[5] = 0x06;
-        frames[f].data[6] = 0x07;
-        frames[f].data[7] = 0x08;
-        frames[f].can_dlc = 8;
-    }
-
-    while (1) {
-        int sent = usbcan_send_n(dev_src, bus_src, frames, batch_size);
-        errors += batch_size - sent;
-        s_count += sent;
-        batches++;
-
-        gettimeofday(&tv, NULL);
-        if (tv.tv_sec > last) {
-            last = tv.tv_sec;
-            printf("Sent %u/%u (%u), received %u (%u)\n", s_count,
-                   s_count - errors, batches, r_count, r_batches);
-            s_count = 0;
-            batches = 0;
-            r_count = 0;
-            r_batches = 0;
-            errors = 0;
+    while (!stopping) {
+        // Batch k is due when frame k * batch_size is, so the mean rate
+        // holds however the sleeps land.
+        uint64_t due_us = start_us + seq * 1000000 / rate;
+        if (due_us >= end_us) {
+            break;
         }
 
-        nanosleep(&ts, NULL);
+        uint64_t now = now_us();
+        if (now < due_us) {
+            sleep_until(due_us);
+            now = now_us();
+        } else if (now - due_us > 1000) {
+            late++;
+        }
+
+        for (uint32_t f = 0; f < batch_size; f++) {
+            struct can_frame *frame = &frames[f];
+            uint32_t r = xorshift(&seed);
+
+            frame->can_id = id_lo + r % (id_hi - id_lo + 1);
+            frame->can_id |= ext ? CAN_EFF_FLAG : 0;
+            frame->can_dlc = dlc_lo + (r >> 16) % (dlc_hi - dlc_lo + 1);
+
+            uint32_t fill = payload == FLOOD_PAYLOAD_ONES ? 0xFF : 0;
+            for (int i = 0; i < 8; i++) {
+                frame->data[i] = payload == FLOOD_PAYLOAD_RANDOM
+                    ? xorshift(&seed) & 0xFF
+                    : fill;
+            }
+
+            uint64_t s = seq + f;
+            frame->data[0] = s & 0xFF;
+            frame->data[1] = (s >> 8) & 0xFF;
+            frame->data[2] = (s >> 16) & 0xFF;
+            frame->data[3] = now & 0xFF;
+            frame->data[4] = (now >> 8) & 0xFF;
+            frame->data[5] = (now >> 16) & 0xFF;
+        }
+
+        uint32_t n = usbcan_send_n(dev_src, bus_src, frames, batch_size);
+        errors += batch_size - n;
+        sent += n;
+        seq += batch_size;
+
+        if (now >= report_us) {
+            uint64_t received = __atomic_load_n(&rx.received, __ATOMIC_RELAXED);
+            printf("Sent %llu, received %llu\n",
+                   (unsigned long long)(sent - report_sent),
+                   (unsigned long long)(received - report_received));
+            report_sent = sent;
+            report_received = received;
+            report_us += 1000000;
+        }
     }
 
+    if (reverse.rate > 0) {
+        pthread_join(reverse.thread, NULL);
+    }
+    if (churn.rate > 0) {
+        pthread_join(churn.thread, NULL);
+    }
+
+    // A slow consumer may still be working through a backlog.
+    uint64_t elapsed_us = now_us() - start_us;
+    uint64_t drained;
+    do {
+        drained = __atomic_load_n(&rx.received, __ATOMIC_RELAXED) +
+            __atomic_load_n(&reverse.received, __ATOMIC_RELAXED);
+        usleep(FLOOD_DRAIN_US);
+    } while (!stopping &&
+             __atomic_load_n(&rx.received, __ATOMIC_RELAXED) +
+             __atomic_load_n(&reverse.received, __ATOMIC_RELAXED) !=
+             drained);
+    pthread_mutex_lock(&handoff.lock);
+    receiver.running = false;
+    pthread_cond_broadcast(&handoff.cond);
+    pthread_mutex_unlock(&handoff.lock);
+    if (rx_mode != FLOOD_RX_CALLBACK) {
+        pthread_join(receiver.thread, NULL);
+    }
+    usbcan_stop(dev_dst, bus_dst);
+    usbcan_stop(dev_src, bus_src);
+
+    struct usbcan_merge_stats merge_stats;
+    memset(&merge_stats, 0, sizeof(merge_stats));
+    if (merge) {
+        usbcan_merge_get_stats(merged.merge, &merge_stats);
+        usbcan_merge_close(merged.merge);
+    }
+    if (capture != NULL) {
+        if (usbcan_capture_close(capture)) {
+            report_capture(capture_path);
+        } else {
+            fprintf(stderr, "%s: capture not closed\n", capture_path);
+        }
+    }
+
+    struct usbcan_bus_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    usbcan_get_stats(dev_dst, bus_dst, &stats);
+    struct usbcan_bus_stats reverse_stats;
+    memset(&reverse_stats, 0, sizeof(reverse_stats));
+    usbcan_get_stats(dev_src, bus_src, &reverse_stats);
+
+    // Frames the adapter refused were never numbered on the bus, so only
+    // accepted frames count towards loss.
+    uint64_t lost = sent > rx.unique ? sent - rx.unique : 0;
+
+    printf("Sent %llu (%llu refused, %llu late batches) in %.3f s, "
+           "received %llu: %llu lost, %llu reordered, %llu duplicated\n",
+           (unsigned long long)sent, (unsigned long long)errors,
+           (unsigned long long)late, elapsed_us / 1e6,
+           (unsigned long long)rx.received, (unsigned long long)lost,
+           (unsigned long long)rx.reordered,
+           (unsigned long long)rx.duplicates);
+    printf("Latency us: p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+           (unsigned long long)percentile(0.5),
+           (unsigned long long)percentile(0.9),
+           (unsigned long long)percentile(0.99),
+           (unsigned long long)percentile(0.999),
+           (unsigned long long)rx.latency_max);
+    printf("Dropped %llu: %llu evicted, %llu rejected, %llu replaced; "
+           "%llu stalls, %llu adapter overflows\n",
+           (unsigned long long)stats.dropped,
+           (unsigned long long)stats.evicted,
+           (unsigned long long)stats.rejected,
+           (unsigned long long)stats.replaced,
+           (unsigned long long)stats.stalls,
+           (unsigned long long)stats.overflows);
+    // What the reverse bus neither delivered nor dropped was lost before
+    // the library saw it, whether or not an overflow was detected.
+    uint64_t reverse_lost =
+        reverse.sent > reverse.received + reverse_stats.dropped
+        ? reverse.sent - reverse.received - reverse_stats.dropped
+        : 0;
+    if (reverse.rate > 0) {
+        printf("Reverse: sent %llu, received %llu, %llu dropped by the "
+               "worker, %llu lost before it (%llu overflows seen)\n",
+               (unsigned long long)reverse.sent,
+               (unsigned long long)reverse.received,
+               (unsigned long long)reverse_stats.dropped,
+               (unsigned long long)reverse_lost,
+               (unsigned long long)reverse_stats.overflows);
+    }
+    if (rx_mode == FLOOD_RX_COPY || rx_mode == FLOOD_RX_RETAIN) {
+        printf("Handed off %llu batches retained, %llu copied (%llu bytes), "
+               "%llu frames dropped; pool exhausted by %llu frames\n",
+               (unsigned long long)handoff.retained,
+               (unsigned long long)handoff.copied,
+               (unsigned long long)handoff.copied_bytes,
+               (unsigned long long)handoff.dropped,
+               (unsigned long long)stats.exhausted);
+    }
+    if (churn.rate > 0) {
+        printf("Filter changes: %llu (%llu failed), first %.2f ms, then "
+               "%.2f ms mean, %.2f ms max\n",
+               (unsigned long long)churn.changes,
+               (unsigned long long)churn.failed, churn.first_us / 1e3,
+               churn.changes > 1
+                   ? churn.total_us / 1e3 / (churn.changes - 1)
+                   : 0,
+               churn.max_us / 1e3);
+    }
+    if (merge) {
+        printf("Merged: %llu received, %llu delivered, %llu dropped, "
+               "%llu late\n",
+               (unsigned long long)merge_stats.received,
+               (unsigned long long)merge_stats.delivered,
+               (unsigned long long)merge_stats.dropped,
+               (unsigned long long)merge_stats.late);
+    }
+    if (scan.enabled) {
+        printf("Scan: %llu frames in %llu batches, %.2f ns each (%llu low "
+               "IDs, payload XOR %016llx)\n",
+               (unsigned long long)scan.frames,
+               (unsigned long long)scan.batches,
+               scan.frames > 0 ? (double)scan.ns / scan.frames : 0,
+               (unsigned long long)scan.low_ids,
+               (unsigned long long)scan.xor);
+    }
+    if (rx_mode == FLOOD_RX_QUEUE) {
+        printf("Wakeups: %llu, %.0f/s, %.1f frames each\n",
+               (unsigned long long)receiver.wakeups,
+               receiver.wakeups / (elapsed_us / 1e6),
+               receiver.wakeups > 0 ? (double)rx.received / receiver.wakeups
+                                    : 0);
+    }
+    printf("{\"rx\":\"%s\",\"overload\":\"%s\",\"slow_us\":%u,"
+           "\"worker\":%s,\"workers\":%u,"
+           "\"reverse\":{\"rate\":%u,\"slow_us\":%u,"
+           "\"sent\":%llu,\"received\":%llu,\"dropped\":%llu,"
+           "\"lost\":%llu},"
+           "\"wakeups\":%llu,\"retained\":%llu,\"copied\":%llu,"
+           "\"copied_bytes\":%llu,\"exhausted\":%llu,"
+           "\"scan_frames\":%llu,\"scan_ns\":%llu,"
+           "\"filter_changes\":%llu,\"filter_change_us\":%llu,"
+           "\"merge\":{\"window_us\":%u,\"received\":%llu,\"delivered\":%llu,"
+           "\"dropped\":%llu,\"late\":%llu},\"rate\":%u,"
+           "\"duration_us\":%llu,\"sent\":%llu,\"refused\":%llu,"
+           "\"late\":%llu,\"received\":%llu,\"unique\":%llu,\"lost\":%llu,"
+           "\"reordered\":%llu,\"duplicates\":%llu,\"foreign\":%llu,"
+           "\"overflows\":%llu,\"dropped\":%llu,\"evicted\":%llu,"
+           "\"rejected\":%llu,\"replaced\":%llu,\"stalls\":%llu,"
+           "\"latency_us\":{\"n\":%llu,\"p50\":%llu,"
+           "\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu,"
+           "\"over_100ms\":%llu}}\n",
+           FLOOD_RX_MODES[rx_mode], FLOOD_OVERLOADS[overload], slow_us,
+           worker ? "true" : "false", workers > 1 ? workers : 1,
+           reverse.rate, reverse.slow_us,
+           (unsigned long long)reverse.sent,
+           (unsigned long long)reverse.received,
+           (unsigned long long)reverse_stats.dropped,
+           (unsigned long long)reverse_lost,
+           (unsigned long long)receiver.wakeups,
+           (unsigned long long)handoff.retained,
+           (unsigned long long)handoff.copied,
+           (unsigned long long)handoff.copied_bytes,
+           (unsigned long long)stats.exhausted,
+           (unsigned long long)scan.frames, (unsigned long long)scan.ns,
+           (unsigned long long)churn.changes,
+           (unsigned long long)(churn.first_us + churn.total_us),
+           merge ? (merge_config.window_us > 0 ? merge_config.window_us
+                                               : USBCAN_MERGE_WINDOW_US)
+                 : 0,
+           (unsigned long long)merge_stats.received,
+           (unsigned long long)merge_stats.delivered,
+           (unsigned long long)merge_stats.dropped,
+           (unsigned long long)merge_stats.late, rate,
+           (unsigned long long)elapsed_us, (unsigned long long)sent,
+           (unsigned long long)errors, (unsigned long long)late,
+           (unsigned long long)rx.received, (unsigned long long)rx.unique,
+           (unsigned long long)lost, (unsigned long long)rx.reordered,
+           (unsigned long long)rx.duplicates, (unsigned long long)rx.foreign,
+           (unsigned long long)stats.overflows,
+           (unsigned long long)stats.dropped,
+           (unsigned long long)stats.evicted,
+           (unsigned long long)stats.rejected,
+           (unsigned long long)stats.replaced,
+           (unsigned long long)stats.stalls,
+           (unsigned long long)rx.latency_n,
+           (unsigned long long)percentile(0.5),
+           (unsigned long long)percentile(0.9),
+           (unsigned long long)percentile(0.99),
+           (unsigned long long)percentile(0.999),
+           (unsigned long long)rx.latency_max,
+           (unsigned long long)rx.latency_over);
+
     free(frames);
+    usbcan_library_close();
 
     return 0;
 }
@@ -0,0 +1,370 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "getopt.h"
+#include "usbcan.h"
+
+/*
+  Sends from one thread per bus, as fast as the buses take frames, on 1,
+  2, 4 and so on up to every bus, and reports the aggregate send rate of
+  each step against a single bus's. Every bus also receives, so each
+  step runs callbacks on the driver threads concurrently with the sends.
+
+  With --churn another thread keeps stopping and re-initializing the
+  buses under load, giving each incarnation a fresh callback argument
+  that it poisons as soon as usbcan_stop returns; a callback that runs
+  after its bus was stopped finds the poison and is counted as stale.
+  Poisoned arguments are kept until the library is closed, so none is
+  handed out again while a stale callback could still read it. The
+  library is closed while frames are still arriving.
+
+  Bringing the buses up is timed. With --init-all they are bound to
+  their adapters by serial number and brought up with usbcan_init_all,
+  after the adapters' board information is read, which is timed too.
+*/
+
+#define STRESS_MAGIC 0x5354524553534152ULL
+
+static const uint32_t STRESS_SPEEDS[][2] = {
+    // kbit/s, speed
+    {1000, CAN_SPEED_1000KBPS}, {500, CAN_SPEED_500KBPS},
+    {250, CAN_SPEED_250KBPS},   {125, CAN_SPEED_125KBPS},
+    {100, CAN_SPEED_100KBPS},   {83, CAN_SPEED_83KBPS},
+    {50, CAN_SPEED_50KBPS},     {20, CAN_SPEED_20KBPS},
+    {10, CAN_SPEED_10KBPS},
+};
+
+struct stress_arg {
+    volatile uint64_t magic;
+    uint64_t received;
+    struct stress_arg *retired; // next in the retired list
+};
+
+struct stress_sender {
+    pthread_t thread;
+    uint32_t dev;
+    uint32_t bus;
+    uint32_t batch_size;
+    uint64_t end_us;
+    uint64_t sent;
+    uint64_t refused;
+};
+
+static struct usbcan_bus_config config;
+static uint32_t num_buses = 0;
+static struct stress_arg **args;
+static struct stress_arg *retired = NULL;
+static volatile bool churning = false;
+static uint64_t received = 0, stale = 0, restarts = 0;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void usbcanstress_callback(uint32_t dev, uint32_t bus, struct usbcan_msg *msgs,
+                           uint32_t n, void *arg) {
+#pragma unused(dev)
+#pragma unused(bus)
+#pragma unused(msgs)
+
+    struct stress_arg *a = (struct stress_arg *)arg;
+    if (a->magic != STRESS_MAGIC) {
+        __atomic_fetch_add(&stale, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    a->received += n;
+    __atomic_fetch_add(&received, n, __ATOMIC_RELAXED);
+}
+
+// Starts bus i with a fresh callback argument.
+static bool stress_start(uint32_t i) {
+    struct stress_arg *a =
+        (struct stress_arg *)calloc(1, sizeof(struct stress_arg));
+    if (a == NULL) {
+        return false;
+    }
+    a->magic = STRESS_MAGIC;
+    args[i] = a;
+
+    config.arg = a;
+    return usbcan_init(i / MAX_BUSES, i % MAX_BUSES, &config) &&
+        usbcan_start(i / MAX_BUSES, i % MAX_BUSES);
+}
+
+// Brings every bus up through usbcan_init_all, bound by serial number.
+static bool stress_start_all() {
+    uint32_t num_devs = num_buses / MAX_BUSES;
+    struct usbcan_dev_info *infos = (struct usbcan_dev_info *)calloc(
+        num_devs, sizeof(struct usbcan_dev_info));
+    struct usbcan_bus_config *configs = (struct usbcan_bus_config *)calloc(
+        num_buses, sizeof(struct usbcan_bus_config));
+    struct usbcan_bus_init *inits = (struct usbcan_bus_init *)calloc(
+        num_buses, sizeof(struct usbcan_bus_init));
+    bool status = infos != NULL && configs != NULL && inits != NULL;
+
+    for (uint32_t dev = 0; status && dev < num_devs; dev++) {
+        status = usbcan_get_dev_info(dev, &infos[dev]);
+    }
+
+    for (uint32_t i = 0; status && i < num_buses; i++) {
+        struct stress_arg *a =
+            (struct stress_arg *)calloc(1, sizeof(struct stress_arg));
+        if (a == NULL) {
+            status = false;
+            break;
+        }
+        a->magic = STRESS_MAGIC;
+        args[i] = a;
+
+        configs[i] = config;
+        configs[i].arg = a;
+        inits[i].serial = infos[i / MAX_BUSES].serial;
+        inits[i].bus = i % MAX_BUSES;
+        inits[i].config = &configs[i];
+    }
+
+    status = status && usbcan_init_all(inits, num_buses);
+    for (uint32_t i = 0; status && i < num_buses; i++) {
+        status = usbcan_start(i / MAX_BUSES, i % MAX_BUSES);
+    }
+
+    free(inits);
+    free(configs);
+    free(infos);
+
+    return status;
+}
+
+// Stops bus i; no callback may see its argument afterwards.
+static void stress_stop(uint32_t i) {
+    usbcan_stop(i / MAX_BUSES, i % MAX_BUSES);
+
+    if (args[i] != NULL) {
+        args[i]->magic = 0;
+        args[i]->retired = retired;
+        retired = args[i];
+        args[i] = NULL;
+    }
+}
+
+static void *stress_send(void *arg) {
+    struct stress_sender *s = (struct stress_sender *)arg;
+
+    struct can_frame *frames =
+        (struct can_frame *)calloc(s->batch_size, sizeof(struct can_frame));
+    if (frames == NULL) {
+        return NULL;
+    }
+
+    uint32_t id = 0x100 + ((s->dev * MAX_BUSES + s->bus) << 4);
+    for (uint32_t f = 0; f < s->batch_size; f++) {
+        frames[f].can_id = id + f % 16;
+        frames[f].can_dlc = 8;
+    }
+
+    while (now_us() < s->end_us) {
+        uint32_t n = usbcan_send_n(s->dev, s->bus, frames, s->batch_size);
+        s->sent += n;
+        s->refused += s->batch_size - n;
+    }
+
+    free(frames);
+
+    return NULL;
+}
+
+static void *stress_churn(void *arg) {
+#pragma unused(arg)
+
+    uint32_t i = 0;
+    while (churning) {
+        stress_stop(i);
+        if (!stress_start(i)) {
+            fprintf(stderr, "Failed to restart %u/%u\n", i / MAX_BUSES,
+                    i % MAX_BUSES);
+        }
+        restarts++;
+        i = (i + 1) % num_buses;
+        usleep(1000);
+    }
+
+    return NULL;
+}
+
+void usage() {
+    fprintf(stderr,
+            "usage: usbcanstress [options]\n"
+            "  --buses N          most buses to send on (all)\n"
+            "  --speed KBPS       bit rate (1000)\n"
+            "  --duration S       seconds per step (5)\n"
+            "  --batch-size N     frames per send call (16)\n"
+            "  --churn            stop and restart buses under load\n"
+            "  --init-all         bring buses up by serial, concurrently\n");
+    exit(-1);
+}
+
+int main(int argc, char **argv) {
+    uint32_t max_buses = 0, kbps = 1000, duration = 5, batch_size = 16;
+    bool churn = false, init_all = false;
+
+    setbuf(stdout, NULL);
+
+    const char *ch;
+    while ((ch = GETOPT(argc, argv)) != NULL) {
+        GETOPT_SWITCH(ch) {
+          GETOPT_OPTARG("--buses") : max_buses = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--speed") : kbps = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--duration") : duration = atoi(optarg);
+            break;
+          GETOPT_OPTARG("--batch-size") : batch_size = atoi(optarg);
+            break;
+          GETOPT_OPT("--churn") : churn = true;
+            break;
+          GETOPT_OPT("--init-all") : init_all = true;
+            break;
+          GETOPT_DEFAULT:
+            usage();
+        }
+    }
+
+    uint32_t speed = UINT32_MAX;
+    for (uint32_t i = 0; i < sizeof(STRESS_SPEEDS) / sizeof(STRESS_SPEEDS[0]);
+         i++) {
+        if (STRESS_SPEEDS[i][0] == kbps) {
+            speed = STRESS_SPEEDS[i][1];
+        }
+    }
+    if (speed == UINT32_MAX || batch_size == 0 || duration == 0) {
+        usage();
+    }
+
+    uint64_t scan_us = now_us();
+    if (!usbcan_library_init()) {
+        exit(-1);
+    }
+
+    num_buses = usbcan_num_devs() * MAX_BUSES;
+    scan_us = now_us() - scan_us;
+    if (max_buses == 0 || max_buses > num_buses) {
+        max_buses = num_buses;
+    }
+
+    args = (struct stress_arg **)calloc(num_buses, sizeof(*args));
+    struct stress_sender *senders = (struct stress_sender *)calloc(
+        max_buses, sizeof(struct stress_sender));
+    if (args == NULL || senders == NULL) {
+        exit(-1);
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.speed = speed;
+    config.cb = usbcanstress_callback;
+
+    uint64_t init_us = now_us();
+    if (init_all) {
+        struct usbcan_dev_info info;
+        if (num_buses == 0 || !usbcan_get_dev_info(0, &info)) {
+            exit(-1);
+        }
+        uint64_t enumerate_us = now_us() - init_us;
+        printf("Found %u adapters in %.1f ms, read their board info in "
+               "%.1f ms\n",
+               num_buses / MAX_BUSES, scan_us / 1e3, enumerate_us / 1e3);
+
+        init_us = now_us();
+        if (!stress_start_all()) {
+            exit(-1);
+        }
+    } else {
+        printf("Found %u adapters in %.1f ms\n", num_buses / MAX_BUSES,
+               scan_us / 1e3);
+        for (uint32_t i = 0; i < num_buses; i++) {
+            if (!stress_start(i)) {
+                exit(-1);
+            }
+        }
+    }
+    printf("Brought %u buses up %s in %.1f ms\n", num_buses,
+           init_all ? "by serial, concurrently" : "in turn",
+           (now_us() - init_us) / 1e3);
+
+    pthread_t churner;
+    churning = churn;
+    if (churn && pthread_create(&churner, NULL, stress_churn, NULL) != 0) {
+        exit(-1);
+    }
+
+    double base = 0;
+    for (uint32_t step = 1;;) {
+        uint64_t start_us = now_us();
+        for (uint32_t i = 0; i < step; i++) {
+            struct stress_sender *s = &senders[i];
+            memset(s, 0, sizeof(*s));
+            s->dev = i / MAX_BUSES;
+            s->bus = i % MAX_BUSES;
+            s->batch_size = batch_size;
+            s->end_us = start_us + (uint64_t)duration * 1000000;
+            if (pthread_create(&s->thread, NULL, stress_send, s) != 0) {
+                exit(-1);
+            }
+        }
+
+        uint64_t sent = 0, refused = 0;
+        for (uint32_t i = 0; i < step; i++) {
+            pthread_join(senders[i].thread, NULL);
+            sent += senders[i].sent;
+            refused += senders[i].refused;
+        }
+
+        double rate = sent / ((now_us() - start_us) / 1e6);
+        if (base == 0) {
+            base = rate;
+        }
+        printf("%u buses: %.0f frames/s (%.2fx), %llu refused\n", step, rate,
+               base > 0 ? rate / base : 0, (unsigned long long)refused);
+
+        if (step == max_buses) {
+            break;
+        }
+        step = step * 2 < max_buses ? step * 2 : max_buses;
+    }
+
+    if (churn) {
+        churning = false;
+        pthread_join(churner, NULL);
+    }
+
+    // Frames sent in the last step are still being received.
+    bool closed = usbcan_library_close();
+    uint64_t stale_after = __atomic_load_n(&stale, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < num_buses; i++) {
+        free(args[i]);
+    }
+    while (retired != NULL) {
+        struct stress_arg *a = retired;
+        retired = a->retired;
+        free(a);
+    }
+
+    printf("Received %llu, %llu restarts, %llu stale callbacks, close %s\n",
+           (unsigned long long)__atomic_load_n(&received, __ATOMIC_RELAXED),
+           (unsigned long long)restarts, (unsigned long long)stale_after,
+           closed ? "ok" : "failed");
+
+    free(senders);
+    free(args);
+
+    return stale_after == 0 && closed ? 0 : 1;
+}